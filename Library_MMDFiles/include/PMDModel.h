@@ -119,6 +119,16 @@ private:
    unsigned short *m_surfaceListForEdge;     /* surface list on which toon edge will be drawn per material */
    TexCoord *m_toonTexCoordListForShadowMap; /* texture coordinates for toon shading on shadow mapping */
 
+   /* work area for skipping vertices whose bones did not move */
+   btTransform *m_boneSkinningTransCache; /* transform matrices of bones at the last skinning */
+   bool *m_boneSkinningChanged;           /* true if the transform matrix of a bone changed since the last skinning */
+   bool m_skinningCacheValid;             /* true when skinned vertices are up to date with the cached matrices */
+   unsigned int m_numSkinGroup;           /* number of vertex groups weighted to the same bones */
+   unsigned int *m_skinGroupIndex;        /* first index of each group in m_skinGroupVertexList, plus the total */
+   unsigned int *m_skinGroupVertexList;   /* vertex indices sorted by group */
+   unsigned short *m_skinGroupBoneList;   /* 2 bones of each group, the same twice if a single one moves it */
+   bool *m_skinGroupMorphed;              /* true if the group holds vertices moved by faces, skinned every time */
+
    /* flags and short lists extracted from the model data */
    PMDBone *m_centerBone;              /* center bone */
    PMDFace *m_baseFace;                /* base face definition */
@@ -158,6 +168,9 @@ private:
    /* clear: free PMDModel */
    void clear();
 
+   /* setupSkinGroup: group vertices by the bones they are weighted to */
+   void setupSkinGroup();
+
 public:
 
    /* PMDModel: constructor */
@@ -84,6 +84,9 @@ public:
    /* add: add this face morph to model vertices with a certain rate */
    void add(btVector3 *vertexList, float rate);
 
+   /* setVertexFlag: set flag of model vertices controlled by this face */
+   void setVertexFlag(bool *flagList);
+
    /* getName: get name */
    char *getName();
 
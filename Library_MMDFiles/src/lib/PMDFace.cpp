@@ -156,6 +156,18 @@ void PMDFace::add(btVector3 *vertexList, float rate)
       vertexList[m_vertex[i].id] += m_vertex[i].pos * rate;
 }
 
+/* PMDFace::setVertexFlag: set flag of model vertices controlled by this face */
+void PMDFace::setVertexFlag(bool *flagList)
+{
+   unsigned long i;
+
+   if (m_vertex == NULL)
+      return;
+
+   for (i = 0; i < m_numVertex; i++)
+      flagList[m_vertex[i].id] = true;
+}
+
 /* PMDFace::getName: get name */
 char *PMDFace::getName()
 {
@@ -95,6 +95,15 @@ void PMDModel::initialize()
    m_surfaceListForEdge = NULL;
    m_toonTexCoordListForShadowMap = NULL;
 
+   m_boneSkinningTransCache = NULL;
+   m_boneSkinningChanged = NULL;
+   m_skinningCacheValid = false;
+   m_numSkinGroup = 0;
+   m_skinGroupIndex = NULL;
+   m_skinGroupVertexList = NULL;
+   m_skinGroupBoneList = NULL;
+   m_skinGroupMorphed = NULL;
+
    m_centerBone = NULL;
    m_baseFace = NULL;
    m_orderedBoneList = NULL;
@@ -174,6 +183,18 @@ void PMDModel::clear()
       free(m_surfaceListForEdge);
    if (m_toonTexCoordListForShadowMap)
       free(m_toonTexCoordListForShadowMap);
+   if (m_boneSkinningTransCache)
+      delete [] m_boneSkinningTransCache;
+   if (m_boneSkinningChanged)
+      free(m_boneSkinningChanged);
+   if (m_skinGroupIndex)
+      free(m_skinGroupIndex);
+   if (m_skinGroupVertexList)
+      free(m_skinGroupVertexList);
+   if (m_skinGroupBoneList)
+      free(m_skinGroupBoneList);
+   if (m_skinGroupMorphed)
+      free(m_skinGroupMorphed);
    if (m_orderedBoneList)
       free(m_orderedBoneList);
    if (m_rotateBoneIDList)
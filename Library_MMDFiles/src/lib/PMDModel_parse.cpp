@@ -43,6 +43,31 @@
 
 #include "MMDFiles.h"
 
+/* SkinGroupEntry: vertex with the key of its skinning group */
+typedef struct {
+   bool morphed;
+   unsigned short bone1;
+   unsigned short bone2;
+   unsigned int id;
+} SkinGroupEntry;
+
+/* compareSkinGroupEntry: qsort function for grouping vertices */
+static int compareSkinGroupEntry(const void *a, const void *b)
+{
+   SkinGroupEntry *x = (SkinGroupEntry *) a;
+   SkinGroupEntry *y = (SkinGroupEntry *) b;
+
+   if (x->morphed != y->morphed)
+      return x->morphed ? 1 : -1;
+   if (x->bone1 != y->bone1)
+      return x->bone1 > y->bone1 ? 1 : -1;
+   if (x->bone2 != y->bone2)
+      return x->bone2 > y->bone2 ? 1 : -1;
+   if (x->id != y->id)
+      return x->id > y->id ? 1 : -1;
+   return 0;
+}
+
 /* PMDModel::parse: initialize and load from data memories */
 bool PMDModel::parse(const unsigned char *data, unsigned long size, BulletPhysics *bullet, SystemTexture *systex, const char *dir)
 {
@@ -386,6 +411,8 @@ bool PMDModel::parse(const unsigned char *data, unsigned long size, BulletPhysic
    m_toonTexCoordList = (TexCoord *) malloc(sizeof(TexCoord) * m_numVertex);
    /* calculated Vertex positions for toon edge drawing */
    m_edgeVertexList = new btVector3[m_numVertex];
+   /* vertex groups and transforms to skip skinning of vertices whose bones did not move */
+   setupSkinGroup();
    /* initialize material order */
    m_materialRenderOrder = new unsigned int[m_numMaterial];
    m_materialDistance = new MaterialDistanceData[m_numMaterial];
@@ -491,3 +518,72 @@ bool PMDModel::parse(const unsigned char *data, unsigned long size, BulletPhysic
 
    return true;
 }
+
+/* PMDModel::setupSkinGroup: group vertices by the bones they are weighted to */
+void PMDModel::setupSkinGroup()
+{
+   unsigned int i;
+   unsigned short j;
+   bool *morphed;
+   SkinGroupEntry *entry;
+
+   m_boneSkinningTransCache = new btTransform[m_numBone];
+   m_boneSkinningChanged = (bool *) malloc(sizeof(bool) * m_numBone);
+   for (j = 0; j < m_numBone; j++)
+      m_boneSkinningChanged[j] = true;
+   m_skinningCacheValid = false;
+
+   m_numSkinGroup = 0;
+   if (m_numVertex == 0)
+      return;
+
+   /* vertices moved by faces change without their bones moving */
+   morphed = (bool *) malloc(sizeof(bool) * m_numVertex);
+   for (i = 0; i < m_numVertex; i++)
+      morphed[i] = false;
+   if (m_baseFace)
+      m_baseFace->setVertexFlag(morphed);
+
+   /* sort vertices by the bones which actually move them */
+   entry = (SkinGroupEntry *) malloc(sizeof(SkinGroupEntry) * m_numVertex);
+   for (i = 0; i < m_numVertex; i++) {
+      entry[i].morphed = morphed[i];
+      if (m_boneWeight1[i] >= 1.0f - PMDMODEL_MINBONEWEIGHT) {
+         entry[i].bone1 = entry[i].bone2 = m_bone1List[i];
+      } else if (m_boneWeight1[i] <= PMDMODEL_MINBONEWEIGHT) {
+         entry[i].bone1 = entry[i].bone2 = m_bone2List[i];
+      } else {
+         entry[i].bone1 = m_bone1List[i];
+         entry[i].bone2 = m_bone2List[i];
+      }
+      entry[i].id = i;
+   }
+   qsort(entry, m_numVertex, sizeof(SkinGroupEntry), compareSkinGroupEntry);
+
+   /* count groups */
+   m_numSkinGroup = 1;
+   for (i = 1; i < m_numVertex; i++)
+      if (entry[i - 1].morphed != entry[i].morphed || entry[i - 1].bone1 != entry[i].bone1 || entry[i - 1].bone2 != entry[i].bone2)
+         m_numSkinGroup++;
+
+   /* store groups */
+   m_skinGroupIndex = (unsigned int *) malloc(sizeof(unsigned int) * (m_numSkinGroup + 1));
+   m_skinGroupVertexList = (unsigned int *) malloc(sizeof(unsigned int) * m_numVertex);
+   m_skinGroupBoneList = (unsigned short *) malloc(sizeof(unsigned short) * m_numSkinGroup * 2);
+   m_skinGroupMorphed = (bool *) malloc(sizeof(bool) * m_numSkinGroup);
+   m_numSkinGroup = 0;
+   for (i = 0; i < m_numVertex; i++) {
+      if (i == 0 || entry[i - 1].morphed != entry[i].morphed || entry[i - 1].bone1 != entry[i].bone1 || entry[i - 1].bone2 != entry[i].bone2) {
+         m_skinGroupIndex[m_numSkinGroup] = i;
+         m_skinGroupBoneList[m_numSkinGroup * 2] = entry[i].bone1;
+         m_skinGroupBoneList[m_numSkinGroup * 2 + 1] = entry[i].bone2;
+         m_skinGroupMorphed[m_numSkinGroup] = entry[i].morphed;
+         m_numSkinGroup++;
+      }
+      m_skinGroupVertexList[i] = entry[i].id;
+   }
+   m_skinGroupIndex[m_numSkinGroup] = m_numVertex;
+
+   free(entry);
+   free(morphed);
+}
@@ -112,33 +112,46 @@ void PMDModel::updateFace()
 void PMDModel::updateSkin()
 {
    unsigned short i;
-   unsigned int j;
+   unsigned int j, k, g;
    btVector3 v, v2, n, n2;
 
-   /* calculate transform matrix for skinning (global -> local) */
-   for (i = 0; i < m_numBone; i++)
+   /* calculate transform matrix for skinning (global -> local) and check which ones changed */
+   for (i = 0; i < m_numBone; i++) {
       m_boneList[i].calcSkinningTrans(&(m_boneSkinningTrans[i]));
-
-   /* do skinning */
-   for (j = 0; j < m_numVertex; j++) {
-      if (m_boneWeight1[j] >= 1.0f - PMDMODEL_MINBONEWEIGHT) {
-         /* bone 1 */
-         m_skinnedVertexList[j] = m_boneSkinningTrans[m_bone1List[j]] * m_vertexList[j];
-         m_skinnedNormalList[j] = m_boneSkinningTrans[m_bone1List[j]].getBasis() * m_normalList[j];
-      } else if (m_boneWeight1[j] <= PMDMODEL_MINBONEWEIGHT) {
-         /* bone 2 */
-         m_skinnedVertexList[j] = m_boneSkinningTrans[m_bone2List[j]] * m_vertexList[j];
-         m_skinnedNormalList[j] = m_boneSkinningTrans[m_bone2List[j]].getBasis() * m_normalList[j];
+      if (m_skinningCacheValid == false || memcmp(&(m_boneSkinningTrans[i]), &(m_boneSkinningTransCache[i]), sizeof(btTransform)) != 0) {
+         m_boneSkinningTransCache[i] = m_boneSkinningTrans[i];
+         m_boneSkinningChanged[i] = true;
       } else {
-         /* lerp */
-         v = m_boneSkinningTrans[m_bone1List[j]] * m_vertexList[j];
-         n = m_boneSkinningTrans[m_bone1List[j]].getBasis() * m_normalList[j];
-         v2 = m_boneSkinningTrans[m_bone2List[j]] * m_vertexList[j];
-         n2 = m_boneSkinningTrans[m_bone2List[j]].getBasis() * m_normalList[j];
-         m_skinnedVertexList[j] = v2.lerp(v, m_boneWeight1[j]);
-         m_skinnedNormalList[j] = n2.lerp(n, m_boneWeight1[j]);
+         m_boneSkinningChanged[i] = false;
+      }
+   }
+
+   /* do skinning, skipping groups whose bones did not move */
+   for (g = 0; g < m_numSkinGroup; g++) {
+      if (m_skinningCacheValid == true && m_skinGroupMorphed[g] == false && m_boneSkinningChanged[m_skinGroupBoneList[g * 2]] == false && m_boneSkinningChanged[m_skinGroupBoneList[g * 2 + 1]] == false)
+         continue;
+      for (k = m_skinGroupIndex[g]; k < m_skinGroupIndex[g + 1]; k++) {
+         j = m_skinGroupVertexList[k];
+         if (m_boneWeight1[j] >= 1.0f - PMDMODEL_MINBONEWEIGHT) {
+            /* bone 1 */
+            m_skinnedVertexList[j] = m_boneSkinningTrans[m_bone1List[j]] * m_vertexList[j];
+            m_skinnedNormalList[j] = m_boneSkinningTrans[m_bone1List[j]].getBasis() * m_normalList[j];
+         } else if (m_boneWeight1[j] <= PMDMODEL_MINBONEWEIGHT) {
+            /* bone 2 */
+            m_skinnedVertexList[j] = m_boneSkinningTrans[m_bone2List[j]] * m_vertexList[j];
+            m_skinnedNormalList[j] = m_boneSkinningTrans[m_bone2List[j]].getBasis() * m_normalList[j];
+         } else {
+            /* lerp */
+            v = m_boneSkinningTrans[m_bone1List[j]] * m_vertexList[j];
+            n = m_boneSkinningTrans[m_bone1List[j]].getBasis() * m_normalList[j];
+            v2 = m_boneSkinningTrans[m_bone2List[j]] * m_vertexList[j];
+            n2 = m_boneSkinningTrans[m_bone2List[j]].getBasis() * m_normalList[j];
+            m_skinnedVertexList[j] = v2.lerp(v, m_boneWeight1[j]);
+            m_skinnedNormalList[j] = n2.lerp(n, m_boneWeight1[j]);
+         }
       }
    }
+   m_skinningCacheValid = true;
 }
 
 /* PMDModel::updateToon: update toon coordinates and edge vertices */
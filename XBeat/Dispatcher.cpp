@@ -14,7 +14,10 @@
 //===-----------------------------------------------------------------------------===//
 
 #include "Dispatcher.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <memory>
 
 Dispatcher::Dispatcher()
 {
@@ -59,6 +62,50 @@ void Dispatcher::addTask(std::function<void(void)> Task)
 	SynchronizingCondition.notify_one();
 }
 
+void Dispatcher::parallelFor(size_t Count, std::function<void(size_t)> Body)
+{
+	struct SharedState {
+		std::function<void(size_t)> Body;
+		size_t Count;
+		std::atomic<size_t> Next;
+		std::atomic<size_t> Finished;
+		std::mutex Synchronizer;
+		std::condition_variable Done;
+
+		void work() {
+			size_t Index;
+			while ((Index = Next++) < Count) {
+				Body(Index);
+
+				if (++Finished == Count) {
+					std::lock_guard<std::mutex> Lock(Synchronizer);
+					Done.notify_all();
+				}
+			}
+		}
+	};
+
+	if (Count == 0)
+		return;
+
+	// Helpers that start after everything is done find no index left, so the state
+	// must outlive this call
+	auto State = std::make_shared<SharedState>();
+	State->Body = Body;
+	State->Count = Count;
+	State->Next = 0;
+	State->Finished = 0;
+
+	size_t Helpers = std::min<size_t>(ThreadPool.size(), Count - 1);
+	for (size_t i = 0; i < Helpers; ++i)
+		addTask([State] { State->work(); });
+
+	State->work();
+
+	std::unique_lock<std::mutex> Lock(State->Synchronizer);
+	while (State->Finished < Count) State->Done.wait(Lock);
+}
+
 void Dispatcher::consumeTask()
 {
 	while (Run) {
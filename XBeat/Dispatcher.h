@@ -37,6 +37,15 @@ public:
 	/// \brief Adds a task to the queue
 	void addTask(std::function<void(void)> Task);
 
+	/// \brief Runs Body once for every index in [0, Count) and waits for all of them
+	///
+	/// The calling thread takes part in the work, so this may safely be called from a
+	/// task running on the dispatcher itself.
+	///
+	/// \param [in] Count The amount of indices to run Body for
+	/// \param [in] Body The function to be run, it must not throw
+	void parallelFor(size_t Count, std::function<void(size_t)> Body);
+
 private:
 	/// \brief The pool of running threads
 	std::vector<std::thread> ThreadPool;
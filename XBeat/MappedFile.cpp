@@ -0,0 +1,131 @@
+//===-- MappedFile.cpp - Defines a read-only memory mapped file ------*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===---------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the MappedFile class, a read-only view of a file
+/// mapped into the address space of the process.
+///
+//===---------------------------------------------------------------------------===//
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <codecvt>
+#include <fcntl.h>
+#include <locale>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+	Data = nullptr;
+	Size = 0;
+#ifdef _WIN32
+	FileHandle = INVALID_HANDLE_VALUE;
+	MappingHandle = NULL;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const std::wstring &FileName)
+{
+	close();
+
+	FileHandle = CreateFileW(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (FileHandle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER FileSize;
+	// Empty files cannot be mapped, so treat them as a failure too
+	if (!GetFileSizeEx(FileHandle, &FileSize) || FileSize.QuadPart == 0 || (uint64_t)FileSize.QuadPart > (uint64_t)SIZE_MAX) {
+		close();
+		return false;
+	}
+
+	MappingHandle = CreateFileMappingW(FileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (MappingHandle == NULL) {
+		close();
+		return false;
+	}
+
+	Data = (const char*)MapViewOfFile(MappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (Data == nullptr) {
+		close();
+		return false;
+	}
+
+	Size = (size_t)FileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (Data != nullptr)
+		UnmapViewOfFile(Data);
+
+	if (MappingHandle != NULL)
+		CloseHandle(MappingHandle);
+
+	if (FileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(FileHandle);
+
+	Data = nullptr;
+	Size = 0;
+	MappingHandle = NULL;
+	FileHandle = INVALID_HANDLE_VALUE;
+}
+#else
+bool MappedFile::open(const std::wstring &FileName)
+{
+	close();
+
+	std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> Conversor;
+	int Descriptor = ::open(Conversor.to_bytes(FileName).c_str(), O_RDONLY);
+	if (Descriptor < 0)
+		return false;
+
+	struct stat Status;
+	if (fstat(Descriptor, &Status) != 0 || Status.st_size <= 0) {
+		::close(Descriptor);
+		return false;
+	}
+
+	void *View = mmap(nullptr, (size_t)Status.st_size, PROT_READ, MAP_PRIVATE, Descriptor, 0);
+	// The mapping keeps its own reference to the file
+	::close(Descriptor);
+
+	if (View == MAP_FAILED)
+		return false;
+
+	madvise(View, (size_t)Status.st_size, MADV_SEQUENTIAL);
+
+	Data = (const char*)View;
+	Size = (size_t)Status.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (Data != nullptr)
+		munmap((void*)Data, Size);
+
+	Data = nullptr;
+	Size = 0;
+}
+#endif
@@ -0,0 +1,68 @@
+//===-- MappedFile.h - Declares a read-only memory mapped file ------*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the MappedFile class, a read-only view of a file
+/// mapped into the address space of the process.
+///
+//===--------------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// \brief Maps a whole file, read-only, into memory
+///
+/// \remarks The mapping is released when the object is destroyed or when close() is called,
+/// so every pointer obtained from data() must not outlive it.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	/// \brief Maps the specified file into memory
+	///
+	/// \param [in] FileName The path of the file to be mapped
+	/// \returns Whether the file was successfully mapped or not
+	bool open(const std::wstring &FileName);
+
+	/// \brief Unmaps the file, if one is mapped
+	void close();
+
+	/// \brief Returns whether a file is currently mapped
+	bool isOpen() const { return Data != nullptr; }
+
+	/// \brief Returns the first byte of the mapping
+	const char* data() const { return Data; }
+
+	/// \brief Returns one past the last byte of the mapping
+	const char* end() const { return Data + Size; }
+
+	/// \brief Returns the size of the mapping, in bytes
+	size_t size() const { return Size; }
+
+private:
+	MappedFile(const MappedFile &) = delete;
+	MappedFile& operator=(const MappedFile &) = delete;
+
+	/// \brief The first byte of the mapped view
+	const char *Data;
+	/// \brief The size of the mapped view
+	size_t Size;
+
+#ifdef _WIN32
+	/// \brief The handle of the opened file
+	void *FileHandle;
+	/// \brief The handle of the file mapping object
+	void *MappingHandle;
+#endif
+};
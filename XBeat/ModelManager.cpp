@@ -20,13 +20,16 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <algorithm>
+#include <cstring>
+#include <exception>
 #include <stdexcept>
 
 namespace fs = boost::filesystem;
 
-ModelManager::ModelManager()
+ModelManager::ModelManager(std::shared_ptr<Dispatcher> EventDispatcher)
 {
-	ModelLoader.reset(new PMX::Loader);
+	this->EventDispatcher = EventDispatcher;
 }
 
 ModelManager::~ModelManager()
@@ -39,12 +42,42 @@ void ModelManager::loadList()
 	fs::path ModelPath(L"./Data/Models/"), CacheFilePath(L"./Data/ModelCache.dat");
 	if (!fs::exists(ModelPath)) throw std::ios_base::failure("Model directory not found");
 
-	if (loadFromCache(CacheFilePath, ModelPath))
-		return;
+	std::vector<ScannedModel> Cached;
+	if (!loadFromCache(CacheFilePath, Cached))
+		Cached.clear();
+
+	std::map<std::wstring, const ScannedModel*> CachedByPath;
+	for (auto &Model : Cached)
+		CachedByPath[Model.Path.generic_wstring()] = &Model;
+
+	// The whole tree is walked every time, as a directory write time only changes with its
+	// direct children. Only files that were added or changed since the cache was written are read
+	std::vector<ScannedModel> Models;
+	findModels(ModelPath, Models);
+	std::sort(Models.begin(), Models.end(), [](const ScannedModel &A, const ScannedModel &B) { return A.Path < B.Path; });
 
-	// Rebuild the cache file, since it is invalid
-	loadInternal(ModelPath);
-	saveToCache(CacheFilePath, ModelPath);
+	std::vector<size_t> Stale;
+	for (size_t Index = 0; Index < Models.size(); ++Index) {
+		auto &Model = Models[Index];
+		auto Entry = CachedByPath.find(Model.Path.generic_wstring());
+
+		if (Entry != CachedByPath.end() && Entry->second->Size == Model.Size && Entry->second->Time == Model.Time) {
+			Model.Name = Entry->second->Name;
+			Model.Valid = Entry->second->Valid;
+		}
+		else Stale.push_back(Index);
+	}
+
+	describeModels(Models, Stale);
+
+	for (auto &Model : Models) {
+		if (Model.Valid)
+			KnownModels[Model.Name] = Model.Path;
+	}
+
+	// Removed files only show up as a difference in the amount of entries
+	if (!Stale.empty() || Models.size() != Cached.size())
+		saveToCache(CacheFilePath, Models);
 }
 
 std::shared_ptr<PMX::Model> ModelManager::loadModel(const std::wstring &Name, std::shared_ptr<Physics::Environment> Physics)
@@ -57,6 +90,7 @@ std::shared_ptr<PMX::Model> ModelManager::loadModel(const std::wstring &Name, st
 	std::shared_ptr<PMX::Model> Model(new PMX::Model);
 	assert(Model);
 	Model->SetPhysics(Physics);
+	Model->SetDispatcher(EventDispatcher.lock());
 
 	if (!Model->LoadModel(Path->second.wstring()))
 		return nullptr;
@@ -64,7 +98,7 @@ std::shared_ptr<PMX::Model> ModelManager::loadModel(const std::wstring &Name, st
 	return Model;
 }
 
-bool ModelManager::loadFromCache(const boost::filesystem::path &FileName, const fs::path &ModelPath) {
+bool ModelManager::loadFromCache(const boost::filesystem::path &FileName, std::vector<ScannedModel> &Models) {
 	fs::path CacheFile(FileName);
 
 	if (!fs::exists(CacheFile))
@@ -78,11 +112,13 @@ bool ModelManager::loadFromCache(const boost::filesystem::path &FileName, const
 		return false;
 	}
 
-	int64_t CacheTime;
-	inputStream.read((char*)&CacheTime, sizeof(int64_t));
+	char Magic[4];
+	uint32_t Version;
+	inputStream.read(Magic, 4);
+	inputStream.read((char*)&Version, sizeof(uint32_t));
 
-	// If the folder modify time is more recent than the stored in the cache, then we need to recache the model list
-	if (fs::last_write_time(ModelPath) > CacheTime) {
+	// Older caches only stored the model names, they are simply rebuilt
+	if (!inputStream.good() || memcmp(Magic, "XBMC", 4) != 0 || Version != CacheVersion) {
 		inputStream.close();
 		return false;
 	}
@@ -91,54 +127,116 @@ bool ModelManager::loadFromCache(const boost::filesystem::path &FileName, const
 	inputStream.read((char*)&ModelCount, sizeof(uint64_t));
 
 	// This function is used to read a std::wstring from the cache file in its binary form
-	auto readWideString = [](std::istream &inputStream) {
+	auto readWideString = [](std::istream &inputStream, std::wstring &Output) {
 		uint64_t stringLength;
 		inputStream.read((char*)&stringLength, sizeof(uint64_t));
 
-		wchar_t *Buffer = new wchar_t[stringLength];
-		inputStream.read((char*)Buffer, sizeof(wchar_t) * stringLength);
-
-		std::wstring Output(Buffer, stringLength);
+		// Paths and model names are short, anything else means the cache is corrupt
+		if (!inputStream.good() || stringLength > 0x8000)
+			return false;
 
-		delete[] Buffer;
-
-		return Output;
+		Output.resize((size_t)stringLength);
+		inputStream.read((char*)&Output[0], sizeof(wchar_t) * stringLength);
+		return inputStream.good();
 	};
 
 	// New operator :)
 	while (ModelCount --> 0) {
-		std::wstring Name = readWideString(inputStream);
-		std::wstring Path = readWideString(inputStream);
-		KnownModels[Name] = fs::path(Path);
+		ScannedModel Model;
+		std::wstring Path;
+		uint8_t Valid;
+
+		if (!readWideString(inputStream, Path) || !readWideString(inputStream, Model.Name)) {
+			inputStream.close();
+			return false;
+		}
+
+		inputStream.read((char*)&Model.Size, sizeof(uint64_t));
+		inputStream.read((char*)&Model.Time, sizeof(int64_t));
+		inputStream.read((char*)&Valid, sizeof(uint8_t));
+		if (!inputStream.good()) {
+			inputStream.close();
+			return false;
+		}
+
+		Model.Path = fs::path(Path);
+		Model.Valid = Valid != 0;
+		Models.push_back(Model);
 	}
 
 	inputStream.close();
 	return true;
 }
 
-void ModelManager::loadInternal(const boost::filesystem::path &Path) {
+void ModelManager::findModels(const boost::filesystem::path &Path, std::vector<ScannedModel> &Output) {
 	fs::directory_iterator EndIterator;
 
 	for (fs::directory_iterator PathIterator(Path); PathIterator != EndIterator; ++PathIterator) {
 		// If the current visited path is a directory, recusively look for a model
 		if (fs::is_directory(PathIterator->status())) {
-			loadInternal(PathIterator->path());
+			findModels(PathIterator->path(), Output);
 		}
 		// Validates the PMX model extension
 		else if (fs::is_regular_file(PathIterator->status()) && PathIterator->path().has_extension()) {
 			if (boost::iequals(PathIterator->path().extension().generic_wstring(), L".pmx")) {
-				try {
-					auto desc = ModelLoader->getDescription(PathIterator->path().wstring());
-					KnownModels[desc.name.japanese] = PathIterator->path();
-				}
-				catch (PMX::Loader::Exception &e) {
-				}
+				boost::system::error_code Error;
+				ScannedModel Model;
+				Model.Path = PathIterator->path();
+				Model.Size = (uint64_t)fs::file_size(Model.Path, Error);
+				Model.Time = Error ? 0 : (int64_t)fs::last_write_time(Model.Path, Error);
+				Model.Valid = false;
+
+				// A file that cannot be inspected is never taken from the cache
+				if (Error) Model.Size = UINT64_MAX;
+
+				Output.push_back(Model);
 			}
 		}
 	}
 }
 
-void ModelManager::saveToCache(const boost::filesystem::path &FileName, const fs::path &ModelPath) {
+std::vector<ModelManager::ScannedModel> ModelManager::scanModels(const boost::filesystem::path &Path) {
+	std::vector<ScannedModel> Models;
+	findModels(Path, Models);
+
+	// Directory iteration order is unspecified, sort so that duplicated names always resolve the same way
+	std::sort(Models.begin(), Models.end(), [](const ScannedModel &A, const ScannedModel &B) { return A.Path < B.Path; });
+
+	std::vector<size_t> Indices(Models.size());
+	for (size_t Index = 0; Index < Indices.size(); ++Index)
+		Indices[Index] = Index;
+
+	describeModels(Models, Indices);
+	return Models;
+}
+
+void ModelManager::describeModels(std::vector<ScannedModel> &Models, const std::vector<size_t> &Indices) {
+	auto describeModel = [&Models, &Indices](size_t Index) {
+		// Each scan uses its own loader, as it keeps the state of the file being read
+		PMX::Loader Loader;
+		auto &Model = Models[Indices[Index]];
+
+		try {
+			Model.Name = Loader.getDescription(Model.Path.wstring()).name.japanese;
+			Model.Valid = true;
+		}
+		catch (std::exception &) {
+			// The body may run on the dispatcher, which takes no exceptions, so any failure only marks the model
+			Model.Valid = false;
+		}
+	};
+
+	auto Tasks = EventDispatcher.lock();
+	if (Tasks) {
+		Tasks->parallelFor(Indices.size(), describeModel);
+	}
+	else {
+		for (size_t Index = 0; Index < Indices.size(); ++Index)
+			describeModel(Index);
+	}
+}
+
+void ModelManager::saveToCache(const boost::filesystem::path &FileName, const std::vector<ScannedModel> &Models) {
 	fs::ofstream outputStream;
 	outputStream.open(FileName, std::ios::binary);
 
@@ -147,9 +245,10 @@ void ModelManager::saveToCache(const boost::filesystem::path &FileName, const fs
 		return;
 	}
 
-	int64_t CacheTime = fs::last_write_time(ModelPath);
-	outputStream.write((char*)&CacheTime, sizeof(int64_t));
-	uint64_t ModelCount = KnownModels.size();
+	uint32_t Version = CacheVersion;
+	outputStream.write("XBMC", 4);
+	outputStream.write((char*)&Version, sizeof(uint32_t));
+	uint64_t ModelCount = Models.size();
 	outputStream.write((char*)&ModelCount, sizeof(uint64_t));
 
 	// This function is used to write to the output stream a string in its binary form
@@ -159,9 +258,14 @@ void ModelManager::saveToCache(const boost::filesystem::path &FileName, const fs
 		outputStream.write((char*)String.c_str(), StringLength * sizeof(wchar_t));
 	};
 
-	for (auto &Model : KnownModels) {
-		writeWideString(outputStream, Model.first);
-		writeWideString(outputStream, Model.second.generic_wstring());
+	// Invalid files are stored too, so they are not read again until they change
+	for (auto &Model : Models) {
+		uint8_t Valid = Model.Valid ? 1 : 0;
+		writeWideString(outputStream, Model.Path.generic_wstring());
+		writeWideString(outputStream, Model.Name);
+		outputStream.write((char*)&Model.Size, sizeof(uint64_t));
+		outputStream.write((char*)&Model.Time, sizeof(int64_t));
+		outputStream.write((char*)&Valid, sizeof(uint8_t));
 	}
 
 	outputStream.close();
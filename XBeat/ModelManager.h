@@ -16,10 +16,13 @@
 #pragma once
 
 #include <boost/filesystem/path.hpp>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
+class Dispatcher;
 namespace Physics { class Environment; }
 namespace PMX { class Loader; class Model; }
 
@@ -29,7 +32,7 @@ class ModelManager
 public:
 	typedef std::map<std::wstring, boost::filesystem::path> ModelList;
 
-	ModelManager();
+	ModelManager(std::shared_ptr<Dispatcher> EventDispatcher);
 	~ModelManager();
 
 	/// \brief Populates the list of available models
@@ -44,25 +47,55 @@ public:
 	/// \brief Returns a copy of the KnownModels
 	ModelList getKnownModels() const { return KnownModels; }
 
+	/// \brief Describes a model file found by scanModels
+	struct ScannedModel {
+		boost::filesystem::path Path;
+		/// \brief The size of the file, in bytes
+		uint64_t Size;
+		/// \brief The last write time of the file
+		int64_t Time;
+		std::wstring Name;
+		/// \brief false if the file is not a valid PMX model
+		bool Valid;
+	};
+
+	/// \brief Reads the name of every PMX model in a directory tree
+	///
+	/// Only the beginning of each file is read. When a dispatcher is available the files
+	/// are scanned concurrently; the result is sorted by path either way.
+	///
+	/// \param [in] Path The root of the directory tree
+	std::vector<ScannedModel> scanModels(const boost::filesystem::path &Path);
+
 private:
 	ModelList KnownModels;
-	std::unique_ptr<PMX::Loader> ModelLoader;
+	/// \brief The dispatcher used to decode models in parallel
+	std::weak_ptr<Dispatcher> EventDispatcher;
 
-	/// \brief Loads the model list from the cache file
+	/// \brief The version of the cache file format
+	static const uint32_t CacheVersion = 2;
+
+	/// \brief Loads the per-file entries stored in the cache file
 	///
 	/// \param [in] FileName The path to the cache file
-	/// \param [in] ModelPath The path that the models are stored in
+	/// \param [out] Models The entries read from the cache
 	///
 	/// \returns false if the cache file failed to be loaded or if the cache is invalid
-	bool loadFromCache(const boost::filesystem::path &FileName, const boost::filesystem::path &ModelPath);
+	bool loadFromCache(const boost::filesystem::path &FileName, std::vector<ScannedModel> &Models);
+
+	/// \brief Recursively looks for PMX files, filling the path, size and time of each one
+	void findModels(const boost::filesystem::path &Path, std::vector<ScannedModel> &Output);
 
-	/// \brief Does the dirty job of populating the KnownModels if the cache needs to be revalidated
-	void loadInternal(const boost::filesystem::path &Path);
+	/// \brief Reads the names of the specified models, concurrently if possible
+	///
+	/// \param [in,out] Models The models found by findModels
+	/// \param [in] Indices The indices in Models of the models to be read
+	void describeModels(std::vector<ScannedModel> &Models, const std::vector<size_t> &Indices);
 
-	/// \brief Saves the cache to the cache file
+	/// \brief Saves the per-file entries to the cache file
 	///
 	/// \param [in] FileName The path to the cache file
-	/// \param [in] ModelPath The path that the models are stored in
-	void saveToCache(const boost::filesystem::path &FileName, const boost::filesystem::path &ModelPath);
+	/// \param [in] Models The entries to be saved
+	void saveToCache(const boost::filesystem::path &FileName, const std::vector<ScannedModel> &Models);
 };
 
@@ -1,4 +1,6 @@
 ﻿#include "PMXBone.h"
+#include "PMXBoneEvaluator.h"
+#include "PMXBoneImpl.h"
 
 #include "PMXMaterial.h"
 #include "PMXModel.h"
@@ -6,209 +8,6 @@
 #include <algorithm>
 #include <cfloat>
 
-namespace PMX {
-namespace detail {
-	class RootBone
-		: public Bone
-	{
-	public:
-		RootBone(PMX::Model *Model) : Bone(Model, -1) {
-			Flags = (uint16_t)BoneFlags::Manipulable | (uint16_t)BoneFlags::Movable | (uint16_t)BoneFlags::Rotatable;
-		}
-
-		virtual bool isRootBone() { return true; }
-
-		virtual Bone* getRootBone() { return this; }
-
-		virtual btVector3 getStartPosition() { return btVector3(0, 0, 0); }
-
-		virtual void initialize(Loader::Bone *Data) {};
-		virtual void terminate() {};
-		virtual void update() {};
-
-		virtual void transform(const btVector3& Angles, const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User)
-		{
-			btQuaternion Rotation;
-			Rotation.setEulerZYX(Angles.x(), Angles.y(), Angles.z());
-			Transform.setRotation(Rotation * Transform.getRotation());
-			Transform.setOrigin(Transform.getOrigin() + Offset);
-
-			Inverse = Transform.inverse();
-		}
-
-		virtual void transform(const btTransform& Transform, DeformationOrigin Origin = DeformationOrigin::User)
-		{
-			this->Transform *= Transform;
-
-			Inverse = this->Transform.inverse();
-		}
-
-		virtual void rotate(const btVector3& Axis, float Angle, DeformationOrigin Origin = DeformationOrigin::User)
-		{
-			rotate(btQuaternion(Axis, Angle), Origin);
-		}
-
-		virtual void rotate(const btVector3& Angles, DeformationOrigin Origin = DeformationOrigin::User)
-		{
-			btQuaternion Rotation;
-			Rotation.setEulerZYX(Angles.x(), Angles.y(), Angles.z());
-			rotate(Rotation, Origin);
-		}
-
-		virtual void rotate(const btQuaternion& Rotation, DeformationOrigin Origin = DeformationOrigin::User)
-		{
-			Transform.setRotation(Rotation * Transform.getRotation());
-
-			Inverse = Transform.inverse();
-		}
-
-		virtual void translate(const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User)
-		{
-			Transform.setOrigin(Transform.getOrigin() + Offset);
-
-			Inverse = Transform.inverse();
-		}
-
-		virtual void resetTransform()
-		{
-			Transform.setIdentity();
-			Inverse.setIdentity();
-		}
-
-#if defined _M_IX86 && defined _MSC_VER
-		void *__cdecl operator new(size_t count){
-			return _aligned_malloc(count, 16);
-		}
-
-		void __cdecl operator delete(void *object) {
-			_aligned_free(object);
-		}
-#endif
-	};
-
-	class BoneImpl
-		: public Bone
-	{
-	public:
-		BoneImpl(PMX::Model *Model, uint32_t Id) : Bone(Model, Id){};
-
-		virtual btVector3 getPosition();
-
-		virtual void initialize(Loader::Bone *Data);
-		virtual void initializeDebug(ID3D11DeviceContext *Context);
-		virtual void terminate();
-
-		virtual void update();
-
-		virtual void transform(const btVector3& Angles, const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User);
-		virtual void transform(const btTransform& Transform, DeformationOrigin Origin = DeformationOrigin::User);
-		virtual void rotate(const btVector3& Axis, float Angle, DeformationOrigin Origin = DeformationOrigin::User);
-		virtual void rotate(const btVector3& Angles, DeformationOrigin Origin = DeformationOrigin::User);
-		virtual void rotate(const btQuaternion& Rotation, DeformationOrigin Origin = DeformationOrigin::User);
-		virtual void translate(const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User);
-
-		virtual void resetTransform();
-
-		virtual void applyMorph(Morph *morph, float weight);
-		virtual void applyPhysicsTransform(btTransform &transform);
-
-		virtual void XM_CALLCONV render(DirectX::FXMMATRIX world, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection);
-
-		virtual btVector3 getStartPosition();
-		virtual btQuaternion getIKRotation() { return IkRotation; }
-
-		virtual btTransform getSkinningTransform() { return btTransform(btQuaternion::getIdentity(), -InitialPosition) * Transform; }
-
-		virtual Bone* getRootBone();
-
-		virtual void clearIK() { IkRotation = btQuaternion::getIdentity(); }
-
-		/**
-		 * @returns the length of this bone
-		 */
-		float getLength();
-		btVector3 getEndPosition(bool transform = true);
-		btQuaternion IkRotation;
-
-#if defined _M_IX86 && defined _MSC_VER
-		void *__cdecl operator new(size_t count){
-			return _aligned_malloc(count, 16);
-		}
-
-		void __cdecl operator delete(void *object) {
-			_aligned_free(object);
-		}
-#endif
-
-	protected:
-		btVector3 getOffsetPosition();
-
-		std::list<std::pair<Morph*, float>> appliedMorphs;
-
-		btTransform InheritTransform, UserTransform, MorphTransform;
-
-		btMatrix3x3 LocalAxis;
-		btVector3 AxisTranslation;
-		btVector3 InitialPosition, EndPosition;
-
-		btQuaternion DebugRotation;
-
-		BoneImpl *AttachedTo;
-		BoneImpl *InheritFrom;
-		float InheritRate;
-
-		float Length;
-
-		// Used for debug render
-		std::unique_ptr<DirectX::GeometricPrimitive> Primitive;
-	};
-
-	class IKBone
-		: public BoneImpl
-	{
-	public:
-		IKBone(PMX::Model *Model, uint32_t Id) : BoneImpl(Model, Id) {}
-
-		virtual void initialize(Loader::Bone *Data);
-		virtual void initializeDebug(ID3D11DeviceContext *Context);
-		virtual void terminate();
-
-		virtual bool isIK() { return true; }
-		virtual void performIK();
-
-#if defined _M_IX86 && defined _MSC_VER
-		void *__cdecl operator new(size_t count){
-			return _aligned_malloc(count, 16);
-		}
-
-		void __cdecl operator delete(void *object) {
-			_aligned_free(object);
-		}
-#endif
-
-	private:
-		struct Node {
-			BoneImpl* Bone;
-			bool Limited;
-			struct {
-				float Lower[3];
-				float Upper[3];
-			} Limits;
-		};
-
-		BoneImpl *TargetBone;
-
-		float ChainLength;
-
-		int LoopCount;
-
-		float AngleLimit;
-
-		std::vector<Node> Links;
-	};
-}
-}
-
 using namespace PMX;
 
 Bone* Bone::createBone(PMX::Model *Model, uint32_t Id, BoneType Type)
@@ -236,6 +35,7 @@ void detail::BoneImpl::initialize(Loader::Bone *Data)
 {
 	InheritTransform = UserTransform = MorphTransform = btTransform::getIdentity();
 	IkRotation = btQuaternion::getIdentity();
+	Dirty = LocalDirty;
 
 	DeformationOrder = Data->DeformationOrder;
 	ParentId = Data->Parent;
@@ -350,40 +150,11 @@ btVector3 detail::BoneImpl::getStartPosition()
 
 void detail::BoneImpl::update()
 {
-	btVector3 Translation(0, 0, 0);
-	btQuaternion Rotation = btQuaternion::getIdentity();
-
-	if (hasAnyFlag((uint16_t)BoneFlags::LocallyAttached)) {
-		Translation = Parent->getLocalTransform().getOrigin();
-	}
-	else if (hasAnyFlag((uint16_t)BoneFlags::TranslationAttached)) {
-		if (InheritFrom) Translation = InheritFrom->InheritTransform.getOrigin();
-	}
-	Translation *= InheritRate;
-
-	if (hasAnyFlag((uint16_t)BoneFlags::LocallyAttached)) {
-		Rotation = Parent->getLocalTransform().getRotation();
-	}
-	else {
-		if (hasAnyFlag((uint16_t)BoneFlags::RotationAttached)) {
-			if (InheritFrom) {
-				Rotation = InheritFrom->getIKRotation() * InheritFrom->InheritTransform.getRotation();
-			}
-			else Rotation *= Parent->getIKRotation();
-		}
-	}
-	Rotation = btQuaternion::getIdentity().slerp(Rotation, InheritRate);
-
-	InheritTransform = btTransform(Rotation, Translation);
-
-	Translation += UserTransform.getOrigin() + MorphTransform.getOrigin() + getOffsetPosition();
-
-	Rotation *= UserTransform.getRotation();
-	Rotation *= MorphTransform.getRotation();
-	Rotation *= IkRotation;
-	Rotation.normalize();
-
-	Transform = hasAnyFlag((uint16_t)BoneFlags::LocallyAttached) ? btTransform(Rotation, Translation) : Parent->getTransform() * btTransform(Rotation, Translation);
+	BoneEvaluator::evaluateBone(Flags, InheritRate, getOffsetPosition(),
+		Parent->getTransform(), Parent->getInverseTransform(), Parent->getIKRotation(),
+		InheritFrom ? &InheritFrom->InheritTransform : nullptr, InheritFrom ? InheritFrom->IkRotation : btQuaternion::getIdentity(),
+		UserTransform, MorphTransform, IkRotation,
+		InheritTransform, Transform);
 }
 
 void detail::BoneImpl::transform(const btVector3& angles, const btVector3& offset, DeformationOrigin origin)
@@ -403,11 +174,17 @@ void detail::BoneImpl::transform(const btTransform& transform, DeformationOrigin
 		return;
 
 	if (origin == DeformationOrigin::Motion) {
+		// Motions set every bone on every frame, even when they are paused
+		if (UserTransform == transform)
+			return;
+
 		UserTransform = transform;
+		Dirty |= LocalDirty;
 		return;
 	}
 
 	UserTransform *= transform;
+	Dirty |= LocalDirty;
 }
 
 void detail::BoneImpl::rotate(const btVector3& axis, float angle, DeformationOrigin origin)
@@ -438,6 +215,7 @@ void detail::BoneImpl::rotate(const btQuaternion& Rotation, DeformationOrigin Or
 		return;
 
 	UserTransform.setRotation(Rotation * UserTransform.getRotation());
+	Dirty |= LocalDirty;
 }
 
 void detail::BoneImpl::translate(const btVector3& offset, DeformationOrigin origin)
@@ -446,16 +224,22 @@ void detail::BoneImpl::translate(const btVector3& offset, DeformationOrigin orig
 		return;
 
 	UserTransform.setOrigin(UserTransform.getOrigin() + offset);
+	Dirty |= LocalDirty;
 }
 
 void detail::BoneImpl::resetTransform()
 {
+	if (UserTransform == btTransform::getIdentity())
+		return;
+
 	UserTransform.setIdentity();
+	Dirty |= LocalDirty;
 }
 
 void detail::BoneImpl::applyPhysicsTransform(btTransform &transform)
 {
 	Transform = transform;
+	Dirty |= WorldDirty;
 }
 
 void detail::BoneImpl::applyMorph(Morph *morph, float weight)
@@ -487,6 +271,7 @@ void detail::BoneImpl::applyMorph(Morph *morph, float weight)
 	}
 	MorphTransform.setRotation(rotation);
 	MorphTransform.setOrigin(position);
+	Dirty |= LocalDirty;
 }
 
 void XM_CALLCONV detail::BoneImpl::render(DirectX::FXMMATRIX world, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection)
@@ -536,12 +321,28 @@ void detail::IKBone::initialize(Loader::Bone *Data) {
 			NewNode.Limits.Upper[2] = Link.limits.upper[2];
 		}
 
+		// A link limited to a single axis is solved as a hinge
+		int FreeAxes = 0;
+		NewNode.HingeAxis = -1;
+		for (int Axis = 0; Axis < 3; ++Axis) {
+			if (NewNode.Limits.Lower[Axis] != NewNode.Limits.Upper[Axis]) {
+				NewNode.HingeAxis = Axis;
+				++FreeAxes;
+			}
+		}
+		if (!NewNode.Limited || FreeAxes != 1)
+			NewNode.HingeAxis = -1;
+
 		ChainLength += NewNode.Bone->getLength();
 		Links.emplace_back(NewNode);
 	}
 
 	assert(!Links.empty());
 	assert(ChainLength > 0.00001f);
+
+	LastSolution.Iterations = 0;
+	LastSolution.Distance = 0.0f;
+	LastSolution.Converged = true;
 }
 
 void detail::IKBone::initializeDebug(ID3D11DeviceContext *Context)
@@ -715,100 +516,261 @@ void detail::IKBone::performIK() {
 	TargetBone->update();
 }
 #else
-void detail::IKBone::performIK() {
-	if (TargetBone->isSimulated())
-		return;
+namespace {
+	//! The squared distance between the target and the destination under which a solve stops
+	const float IKConvergenceThreshold = 0.0001f;
 
-	for (auto &Link : Links) {
-		if (Link.Bone->isSimulated()) return;
-		Link.Bone->clearIK();
+	btVector3 unitAxis(int Axis)
+	{
+		return btVector3(Axis == 0 ? 1.0f : 0.0f, Axis == 1 ? 1.0f : 0.0f, Axis == 2 ? 1.0f : 0.0f);
 	}
 
-	btVector3 Destination = getPosition();
-	btVector3 RootPosition = Links.back().Bone->getPosition();
-
-	auto InitialRotation = TargetBone->getRotation();
+	//! Brings an angle in (-3 pi; 3 pi) back to [-pi; pi]
+	float wrapAngle(float Angle)
+	{
+		if (Angle > SIMD_PI)
+			return Angle - SIMD_2_PI;
+		if (Angle < -SIMD_PI)
+			return Angle + SIMD_2_PI;
+		return Angle;
+	}
 
-#if 1
-	// Determine if the target position is reachable
-	if (RootPosition.distance(Destination) > ChainLength) {
-		// If unreachable, move the target point to a reachable point colinear to the root bone position and the original target point
-		Destination = (Destination - RootPosition).normalized() * ChainLength + RootPosition;
-		assert(RootPosition.distance(Destination) <= ChainLength + 0.0001f);
+	//! Returns the angle a rotation turns around one of the coordinate axes, ignoring the rest of it
+	float getTwistAngle(const btQuaternion &Rotation, int Axis)
+	{
+		const btScalar Components[3] = { Rotation.x(), Rotation.y(), Rotation.z() };
+		return wrapAngle(2.0f * btAtan2(Components[Axis], Rotation.w()));
 	}
-#endif
 
-	for (int Iteration = 0; Iteration < LoopCount; ++Iteration) {
-		for (int Index = 0; Index < Links.size(); ++Index) {
-			auto &Link = Links[Index];
-			btVector3 CurrentPosition = Link.Bone->getPosition();
-			btVector3 TargetPosition = TargetBone->getPosition();
+	//! Clamps the Euler angles of a rotation, in the order of btQuaternion::setEulerZYX(), read from the quaternion itself
+	//!
+	//! PMX limits are ranges of Euler angles, which a swing and twist split of the quaternion cannot
+	//! express for three axes, so the angles themselves are clamped. Every rotation is described by
+	//! two sets of angles, the one the limits change the least is kept.
+	btQuaternion clampRotation(const btQuaternion &Rotation, const float *Lower, const float *Upper)
+	{
+		float x = Rotation.x(), y = Rotation.y(), z = Rotation.z(), w = Rotation.w();
 
-			btTransform TransformInverse = Link.Bone->getTransform().inverse();
-			btVector3 LocalDestination = Destination - CurrentPosition;
-			btVector3 LocalAffectedBonePosition = TargetPosition - CurrentPosition;
+		float X = btAtan2(2.0f * (w * x + y * z), 1.0f - 2.0f * (x * x + y * y));
+		float Y = btAsin(btClamped(2.0f * (w * y - z * x), -1.0f, 1.0f));
+		float Z = btAtan2(2.0f * (w * z + x * y), 1.0f - 2.0f * (y * y + z * z));
 
-			if (LocalDestination.length2() <= 0.00001f)
-				continue;
+		const float Angles[2][3] = {
+			{ X, Y, Z },
+			{ wrapAngle(X + SIMD_PI), wrapAngle(SIMD_PI - Y), wrapAngle(Z + SIMD_PI) },
+		};
 
-			if (LocalDestination.distance2(LocalAffectedBonePosition) <= 0.0001f) {
-				Iteration = LoopCount;
-				break;
+		float Clamped[2][3], Correction[2] = { 0.0f, 0.0f };
+		for (int Set = 0; Set < 2; ++Set) {
+			for (int Axis = 0; Axis < 3; ++Axis) {
+				Clamped[Set][Axis] = btClamped(Angles[Set][Axis], Lower[Axis], Upper[Axis]);
+				Correction[Set] += btFabs(Clamped[Set][Axis] - Angles[Set][Axis]);
 			}
+		}
 
-			LocalDestination.normalize();
-			LocalAffectedBonePosition.normalize();
+		const float *Best = Correction[1] < Correction[0] ? Clamped[1] : Clamped[0];
 
-			auto Dot = LocalAffectedBonePosition.dot(LocalDestination);
-			if (Dot > 0.99999f) continue;
+		btQuaternion Result;
+		Result.setEulerZYX(Best[2], Best[1], Best[0]);
+		return Result;
+	}
+}
 
-			auto Angle = acosf(Dot);
-			if (fabsf(Angle) < 0.0001f) continue;
+void detail::IKBone::buildChain()
+{
+	uint32_t LinkCount = (uint32_t)Links.size();
+
+	Chain.resize(LinkCount + 1);
+	for (uint32_t Index = 0; Index <= LinkCount; ++Index) {
+		Bone *Node = Index < LinkCount ? Links[Index].Bone : TargetBone;
+
+		// A node hangs from its closest ancestor among the links
+		Chain[Index].Parent = -1;
+		Chain[Index].Moved = false;
+		for (Bone *Ancestor = Node->getParent(); Ancestor != nullptr && Chain[Index].Parent < 0; Ancestor = Ancestor->getParent()) {
+			for (uint32_t Link = 0; Link < LinkCount; ++Link) {
+				if (Links[Link].Bone == Ancestor) {
+					Chain[Index].Parent = Link;
+					break;
+				}
+			}
+		}
+	}
 
-			btClamp(Angle, -AngleLimit, AngleLimit);
+	std::vector<uint32_t> Depths(LinkCount + 1, 0);
+	for (uint32_t Index = 0; Index <= LinkCount; ++Index) {
+		for (int32_t Parent = Chain[Index].Parent; Parent >= 0; Parent = Chain[Parent].Parent)
+			Depths[Index]++;
+	}
 
-			btVector3 Axis = LocalAffectedBonePosition.cross(LocalDestination);
-			if (Axis.length2() < 0.0001f && Iteration != 0) continue;
+	ChainOrder.resize(LinkCount + 1);
+	for (uint32_t Index = 0; Index <= LinkCount; ++Index)
+		ChainOrder[Index] = Index;
+	std::stable_sort(ChainOrder.begin(), ChainOrder.end(), [&Depths](uint32_t a, uint32_t b) { return Depths[a] < Depths[b]; });
 
-			Axis.normalize();
+	ChainPositions.resize(LinkCount + 1);
+	for (uint32_t Position = 0; Position <= LinkCount; ++Position)
+		ChainPositions[ChainOrder[Position]] = Position;
+}
 
-			btQuaternion Rotation(Axis, Angle);
-			// clamp rotation values
-			if (Link.Limited) {
-#if 1
-				if (Iteration == 0) {
-					Link.Bone->IkRotation.setRotation(Axis, -AngleLimit);
-					//Link.Bone->IkRotation.setEulerZYX(Link.Limits.Upper[2], Link.Limits.Upper[1], Link.Limits.Upper[0]);
-				}
-				else
-#endif
-				{
-					btMatrix3x3 Matrix;
-					float x, y, z;
-					Matrix.setRotation(Rotation);
-					Matrix.getEulerZYX(z, y, x);
-					float cx, cy, cz;
-					Matrix.setRotation(Link.Bone->getRotation());
-					Matrix.getEulerZYX(cz, cy, cx);
-
-					x = btClamped(x, Link.Limits.Lower[0] - cx, Link.Limits.Upper[0] - cx);
-					y = btClamped(y, Link.Limits.Lower[1] - cy, Link.Limits.Upper[1] - cy);
-					z = btClamped(z, Link.Limits.Lower[2] - cz, Link.Limits.Upper[2] - cz);
-
-					Rotation.setEulerZYX(z, y, x);
-				}
-			}
-			Link.Bone->IkRotation *= Rotation;
+void detail::IKBone::updateNode(uint32_t Index)
+{
+	auto &Node = Chain[Index];
+	btQuaternion Rotation = Node.LocalRotation * Node.IK;
 
-			for (int UpdateIndex = Index; UpdateIndex >= 0; --UpdateIndex) {
-				Links[UpdateIndex].Bone->update();
-			}
-			TargetBone->update();
+	if (Node.Parent >= 0) {
+		auto &Parent = Chain[Node.Parent];
+		Node.Rotation = (Parent.Rotation * Rotation).normalized();
+		Node.Position = quatRotate(Parent.Rotation, Node.LocalPosition) + Parent.Position;
+	}
+	else {
+		Node.Rotation = Rotation.normalized();
+		Node.Position = Node.LocalPosition;
+	}
+}
+
+void detail::IKBone::updateChain(uint32_t Link)
+{
+	updateNode(Link);
+	Chain[Link].Moved = true;
+
+	// Only the nodes after the link in ChainOrder may hang from it
+	for (size_t Position = ChainPositions[Link] + 1; Position < ChainOrder.size(); ++Position) {
+		auto &Node = Chain[ChainOrder[Position]];
+		if (Node.Parent >= 0 && Chain[Node.Parent].Moved) {
+			updateNode(ChainOrder[Position]);
+			Node.Moved = true;
 		}
 	}
 
-	TargetBone->IkRotation = InitialRotation * TargetBone->getRotation().inverse();
-	TargetBone->update();
+	for (size_t Position = ChainPositions[Link]; Position < ChainOrder.size(); ++Position)
+		Chain[ChainOrder[Position]].Moved = false;
+}
+
+bool detail::IKBone::rotateLink(uint32_t Index, const btVector3 &Destination)
+{
+	auto &Link = Links[Index];
+	auto &Node = Chain[Index];
+
+	btVector3 ToTarget = Chain[Links.size()].Position - Node.Position;
+	btVector3 ToDestination = Destination - Node.Position;
+	if (ToTarget.length2() <= 0.00001f || ToDestination.length2() <= 0.00001f)
+		return false;
+
+	if (Link.HingeAxis >= 0) {
+		// Turn around the hinge by the angle between both directions on the plane it rotates in
+		btVector3 Axis = quatRotate(Node.Rotation, unitAxis(Link.HingeAxis));
+		bool Closer = ToDestination.length2() < ToTarget.length2();
+		ToTarget -= Axis * Axis.dot(ToTarget);
+		ToDestination -= Axis * Axis.dot(ToDestination);
+		if (ToTarget.length2() <= 0.00001f || ToDestination.length2() <= 0.00001f)
+			return false;
+
+		float Angle = btAtan2(Axis.dot(ToTarget.cross(ToDestination)), ToTarget.dot(ToDestination));
+		float Lower = Link.Limits.Lower[Link.HingeAxis], Upper = Link.Limits.Upper[Link.HingeAxis];
+
+		float Current = getTwistAngle(Node.IK, Link.HingeAxis);
+		float Next = btClamped(Current + btClamped(Angle, -AngleLimit, AngleLimit), Lower, Upper);
+
+		// A straight chain never folds towards a closer destination by itself, so fold it the way the limits allow
+		if (Closer && btFabs(Next - Current) < 0.0001f && btFabs(Current - btClamped(0.0f, Lower, Upper)) < 0.0001f)
+			Next = btClamped(Current + (Upper > -Lower ? AngleLimit : -AngleLimit), Lower, Upper);
+		if (Next == Current)
+			return false;
+
+		Node.IK = btQuaternion(unitAxis(Link.HingeAxis), Next);
+		return true;
+	}
+
+	ToTarget.normalize();
+	ToDestination.normalize();
+
+	// The angle is taken from both the sine and the cosine, as the cosine alone is too coarse near the destination
+	btVector3 Axis = ToTarget.cross(ToDestination);
+	float Angle = btAtan2(Axis.length(), ToTarget.dot(ToDestination));
+	if (Angle < 0.00001f || Axis.length2() < 0.0000000001f)
+		return false;
+
+	// The IK rotation applies after the rest of the rotation of the link, so the axis is taken to its space
+	Axis = quatRotate(Node.Rotation.inverse(), Axis.normalized());
+	btQuaternion Rotation = Node.IK * btQuaternion(Axis, btMin(Angle, AngleLimit));
+
+	if (Link.Limited)
+		Rotation = clampRotation(Rotation, Link.Limits.Lower, Link.Limits.Upper);
+
+	Node.IK = Rotation.normalized();
+	return true;
+}
+
+void detail::IKBone::performIK() {
+	LastSolution.Iterations = 0;
+	LastSolution.Distance = 0.0f;
+	LastSolution.Converged = false;
+
+	if (TargetBone->isSimulated())
+		return;
+
+	for (auto &Link : Links) {
+		if (Link.Bone->isSimulated()) return;
+	}
+
+	if (ChainOrder.empty())
+		buildChain();
+
+	uint32_t LinkCount = (uint32_t)Links.size();
+	auto &Target = Chain[LinkCount];
+
+	// Cache the chain without the IK rotations of the last solve, relative to the link each node hangs from
+	for (uint32_t Index = 0; Index <= LinkCount; ++Index) {
+		BoneImpl *Current = Index < LinkCount ? Links[Index].Bone : TargetBone;
+		auto &Node = Chain[Index];
+
+		btTransform Local = Current->getTransform() * btTransform(Current->IkRotation.inverse());
+		if (Node.Parent >= 0)
+			Local = Links[Node.Parent].Bone->getTransform().inverseTimes(Local);
+
+		Node.LocalRotation = Local.getRotation();
+		Node.LocalPosition = Local.getOrigin();
+		Node.IK = btQuaternion::getIdentity();
+	}
+
+	for (auto Index : ChainOrder)
+		updateNode(Index);
+
+	// The target keeps the rotation it had without IK, however the links turn
+	btQuaternion TargetRotation = Target.Rotation;
+
+	btVector3 Destination = getPosition();
+	btVector3 Root = Chain[LinkCount - 1].Position;
+	if (Destination.distance2(Root) > ChainLength * ChainLength)
+		Destination = Root + (Destination - Root).normalized() * ChainLength;
+
+	float Distance = Target.Position.distance2(Destination);
+	int Iteration = 0;
+	while (Iteration < LoopCount && Distance > IKConvergenceThreshold) {
+		for (uint32_t Index = 0; Index < LinkCount; ++Index) {
+			if (rotateLink(Index, Destination))
+				updateChain(Index);
+		}
+
+		++Iteration;
+		Distance = Target.Position.distance2(Destination);
+	}
+
+	for (uint32_t Index = 0; Index < LinkCount; ++Index)
+		Links[Index].Bone->IkRotation = Chain[Index].IK;
+	TargetBone->IkRotation = (Target.Rotation.inverse() * TargetRotation).normalized();
+
+	// The evaluator computes the solved bones again on the next pass, from the pose without IK
+	for (auto Index : ChainOrder) {
+		BoneImpl *Solved = Index < LinkCount ? Links[Index].Bone : TargetBone;
+		Solved->update();
+		Solved->Dirty |= SolvedDirty;
+	}
 	TargetBone->updateChildren();
+
+	LastSolution.Iterations = Iteration;
+	LastSolution.Distance = btSqrt(Distance);
+	LastSolution.Converged = Distance <= IKConvergenceThreshold;
 }
 #endif
@@ -16,6 +16,16 @@ class Bone
 public:
 	static Bone* createBone(Model *Model, uint32_t Id, BoneType Type);
 
+	//! The outcome of the last IK solve of an IK bone
+	struct IKSolution {
+		//! The amount of iterations run
+		int Iterations;
+		//! The distance left between the target bone and the point it was moved to
+		float Distance;
+		//! Whether the distance went below the convergence threshold
+		bool Converged;
+	};
+
 	//! Applies a rotation around Euler angles and a translation
 	virtual void transform(const btVector3& Angles, const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User) = 0;
 	//! Applies a btTransform
@@ -87,6 +97,8 @@ public:
 
 	//! Perform IK link
 	virtual void performIK() {}
+	//! Returns the outcome of the last performIK()
+	virtual IKSolution getIKSolution() { IKSolution None = { 0, 0.0f, true }; return None; }
 	//! Clear IK information
 	virtual void clearIK() {}
 
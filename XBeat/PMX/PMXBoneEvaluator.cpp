@@ -0,0 +1,348 @@
+//===-- PMX/PMXBoneEvaluator.cpp - Defines the flat bone evaluator ---*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the PMX::BoneEvaluator class, which computes the
+/// transforms of every bone of a model in a single pass over flat arrays
+///
+//===-------------------------------------------------------------------------===//
+
+#include "PMXBoneEvaluator.h"
+#include "PMXBoneImpl.h"
+
+#include <unordered_map>
+
+using namespace PMX;
+
+BoneEvaluator::BoneEvaluator()
+{
+	Root = nullptr;
+	PostPhysicsStart = 0;
+	RootTransform.setIdentity();
+	RootChanged = true;
+}
+
+void BoneEvaluator::build(Bone *Root, const std::vector<Bone*> &PrePhysics, const std::vector<Bone*> &PostPhysics)
+{
+	clear();
+
+	this->Root = Root;
+
+	for (auto &Bone : PrePhysics)
+		Bones.push_back(static_cast<detail::BoneImpl*>(Bone));
+	PostPhysicsStart = (uint32_t)Bones.size();
+	for (auto &Bone : PostPhysics)
+		Bones.push_back(static_cast<detail::BoneImpl*>(Bone));
+
+	uint32_t Count = (uint32_t)Bones.size();
+
+	std::unordered_map<const Bone*, int32_t> Slots;
+	for (uint32_t Index = 0; Index < Count; ++Index)
+		Slots[Bones[Index]] = (int32_t)Index;
+
+	auto getSlot = [&Slots](const Bone *Bone) -> int32_t {
+		auto Slot = Slots.find(Bone);
+		return Slot != Slots.end() ? Slot->second : -1;
+	};
+
+	Parents.resize(Count);
+	Sources.resize(Count);
+	Flags.resize(Count);
+	InheritRates.resize(Count);
+	Offsets.resize(Count);
+	InverseRotations.resize(Count);
+	InverseTranslations.resize(Count);
+	LocalRotations.resize(Count);
+	LocalTranslations.resize(Count);
+	IKRotations.resize(Count);
+	InheritedRotations.resize(Count);
+	InheritedTranslations.resize(Count);
+	Rotations.resize(Count);
+	Translations.resize(Count);
+
+	Changed.assign(Count, 1);
+	Pinned.assign(Count, 0);
+
+	std::vector<bool> ReadEarly(Count, false);
+
+	for (uint32_t Index = 0; Index < Count; ++Index) {
+		auto Bone = Bones[Index];
+
+		Parents[Index] = getSlot(Bone->Parent);
+		Sources[Index] = Bone->InheritFrom ? getSlot(Bone->InheritFrom) : -1;
+		Flags[Index] = Bone->Flags;
+		InheritRates[Index] = Bone->InheritRate;
+		Offsets[Index] = Bone->getOffsetPosition();
+		InverseRotations[Index] = Bone->Inverse.getRotation();
+		InverseTranslations[Index] = Bone->Inverse.getOrigin();
+		InheritedRotations[Index] = Bone->InheritTransform.getRotation();
+		InheritedTranslations[Index] = Bone->InheritTransform.getOrigin();
+		Rotations[Index] = Bone->Transform.getRotation();
+		Translations[Index] = Bone->Transform.getOrigin();
+
+		// No bone has a null rotation, so the first pass gathers and computes every bone
+		LocalRotations[Index] = IKRotations[Index] = btQuaternion(0.0f, 0.0f, 0.0f, 0.0f);
+		LocalTranslations[Index].setZero();
+		Bone->Dirty |= detail::BoneImpl::LocalDirty;
+
+		if (Parents[Index] >= (int32_t)Index) {
+			ReadEarly[Parents[Index]] = true;
+			Pinned[Index] = 1;
+		}
+		if (Sources[Index] >= (int32_t)Index) {
+			ReadEarly[Sources[Index]] = true;
+			Pinned[Index] = 1;
+		}
+
+		if (Bone->isSimulated()) {
+			Simulated.push_back(Index);
+
+			// The arrays hold the transform of the rigid body after the physics step,
+			// so the bone is computed again on the next pass
+			if (Index < PostPhysicsStart)
+				Pinned[Index] = 1;
+		}
+	}
+
+	for (uint32_t Index = 0; Index < Count; ++Index) {
+		if (ReadEarly[Index])
+			EarlyReads.push_back(Index);
+	}
+}
+
+void BoneEvaluator::clear()
+{
+	Root = nullptr;
+	Bones.clear();
+	PostPhysicsStart = 0;
+
+	Parents.clear();
+	Sources.clear();
+	Flags.clear();
+	InheritRates.clear();
+	Offsets.clear();
+	InverseRotations.clear();
+	InverseTranslations.clear();
+	LocalRotations.clear();
+	LocalTranslations.clear();
+	IKRotations.clear();
+	InheritedRotations.clear();
+	InheritedTranslations.clear();
+	Rotations.clear();
+	Translations.clear();
+
+	EarlyReads.clear();
+	Simulated.clear();
+	Changed.clear();
+	Pinned.clear();
+
+	RootTransform.setIdentity();
+	RootChanged = true;
+}
+
+void BoneEvaluator::updatePrePhysics()
+{
+	btTransform CurrentRoot = Root->getTransform();
+	RootChanged = !(CurrentRoot == RootTransform);
+	RootTransform = CurrentRoot;
+
+	for (auto Index : EarlyReads) {
+		auto Bone = Bones[Index];
+		InheritedRotations[Index] = Bone->InheritTransform.getRotation();
+		InheritedTranslations[Index] = Bone->InheritTransform.getOrigin();
+		Rotations[Index] = Bone->Transform.getRotation();
+		Translations[Index] = Bone->Transform.getOrigin();
+	}
+
+	gather(0, (uint32_t)Bones.size());
+	evaluate(0, PostPhysicsStart);
+	scatter(0, PostPhysicsStart);
+}
+
+void BoneEvaluator::updatePostPhysics()
+{
+	for (auto Index : Simulated) {
+		auto Bone = Bones[Index];
+		if ((Bone->Dirty & detail::BoneImpl::WorldDirty) == 0)
+			continue;
+
+		// Bones deformed after the physics step are computed again, discarding the rigid body
+		if (Index < PostPhysicsStart) {
+			Rotations[Index] = Bone->Transform.getRotation();
+			Translations[Index] = Bone->Transform.getOrigin();
+		}
+		Changed[Index] = 1;
+		Bone->Dirty &= ~detail::BoneImpl::WorldDirty;
+	}
+
+	evaluate(PostPhysicsStart, (uint32_t)Bones.size());
+	scatter(PostPhysicsStart, (uint32_t)Bones.size());
+}
+
+void BoneEvaluator::gather(uint32_t First, uint32_t Last)
+{
+	for (uint32_t Index = First; Index < Last; ++Index) {
+		auto Bone = Bones[Index];
+		uint8_t BoneChanged = Pinned[Index];
+
+		if ((Bone->Dirty & detail::BoneImpl::LocalDirty) != 0) {
+			btQuaternion Rotation = Bone->UserTransform.getRotation() * Bone->MorphTransform.getRotation();
+			btVector3 Translation = Bone->UserTransform.getOrigin() + Bone->MorphTransform.getOrigin();
+			Bone->Dirty &= ~detail::BoneImpl::LocalDirty;
+
+			// Motions reset every bone and set it again on every frame, so only a different deformation is a change
+			if (Rotation != LocalRotations[Index] || Translation != LocalTranslations[Index]) {
+				LocalRotations[Index] = Rotation;
+				LocalTranslations[Index] = Translation;
+				BoneChanged = 1;
+			}
+		}
+
+		// IK writes the rotation directly and solves it again on every frame, so compare it instead
+		if (IKRotations[Index] != Bone->IkRotation) {
+			IKRotations[Index] = Bone->IkRotation;
+			BoneChanged = 1;
+		}
+
+		// IK also wrote the transform of the bone, which the arrays never saw; computing it
+		// again restores the pose without IK for the next solve, and updates its descendants
+		if ((Bone->Dirty & detail::BoneImpl::SolvedDirty) != 0) {
+			Bone->Dirty &= ~detail::BoneImpl::SolvedDirty;
+			BoneChanged = 1;
+		}
+
+		Changed[Index] = BoneChanged;
+	}
+}
+
+void BoneEvaluator::evaluate(uint32_t First, uint32_t Last)
+{
+	const btTransform RootInverse = Root->getInverseTransform();
+	const btQuaternion RootRotation = RootTransform.getRotation();
+	const btQuaternion RootInverseRotation = RootInverse.getRotation();
+	const btQuaternion Identity = btQuaternion::getIdentity();
+
+	for (uint32_t Index = First; Index < Last; ++Index) {
+		int32_t Parent = Parents[Index];
+		int32_t Source = Sources[Index];
+
+		if (!Changed[Index] && !(Parent >= 0 ? Changed[Parent] : RootChanged) && !(Source >= 0 && Changed[Source]))
+			continue;
+		Changed[Index] = 1;
+
+		if (Parent >= 0) {
+			deform(Flags[Index], InheritRates[Index], Offsets[Index],
+				Rotations[Parent], Translations[Parent],
+				InverseRotations[Parent], InverseTranslations[Parent], IKRotations[Parent],
+				Source >= 0 ? &InheritedRotations[Source] : nullptr, Source >= 0 ? &InheritedTranslations[Source] : nullptr,
+				Source >= 0 ? IKRotations[Source] : Identity,
+				LocalRotations[Index], LocalTranslations[Index], IKRotations[Index],
+				InheritedRotations[Index], InheritedTranslations[Index], Rotations[Index], Translations[Index]);
+		}
+		else {
+			deform(Flags[Index], InheritRates[Index], Offsets[Index],
+				RootRotation, RootTransform.getOrigin(),
+				RootInverseRotation, RootInverse.getOrigin(), Identity,
+				Source >= 0 ? &InheritedRotations[Source] : nullptr, Source >= 0 ? &InheritedTranslations[Source] : nullptr,
+				Source >= 0 ? IKRotations[Source] : Identity,
+				LocalRotations[Index], LocalTranslations[Index], IKRotations[Index],
+				InheritedRotations[Index], InheritedTranslations[Index], Rotations[Index], Translations[Index]);
+		}
+	}
+}
+
+void BoneEvaluator::scatter(uint32_t First, uint32_t Last)
+{
+	for (uint32_t Index = First; Index < Last; ++Index) {
+		if (!Changed[Index])
+			continue;
+
+		auto Bone = Bones[Index];
+		Bone->InheritTransform = btTransform(InheritedRotations[Index], InheritedTranslations[Index]);
+		Bone->Transform = btTransform(Rotations[Index], Translations[Index]);
+	}
+}
+
+void BoneEvaluator::evaluateBone(uint16_t Flags, float InheritRate, const btVector3 &Offset,
+	const btTransform &ParentTransform, const btTransform &ParentInverse, const btQuaternion &ParentIK,
+	const btTransform *Source, const btQuaternion &SourceIK,
+	const btTransform &User, const btTransform &Morph, const btQuaternion &IK,
+	btTransform &Inherited, btTransform &Transform)
+{
+	btQuaternion SourceRotation;
+	btVector3 SourceTranslation;
+	if (Source) {
+		SourceRotation = Source->getRotation();
+		SourceTranslation = Source->getOrigin();
+	}
+
+	bool LocallyAttached = (Flags & (uint16_t)BoneFlags::LocallyAttached) != 0;
+
+	btQuaternion InheritedRotation, Rotation;
+	btVector3 InheritedTranslation, Translation;
+	deform(Flags, InheritRate, Offset,
+		ParentTransform.getRotation(), ParentTransform.getOrigin(),
+		LocallyAttached ? ParentInverse.getRotation() : btQuaternion::getIdentity(), ParentInverse.getOrigin(), ParentIK,
+		Source ? &SourceRotation : nullptr, Source ? &SourceTranslation : nullptr, SourceIK,
+		User.getRotation() * Morph.getRotation(), User.getOrigin() + Morph.getOrigin(), IK,
+		InheritedRotation, InheritedTranslation, Rotation, Translation);
+
+	Inherited = btTransform(InheritedRotation, InheritedTranslation);
+	Transform = btTransform(Rotation, Translation);
+}
+
+void BoneEvaluator::deform(uint16_t Flags, float InheritRate, const btVector3 &Offset,
+	const btQuaternion &ParentRotation, const btVector3 &ParentTranslation,
+	const btQuaternion &ParentInverseRotation, const btVector3 &ParentInverseTranslation, const btQuaternion &ParentIK,
+	const btQuaternion *SourceRotation, const btVector3 *SourceTranslation, const btQuaternion &SourceIK,
+	const btQuaternion &LocalRotation, const btVector3 &LocalTranslation, const btQuaternion &IK,
+	btQuaternion &InheritedRotation, btVector3 &InheritedTranslation, btQuaternion &Rotation, btVector3 &Translation)
+{
+	bool LocallyAttached = (Flags & (uint16_t)BoneFlags::LocallyAttached) != 0;
+
+	btVector3 Position(0, 0, 0);
+	btQuaternion Orientation = btQuaternion::getIdentity();
+
+	if (LocallyAttached) {
+		// The transform of the parent relative to its initial one
+		Position = quatRotate(ParentInverseRotation, ParentTranslation) + ParentInverseTranslation;
+		Orientation = ParentInverseRotation * ParentRotation;
+	}
+	else {
+		if ((Flags & (uint16_t)BoneFlags::TranslationAttached) != 0 && SourceTranslation)
+			Position = *SourceTranslation;
+
+		if ((Flags & (uint16_t)BoneFlags::RotationAttached) != 0) {
+			if (SourceRotation) Orientation = SourceIK * *SourceRotation;
+			else Orientation *= ParentIK;
+		}
+	}
+	if (InheritRate != 1.0f) {
+		Position *= InheritRate;
+		Orientation = btQuaternion::getIdentity().slerp(Orientation, InheritRate);
+	}
+
+	InheritedRotation = Orientation;
+	InheritedTranslation = Position;
+
+	Position += LocalTranslation + Offset;
+
+	Orientation *= LocalRotation;
+	Orientation *= IK;
+	Orientation.normalize();
+
+	if (LocallyAttached) {
+		Rotation = Orientation;
+		Translation = Position;
+	}
+	else {
+		Rotation = ParentRotation * Orientation;
+		Translation = quatRotate(ParentRotation, Position) + ParentTranslation;
+	}
+}
@@ -0,0 +1,169 @@
+//===-- PMX/PMXBoneEvaluator.h - Declares the flat bone evaluator ---*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the PMX::BoneEvaluator class, which computes the
+/// transforms of every bone of a model in a single pass over flat arrays
+///
+//===-------------------------------------------------------------------------===//
+
+#pragma once
+
+#include "PMXDefinitions.h"
+
+#include <LinearMath/btAlignedObjectArray.h>
+#include <LinearMath/btTransform.h>
+#include <cstdint>
+#include <vector>
+
+namespace PMX {
+
+class Bone;
+
+namespace detail {
+	class BoneImpl;
+}
+
+/// \brief Evaluates the bone hierarchy of a model from arrays sorted in deformation order
+///
+/// The bones keep being the interface motions, morphs, physics and IK work with. Before a
+/// pass, the evaluator copies the deformations of every bone into its arrays; it then walks
+/// them once, in the order the bones deform, with parents and inheritance sources referred
+/// to by index, and writes the resulting transforms back to the bones, so every reader of
+/// the bone objects sees the same values as before.
+///
+/// The bones are split in the ones deformed before the physics step and the ones deformed
+/// after it, each group sorted by deformation order and then by index, like PMX::Model
+/// always did.
+///
+/// Only the bones whose deformation changed since the last pass, and the bones depending
+/// on them through their parent or their inheritance source, are computed and written
+/// back. An idle or paused model costs little more than walking the flags.
+class BoneEvaluator
+{
+public:
+	BoneEvaluator();
+
+	/// \brief Builds the arrays of a model
+	///
+	/// \param [in] Root The root bone of the model, parent of the top level bones
+	/// \param [in] PrePhysics The bones deformed before the physics step, in deformation order
+	/// \param [in] PostPhysics The bones deformed after the physics step, in deformation order
+	void build(Bone *Root, const std::vector<Bone*> &PrePhysics, const std::vector<Bone*> &PostPhysics);
+
+	/// \brief Releases the arrays
+	void clear();
+
+	/// \brief Computes the bones deformed before the physics step
+	void updatePrePhysics();
+	/// \brief Computes the bones deformed after the physics step
+	///
+	/// The transforms the rigid bodies applied to simulated bones are picked up first.
+	void updatePostPhysics();
+
+	/// \brief Returns the amount of bones evaluated
+	uint32_t getBoneCount() const { return (uint32_t)Bones.size(); }
+
+	/// \brief Computes the transform inherited from other bones and the world transform of a bone
+	///
+	/// This is the whole deformation of a single bone, shared by the evaluator and by
+	/// detail::BoneImpl::update(), which still updates single bones during IK.
+	///
+	/// \param [in] Flags The BoneFlags of the bone
+	/// \param [in] InheritRate The rate of the rotation and translation taken from the inheritance source
+	/// \param [in] Offset The initial position of the bone relative to the initial position of its parent
+	/// \param [in] ParentTransform The world transform of the parent
+	/// \param [in] ParentInverse The inverse initial transform of the parent
+	/// \param [in] ParentIK The IK rotation of the parent
+	/// \param [in] Source The transform inherited by the inheritance source, or nullptr if there is none
+	/// \param [in] SourceIK The IK rotation of the inheritance source
+	/// \param [in] User The deformation applied by the user or by motions
+	/// \param [in] Morph The deformation applied by bone morphs
+	/// \param [in] IK The rotation applied by IK
+	/// \param [out] Inherited The transform other bones inherit from this one
+	/// \param [out] Transform The world transform of the bone
+	static void evaluateBone(uint16_t Flags, float InheritRate, const btVector3 &Offset,
+		const btTransform &ParentTransform, const btTransform &ParentInverse, const btQuaternion &ParentIK,
+		const btTransform *Source, const btQuaternion &SourceIK,
+		const btTransform &User, const btTransform &Morph, const btQuaternion &IK,
+		btTransform &Inherited, btTransform &Transform);
+
+private:
+	/// \brief Copies the changed deformations of the bones in a range into the arrays
+	void gather(uint32_t First, uint32_t Last);
+	/// \brief Computes the bones in a range which changed or depend on a changed bone
+	void evaluate(uint32_t First, uint32_t Last);
+	/// \brief Writes the transforms of the changed bones in a range back to them
+	void scatter(uint32_t First, uint32_t Last);
+
+	/// \brief The deformation of a single bone, on rotations and translations
+	///
+	/// Bone transforms never scale, so they are kept as a rotation followed by a
+	/// translation, which are cheaper to combine than matrices.
+	static void deform(uint16_t Flags, float InheritRate, const btVector3 &Offset,
+		const btQuaternion &ParentRotation, const btVector3 &ParentTranslation,
+		const btQuaternion &ParentInverseRotation, const btVector3 &ParentInverseTranslation, const btQuaternion &ParentIK,
+		const btQuaternion *SourceRotation, const btVector3 *SourceTranslation, const btQuaternion &SourceIK,
+		const btQuaternion &LocalRotation, const btVector3 &LocalTranslation, const btQuaternion &IK,
+		btQuaternion &InheritedRotation, btVector3 &InheritedTranslation, btQuaternion &Rotation, btVector3 &Translation);
+
+	Bone *Root;
+
+	/// \brief The bones, in evaluation order
+	std::vector<detail::BoneImpl*> Bones;
+	/// \brief The first bone deformed after the physics step
+	uint32_t PostPhysicsStart;
+
+	/// \brief The index of the parent of each bone, or -1 for the root bone
+	std::vector<int32_t> Parents;
+	/// \brief The index of the inheritance source of each bone, or -1 if there is none
+	std::vector<int32_t> Sources;
+	std::vector<uint16_t> Flags;
+	std::vector<float> InheritRates;
+	/// \brief The initial position of each bone relative to its parent
+	btAlignedObjectArray<btVector3> Offsets;
+	/// \brief The inverse initial transform of each bone
+	btAlignedObjectArray<btQuaternion> InverseRotations;
+	btAlignedObjectArray<btVector3> InverseTranslations;
+
+	/// \brief The user and morph deformations of each bone, combined
+	btAlignedObjectArray<btQuaternion> LocalRotations;
+	btAlignedObjectArray<btVector3> LocalTranslations;
+	btAlignedObjectArray<btQuaternion> IKRotations;
+
+	btAlignedObjectArray<btQuaternion> InheritedRotations;
+	btAlignedObjectArray<btVector3> InheritedTranslations;
+	/// \brief The world transform of each bone
+	btAlignedObjectArray<btQuaternion> Rotations;
+	btAlignedObjectArray<btVector3> Translations;
+
+	/// \brief The bones read by a bone deformed before them, which are copied back before each pass
+	///
+	/// IK and physics change those bones after they were evaluated, and the bones reading
+	/// them always saw the changed transforms of the previous frame.
+	std::vector<uint32_t> EarlyReads;
+	/// \brief The bones whose transform rigid bodies may set
+	std::vector<uint32_t> Simulated;
+
+	/// \brief Whether each bone has to be computed in the current pass
+	///
+	/// Set for the bones whose deformation changed or which IK solved, and while evaluating,
+	/// for the bones whose parent or inheritance source was computed.
+	std::vector<uint8_t> Changed;
+	/// \brief Whether each bone is computed on every pass, because it reads bones deformed
+	/// after it or rigid bodies move it
+	std::vector<uint8_t> Pinned;
+
+	/// \brief The root transform used by the last pass
+	btTransform RootTransform;
+	/// \brief Whether the root bone moved since the last pass
+	bool RootChanged;
+};
+
+}
@@ -0,0 +1,279 @@
+//===-- PMX/PMXBoneImpl.h - Declares the PMX bone implementations ---*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the classes implementing PMX::Bone, which are private
+/// to the bone code and the bone evaluator
+///
+//===-------------------------------------------------------------------------===//
+
+#pragma once
+
+#include "PMXBone.h"
+#include "GeometricPrimitive.h"
+
+#include <LinearMath/btAlignedObjectArray.h>
+#include <list>
+#include <memory>
+#include <vector>
+
+namespace PMX {
+class BoneEvaluator;
+
+namespace detail {
+	class RootBone
+		: public Bone
+	{
+	public:
+		RootBone(PMX::Model *Model) : Bone(Model, -1) {
+			Flags = (uint16_t)BoneFlags::Manipulable | (uint16_t)BoneFlags::Movable | (uint16_t)BoneFlags::Rotatable;
+		}
+
+		virtual bool isRootBone() { return true; }
+
+		virtual Bone* getRootBone() { return this; }
+
+		virtual btVector3 getStartPosition() { return btVector3(0, 0, 0); }
+
+		virtual void initialize(Loader::Bone *Data) {};
+		virtual void terminate() {};
+		virtual void update() {};
+
+		virtual void transform(const btVector3& Angles, const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User)
+		{
+			btQuaternion Rotation;
+			Rotation.setEulerZYX(Angles.x(), Angles.y(), Angles.z());
+			Transform.setRotation(Rotation * Transform.getRotation());
+			Transform.setOrigin(Transform.getOrigin() + Offset);
+
+			Inverse = Transform.inverse();
+		}
+
+		virtual void transform(const btTransform& Transform, DeformationOrigin Origin = DeformationOrigin::User)
+		{
+			this->Transform *= Transform;
+
+			Inverse = this->Transform.inverse();
+		}
+
+		virtual void rotate(const btVector3& Axis, float Angle, DeformationOrigin Origin = DeformationOrigin::User)
+		{
+			rotate(btQuaternion(Axis, Angle), Origin);
+		}
+
+		virtual void rotate(const btVector3& Angles, DeformationOrigin Origin = DeformationOrigin::User)
+		{
+			btQuaternion Rotation;
+			Rotation.setEulerZYX(Angles.x(), Angles.y(), Angles.z());
+			rotate(Rotation, Origin);
+		}
+
+		virtual void rotate(const btQuaternion& Rotation, DeformationOrigin Origin = DeformationOrigin::User)
+		{
+			Transform.setRotation(Rotation * Transform.getRotation());
+
+			Inverse = Transform.inverse();
+		}
+
+		virtual void translate(const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User)
+		{
+			Transform.setOrigin(Transform.getOrigin() + Offset);
+
+			Inverse = Transform.inverse();
+		}
+
+		virtual void resetTransform()
+		{
+			Transform.setIdentity();
+			Inverse.setIdentity();
+		}
+
+#if defined _M_IX86 && defined _MSC_VER
+		void *__cdecl operator new(size_t count){
+			return _aligned_malloc(count, 16);
+		}
+
+		void __cdecl operator delete(void *object) {
+			_aligned_free(object);
+		}
+#endif
+	};
+
+	class BoneImpl
+		: public Bone
+	{
+	public:
+		BoneImpl(PMX::Model *Model, uint32_t Id) : Bone(Model, Id){};
+
+		virtual btVector3 getPosition();
+
+		virtual void initialize(Loader::Bone *Data);
+		virtual void initializeDebug(ID3D11DeviceContext *Context);
+		virtual void terminate();
+
+		virtual void update();
+
+		virtual void transform(const btVector3& Angles, const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User);
+		virtual void transform(const btTransform& Transform, DeformationOrigin Origin = DeformationOrigin::User);
+		virtual void rotate(const btVector3& Axis, float Angle, DeformationOrigin Origin = DeformationOrigin::User);
+		virtual void rotate(const btVector3& Angles, DeformationOrigin Origin = DeformationOrigin::User);
+		virtual void rotate(const btQuaternion& Rotation, DeformationOrigin Origin = DeformationOrigin::User);
+		virtual void translate(const btVector3& Offset, DeformationOrigin Origin = DeformationOrigin::User);
+
+		virtual void resetTransform();
+
+		virtual void applyMorph(Morph *morph, float weight);
+		virtual void applyPhysicsTransform(btTransform &transform);
+
+		virtual void XM_CALLCONV render(DirectX::FXMMATRIX world, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection);
+
+		virtual btVector3 getStartPosition();
+		virtual btQuaternion getIKRotation() { return IkRotation; }
+
+		virtual btTransform getSkinningTransform() { return btTransform(btQuaternion::getIdentity(), -InitialPosition) * Transform; }
+
+		virtual Bone* getRootBone();
+
+		virtual void clearIK() { IkRotation = btQuaternion::getIdentity(); }
+
+		/**
+		 * @returns the length of this bone
+		 */
+		float getLength();
+		btVector3 getEndPosition(bool transform = true);
+		btQuaternion IkRotation;
+
+#if defined _M_IX86 && defined _MSC_VER
+		void *__cdecl operator new(size_t count){
+			return _aligned_malloc(count, 16);
+		}
+
+		void __cdecl operator delete(void *object) {
+			_aligned_free(object);
+		}
+#endif
+
+	protected:
+		btVector3 getOffsetPosition();
+
+		//! What changed since the bone was last evaluated by the BoneEvaluator
+		enum DirtyFlags : uint8_t {
+			//! The user or morph deformation changed
+			LocalDirty = 0x1,
+			//! The world transform was set from outside, by a rigid body
+			WorldDirty = 0x2,
+			//! The world transform was solved by IK after the bone was evaluated
+			SolvedDirty = 0x4,
+		};
+		uint8_t Dirty;
+
+		std::list<std::pair<Morph*, float>> appliedMorphs;
+
+		btTransform InheritTransform, UserTransform, MorphTransform;
+
+		btMatrix3x3 LocalAxis;
+		btVector3 AxisTranslation;
+		btVector3 InitialPosition, EndPosition;
+
+		btQuaternion DebugRotation;
+
+		BoneImpl *AttachedTo;
+		BoneImpl *InheritFrom;
+		float InheritRate;
+
+		float Length;
+
+		// Used for debug render
+		std::unique_ptr<DirectX::GeometricPrimitive> Primitive;
+
+		friend class PMX::BoneEvaluator;
+		friend class IKBone;
+	};
+
+	class IKBone
+		: public BoneImpl
+	{
+	public:
+		IKBone(PMX::Model *Model, uint32_t Id) : BoneImpl(Model, Id) {}
+
+		virtual void initialize(Loader::Bone *Data);
+		virtual void initializeDebug(ID3D11DeviceContext *Context);
+		virtual void terminate();
+
+		virtual bool isIK() { return true; }
+		virtual void performIK();
+		virtual IKSolution getIKSolution() { return LastSolution; }
+
+#if defined _M_IX86 && defined _MSC_VER
+		void *__cdecl operator new(size_t count){
+			return _aligned_malloc(count, 16);
+		}
+
+		void __cdecl operator delete(void *object) {
+			_aligned_free(object);
+		}
+#endif
+
+	private:
+		struct Node {
+			BoneImpl* Bone;
+			bool Limited;
+			struct {
+				float Lower[3];
+				float Upper[3];
+			} Limits;
+			//! The only axis a limited link rotates around, or -1 if it may rotate around several
+			int HingeAxis;
+		};
+
+		//! The state of a link, or of the target, while solving
+		struct ChainNode {
+			//! The transform relative to the chain node this one hangs from, without IK
+			btQuaternion LocalRotation;
+			btVector3 LocalPosition;
+			//! The world transform
+			btQuaternion Rotation;
+			btVector3 Position;
+			btQuaternion IK;
+			//! The link this node hangs from, or -1 if none of its ancestors is a link
+			int32_t Parent;
+			//! Whether this node moved in the current chain update
+			bool Moved;
+		};
+
+		//! Finds the link each chain node hangs from and the order to update them in
+		void buildChain();
+		//! Computes the world transform of a chain node from the one it hangs from
+		void updateNode(uint32_t Index);
+		//! Recomputes a link and the chain nodes hanging from it
+		void updateChain(uint32_t Link);
+		//! Rotates a link so the target gets closer to Destination, returns false if it did not move
+		bool rotateLink(uint32_t Index, const btVector3 &Destination);
+
+		BoneImpl *TargetBone;
+
+		float ChainLength;
+
+		int LoopCount;
+
+		float AngleLimit;
+
+		std::vector<Node> Links;
+
+		//! The links followed by the target, reused by every solve
+		btAlignedObjectArray<ChainNode> Chain;
+		//! The chain nodes, each one after the node it hangs from
+		std::vector<uint32_t> ChainOrder;
+		//! The position of each chain node in ChainOrder
+		std::vector<uint32_t> ChainPositions;
+
+		IKSolution LastSolution;
+	};
+}
+}
@@ -0,0 +1,803 @@
+//===-- PMX/PMXCache.cpp - Defines the precompiled PMX model cache ----*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===---------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the PMX::Cache class, which reads and writes the
+/// precompiled binary model cache (.pmxc)
+///
+//===---------------------------------------------------------------------------===//
+
+#include "PMXCache.h"
+
+#include "PMXModel.h"
+#include "../MappedFile.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <cstring>
+#include <vector>
+
+using namespace PMX;
+
+namespace fs = boost::filesystem;
+
+namespace {
+	enum SectionId : uint32_t {
+		StringTable,
+		StringData,
+		Description,
+		Positions,
+		Normals,
+		UVs,
+		AdditionalUVs,
+		WeightMethods,
+		BoneIndices,
+		BoneWeights,
+		EdgeWeights,
+		SDEFVertices,
+		SDEFParameters,
+		Indices,
+		Textures,
+		Materials,
+		Bones,
+		IKLinks,
+		Morphs,
+		MorphData,
+		Frames,
+		FrameElements,
+		RigidBodies,
+		Joints,
+		SoftBodies,
+		Anchors,
+		Pins,
+		SectionCount
+	};
+
+	struct FileHeader {
+		char Magic[4];
+		uint32_t Version;
+		uint64_t SourceSize;
+		int64_t SourceTime;
+		uint64_t SourceHash;
+		struct {
+			uint64_t Offset;
+			uint64_t Count;
+		} Sections[SectionCount];
+	};
+
+	typedef uint32_t StringId;
+
+	struct StringEntry {
+		/// \brief Offset of the first UTF-16 code unit in the StringData section
+		uint32_t Offset;
+		/// \brief Length in UTF-16 code units
+		uint32_t Length;
+	};
+
+	struct NameRecord {
+		StringId Japanese;
+		StringId English;
+	};
+
+	struct MaterialRecord {
+		NameRecord Name;
+		Color4 Diffuse;
+		Color Specular;
+		float SpecularCoefficient;
+		Color Ambient;
+		Color4 EdgeColor;
+		float EdgeSize;
+		uint32_t BaseTexture;
+		uint32_t SphereTexture;
+		uint32_t ToonTexture;
+		StringId FreeField;
+		int32_t IndexCount;
+		uint8_t Flags;
+		MaterialSphereMode SphereMode;
+		MaterialToonMode ToonFlag;
+		uint8_t Padding;
+	};
+
+	struct BoneRecord {
+		NameRecord Name;
+		DirectX::XMFLOAT3 InitialPosition;
+		uint32_t Parent;
+		int32_t DeformationOrder;
+		uint16_t Flags;
+		uint16_t HasIK;
+		decltype(Loader::Bone::Size) Size;
+		decltype(Loader::Bone::Inherit) Inherit;
+		DirectX::XMFLOAT3 AxisTranslation;
+		decltype(Loader::Bone::LocalAxes) LocalAxes;
+		int32_t ExternalDeformationKey;
+		uint32_t IKTarget;
+		int32_t IKLoopCount;
+		float IKAngleLimit;
+		uint32_t IKLinkFirst;
+		uint32_t IKLinkCount;
+	};
+
+	struct MorphRecord {
+		NameRecord Name;
+		uint8_t Operation;
+		uint8_t Type;
+		uint8_t Padding[2];
+		uint32_t DataFirst;
+		uint32_t DataCount;
+	};
+
+	struct FrameRecord {
+		NameRecord Name;
+		uint8_t Type;
+		uint8_t Padding[3];
+		uint32_t ElementFirst;
+		uint32_t ElementCount;
+	};
+
+	struct RigidBodyRecord {
+		NameRecord Name;
+		uint32_t TargetBone;
+		uint16_t GroupMask;
+		uint8_t Group;
+		RigidBodyShape Shape;
+		DirectX::XMFLOAT3 Size;
+		DirectX::XMFLOAT3 Position;
+		DirectX::XMFLOAT3 Rotation;
+		float Mass;
+		float LinearDamping;
+		float AngularDamping;
+		float Restitution;
+		float Friction;
+		RigidBodyMode Mode;
+		uint8_t Padding[3];
+	};
+
+	struct JointRecord {
+		NameRecord Name;
+		JointType Type;
+		uint8_t Padding[3];
+		decltype(Loader::Joint::data) Data;
+	};
+
+	struct SoftBodyRecord {
+		NameRecord Name;
+		uint32_t Material;
+		uint16_t GroupFlags;
+		uint8_t Group;
+		SoftBody::Shape::Shape_e Shape;
+		SoftBody::Flags::Flags_e Flags;
+		uint8_t Padding[3];
+		int32_t BlinkCreationDistance;
+		int32_t ClusterCount;
+		float Mass;
+		float CollisionMargin;
+		SoftBody::AeroModel::AeroModel_e AeroModel;
+		SoftBody::Config Config;
+		SoftBody::Cluster Cluster;
+		SoftBody::Iteration Iteration;
+		SoftBody::Material MaterialInfo;
+		uint32_t AnchorFirst;
+		uint32_t AnchorCount;
+		uint32_t PinFirst;
+		uint32_t PinCount;
+	};
+
+	/// \brief Accumulates the sections of a cache file before it is written
+	class Writer {
+	public:
+		template <class T>
+		uint32_t push(SectionId Id, const T &Value) {
+			auto &Section = Sections[Id];
+			uint32_t Index = (uint32_t)(Section.size() / sizeof(T));
+			Section.insert(Section.end(), (const char*)&Value, (const char*)&Value + sizeof(T));
+			return Index;
+		}
+
+		/// \brief Stores a whole array as a section
+		template <class T>
+		void pushArray(SectionId Id, const std::vector<T> &Values) {
+			Sections[Id].assign((const char*)Values.data(), (const char*)(Values.data() + Values.size()));
+			Counts[Id] = Values.size();
+		}
+
+		StringId addString(const std::wstring &String) {
+			StringEntry Entry;
+			Entry.Offset = (uint32_t)(Sections[StringData].size() / sizeof(uint16_t));
+			Entry.Length = (uint32_t)String.size();
+
+			for (auto Char : String) {
+				uint16_t Unit = (uint16_t)Char;
+				push(StringData, Unit);
+			}
+
+			return push(StringTable, Entry);
+		}
+
+		NameRecord addName(const Name &Name) {
+			NameRecord Record;
+			Record.Japanese = addString(Name.japanese);
+			Record.English = addString(Name.english);
+			return Record;
+		}
+
+		void setCount(SectionId Id, uint64_t Count) { Counts[Id] = Count; }
+
+		uint64_t count(SectionId Id) const {
+			return Id == StringTable ? Sections[Id].size() / sizeof(StringEntry)
+				: Id == StringData ? Sections[Id].size() / sizeof(uint16_t) : Counts[Id];
+		}
+
+		bool write(const fs::path &Path, FileHeader &Header) {
+			fs::ofstream Output(Path, std::ios::binary | std::ios::trunc);
+			if (!Output.good())
+				return false;
+
+			// Every section starts 16 byte aligned, so the mapped records can be used in place
+			uint64_t Offset = alignTo(sizeof(FileHeader));
+			for (uint32_t Id = 0; Id < SectionCount; ++Id) {
+				Header.Sections[Id].Offset = Offset;
+				Header.Sections[Id].Count = Counts[Id];
+				Offset = alignTo(Offset + Sections[Id].size());
+			}
+
+			static const char Zeroes[16] = { 0 };
+			Output.write((const char*)&Header, sizeof(FileHeader));
+			Output.write(Zeroes, alignTo(sizeof(FileHeader)) - sizeof(FileHeader));
+			for (uint32_t Id = 0; Id < SectionCount; ++Id) {
+				Output.write(Sections[Id].data(), Sections[Id].size());
+				Output.write(Zeroes, alignTo(Sections[Id].size()) - Sections[Id].size());
+			}
+
+			return Output.good();
+		}
+
+	private:
+		static uint64_t alignTo(uint64_t Value) { return (Value + 15) & ~(uint64_t)15; }
+
+		std::vector<char> Sections[SectionCount];
+		uint64_t Counts[SectionCount] = {};
+	};
+
+	/// \brief Gives checked access to the sections of a mapped cache file
+	class Reader {
+	public:
+		Reader(const MappedFile &File) : File(File) {
+			Header = (const FileHeader*)File.data();
+		}
+
+		template <class T>
+		const T* section(SectionId Id, size_t &Count) {
+			auto &Entry = Header->Sections[Id];
+			if (Entry.Offset > File.size() || Entry.Count > (File.size() - Entry.Offset) / sizeof(T))
+				throw Loader::Exception("Corrupt cache section");
+
+			Count = (size_t)Entry.Count;
+			return (const T*)(File.data() + Entry.Offset);
+		}
+
+		/// \brief Reads a whole section into an array, which must have Count elements
+		template <class T>
+		void readArray(SectionId Id, std::vector<T> &Output, size_t Count) {
+			size_t SectionCount;
+			auto Values = section<T>(Id, SectionCount);
+			if (SectionCount != Count)
+				throw Loader::Exception("Corrupt cache section");
+
+			Output.assign(Values, Values + Count);
+		}
+
+		void prepareStrings() {
+			Strings = section<StringEntry>(StringTable, StringCount);
+			Chars = section<uint16_t>(StringData, CharCount);
+		}
+
+		std::wstring string(StringId Id) {
+			if (Id >= StringCount || Strings[Id].Offset > CharCount || Strings[Id].Length > CharCount - Strings[Id].Offset)
+				throw Loader::Exception("Corrupt cache string");
+
+			const uint16_t *First = Chars + Strings[Id].Offset;
+			return std::wstring(First, First + Strings[Id].Length);
+		}
+
+		void name(Name &Output, const NameRecord &Record) {
+			Output.japanese = string(Record.Japanese);
+			Output.english = string(Record.English);
+		}
+
+		static void checkRange(uint32_t First, uint32_t Count, size_t Size) {
+			if (First > Size || Count > Size - First)
+				throw Loader::Exception("Corrupt cache range");
+		}
+
+		const FileHeader *Header;
+
+	private:
+		const MappedFile &File;
+		const StringEntry *Strings;
+		const uint16_t *Chars;
+		size_t StringCount, CharCount;
+	};
+
+	bool getSourceInfo(const std::wstring &FileName, uint64_t &Size, int64_t &Time) {
+		boost::system::error_code Error;
+		Size = (uint64_t)fs::file_size(FileName, Error);
+		if (Error) return false;
+		Time = (int64_t)fs::last_write_time(FileName, Error);
+		return !Error;
+	}
+}
+
+std::wstring Cache::getCachePath(const std::wstring &FileName)
+{
+	return fs::path(FileName).replace_extension(L".pmxc").wstring();
+}
+
+uint64_t Cache::hash(const char *Data, size_t Size)
+{
+	uint64_t Hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < Size; ++i) {
+		Hash ^= (uint8_t)Data[i];
+		Hash *= 1099511628211ULL;
+	}
+
+	return Hash;
+}
+
+bool Cache::load(Model *Model, Loader *ModelLoader, const std::wstring &FileName, SourceInfo *Source)
+{
+	SourceInfo Info;
+	Info.Hashed = false;
+	if (Source != nullptr)
+		Source->Hashed = false;
+
+	if (!getSourceInfo(FileName, Info.Size, Info.Time))
+		return false;
+
+	MappedFile File;
+	if (!File.open(getCachePath(FileName)) || File.size() < sizeof(FileHeader))
+		return false;
+
+	Reader Input(File);
+	auto Header = Input.Header;
+	if (memcmp(Header->Magic, "PMXC", 4) != 0 || Header->Version != Version || Header->SourceSize != Info.Size)
+		return false;
+
+	// The file was touched but may not have changed, compare its contents before giving up
+	bool Touched = Header->SourceTime != Info.Time;
+	if (Touched) {
+		MappedFile SourceFile;
+		if (!SourceFile.open(FileName))
+			return false;
+
+		Info.Hash = hash(SourceFile.data(), SourceFile.size());
+		Info.Hashed = true;
+		if (Source != nullptr)
+			*Source = Info;
+
+		if (Info.Hash != Header->SourceHash)
+			return false;
+	}
+
+	try {
+		size_t Count, LinkCount, DataCount, ElementCount, AnchorCount, PinCount;
+		Input.prepareStrings();
+
+		auto Names = Input.section<NameRecord>(Description, Count);
+		if (Count != 2) return false;
+		Input.name(Model->description.name, Names[0]);
+		Input.name(Model->description.comment, Names[1]);
+
+		// Every vertex array must be as long as the positions one
+		auto &Vertices = Model->vertexData;
+		Input.section<DirectX::XMFLOAT3>(Positions, Count);
+		size_t UVCount;
+		Input.section<DirectX::XMFLOAT4>(AdditionalUVs, UVCount);
+		if (Count > 0 ? (UVCount % Count != 0 || UVCount / Count > 4) : UVCount != 0)
+			return false;
+
+		Vertices.resize(Count, Count > 0 ? (uint32_t)(UVCount / Count) : 0);
+		Input.readArray(Positions, Vertices.positions, Count);
+		Input.readArray(Normals, Vertices.normals, Count);
+		Input.readArray(UVs, Vertices.uvs, Count);
+		Input.readArray(AdditionalUVs, Vertices.additionalUVs, UVCount);
+		Input.readArray(WeightMethods, Vertices.weightMethods, Count);
+		Input.readArray(BoneIndices, Vertices.boneIndices, Count);
+		Input.readArray(BoneWeights, Vertices.boneWeights, Count);
+		Input.readArray(EdgeWeights, Vertices.edgeWeights, Count);
+		Input.section<uint32_t>(SDEFVertices, Count);
+		Input.readArray(SDEFVertices, Vertices.sdefVertices, Count);
+		Input.readArray(SDEFParameters, Vertices.sdefParameters, Count);
+
+		auto IndexRecords = Input.section<uint32_t>(Indices, Count);
+		Model->verticesIndex.assign(IndexRecords, IndexRecords + Count);
+
+		auto TextureRecords = Input.section<StringId>(Textures, Count);
+		Model->textures.resize(Count);
+		for (size_t i = 0; i < Count; ++i)
+			Model->textures[i] = Input.string(TextureRecords[i]);
+
+		auto MaterialRecords = Input.section<MaterialRecord>(Materials, Count);
+		Model->materials.resize(Count);
+		for (size_t i = 0; i < Count; ++i) {
+			auto &Record = MaterialRecords[i];
+			auto Material = Model->materials[i] = new PMX::Material;
+			Input.name(Material->name, Record.Name);
+			Material->diffuse = Record.Diffuse;
+			Material->specular = Record.Specular;
+			Material->specularCoefficient = Record.SpecularCoefficient;
+			Material->ambient = Record.Ambient;
+			Material->flags = Record.Flags;
+			Material->edgeColor = Record.EdgeColor;
+			Material->edgeSize = Record.EdgeSize;
+			Material->baseTexture = Record.BaseTexture;
+			Material->sphereTexture = Record.SphereTexture;
+			Material->sphereMode = Record.SphereMode;
+			Material->toonFlag = Record.ToonFlag;
+			if (Record.ToonFlag == MaterialToonMode::DefaultTexture)
+				Material->toonTexture.default = (uint8_t)Record.ToonTexture;
+			else
+				Material->toonTexture.custom = Record.ToonTexture;
+			Material->freeField = Input.string(Record.FreeField);
+			Material->indexCount = Record.IndexCount;
+		}
+
+		auto Links = Input.section<IK::Node>(IKLinks, LinkCount);
+		auto BoneRecords = Input.section<BoneRecord>(Bones, Count);
+		ModelLoader->Bones.resize(Count);
+		for (size_t i = 0; i < Count; ++i) {
+			auto &Record = BoneRecords[i];
+			auto &Bone = ModelLoader->Bones[i];
+			Input.name(Bone.Name, Record.Name);
+			Bone.InitialPosition = Record.InitialPosition;
+			Bone.Parent = Record.Parent;
+			Bone.DeformationOrder = Record.DeformationOrder;
+			Bone.Flags = Record.Flags;
+			Bone.Size = Record.Size;
+			Bone.Inherit = Record.Inherit;
+			Bone.AxisTranslation = Record.AxisTranslation;
+			Bone.LocalAxes = Record.LocalAxes;
+			Bone.ExternalDeformationKey = Record.ExternalDeformationKey;
+			Bone.IkData = nullptr;
+
+			if (Record.HasIK) {
+				Reader::checkRange(Record.IKLinkFirst, Record.IKLinkCount, LinkCount);
+				Bone.IkData = new IK;
+				Bone.IkData->targetIndex = Record.IKTarget;
+				Bone.IkData->loopCount = Record.IKLoopCount;
+				Bone.IkData->angleLimit = Record.IKAngleLimit;
+				Bone.IkData->links.assign(Links + Record.IKLinkFirst, Links + Record.IKLinkFirst + Record.IKLinkCount);
+			}
+		}
+
+		auto Data = Input.section<MorphType>(MorphData, DataCount);
+		auto MorphRecords = Input.section<MorphRecord>(Morphs, Count);
+		Model->morphs.resize(Count);
+		for (size_t i = 0; i < Count; ++i) {
+			auto &Record = MorphRecords[i];
+			auto Morph = Model->morphs[i] = new PMX::Morph;
+			Input.name(Morph->name, Record.Name);
+			Morph->operation = Record.Operation;
+			Morph->type = Record.Type;
+			Reader::checkRange(Record.DataFirst, Record.DataCount, DataCount);
+			Morph->data.assign(Data + Record.DataFirst, Data + Record.DataFirst + Record.DataCount);
+		}
+
+		auto Elements = Input.section<FrameMorphs>(FrameElements, ElementCount);
+		auto FrameRecords = Input.section<FrameRecord>(Frames, Count);
+		Model->frames.resize(Count);
+		for (size_t i = 0; i < Count; ++i) {
+			auto &Record = FrameRecords[i];
+			auto Frame = Model->frames[i] = new PMX::Frame;
+			Input.name(Frame->name, Record.Name);
+			Frame->type = Record.Type;
+			Reader::checkRange(Record.ElementFirst, Record.ElementCount, ElementCount);
+			Frame->morphs.assign(Elements + Record.ElementFirst, Elements + Record.ElementFirst + Record.ElementCount);
+		}
+
+		auto BodyRecords = Input.section<RigidBodyRecord>(RigidBodies, Count);
+		ModelLoader->RigidBodies.resize(Count);
+		for (size_t i = 0; i < Count; ++i) {
+			auto &Record = BodyRecords[i];
+			auto &Body = ModelLoader->RigidBodies[i];
+			Input.name(Body.name, Record.Name);
+			Body.targetBone = Record.TargetBone;
+			Body.group = Record.Group;
+			Body.groupMask = Record.GroupMask;
+			Body.shape = Record.Shape;
+			Body.size = Record.Size;
+			Body.position = Record.Position;
+			Body.rotation = Record.Rotation;
+			Body.mass = Record.Mass;
+			Body.linearDamping = Record.LinearDamping;
+			Body.angularDamping = Record.AngularDamping;
+			Body.restitution = Record.Restitution;
+			Body.friction = Record.Friction;
+			Body.mode = Record.Mode;
+		}
+
+		auto JointRecords = Input.section<JointRecord>(Joints, Count);
+		ModelLoader->Joints.resize(Count);
+		for (size_t i = 0; i < Count; ++i) {
+			auto &Joint = ModelLoader->Joints[i];
+			Input.name(Joint.name, JointRecords[i].Name);
+			Joint.type = JointRecords[i].Type;
+			Joint.data = JointRecords[i].Data;
+		}
+
+		auto AnchorRecords = Input.section<SoftBody::AnchorRigidBody>(Anchors, AnchorCount);
+		auto PinRecords = Input.section<SoftBody::Pin>(Pins, PinCount);
+		auto SoftBodyRecords = Input.section<SoftBodyRecord>(SoftBodies, Count);
+		Model->softBodies.resize(Count);
+		for (size_t i = 0; i < Count; ++i) {
+			auto &Record = SoftBodyRecords[i];
+			auto Body = Model->softBodies[i] = new SoftBody;
+			Input.name(Body->name, Record.Name);
+			Body->shape = Record.Shape;
+			Body->material = Record.Material;
+			Body->group = Record.Group;
+			Body->groupFlags = Record.GroupFlags;
+			Body->flags = Record.Flags;
+			Body->blinkCreationDistance = Record.BlinkCreationDistance;
+			Body->clusterCount = Record.ClusterCount;
+			Body->mass = Record.Mass;
+			Body->collisionMargin = Record.CollisionMargin;
+			Body->model = Record.AeroModel;
+			Body->config = Record.Config;
+			Body->cluster = Record.Cluster;
+			Body->iteration = Record.Iteration;
+			Body->materialInfo = Record.MaterialInfo;
+			Reader::checkRange(Record.AnchorFirst, Record.AnchorCount, AnchorCount);
+			Body->anchors.assign(AnchorRecords + Record.AnchorFirst, AnchorRecords + Record.AnchorFirst + Record.AnchorCount);
+			Reader::checkRange(Record.PinFirst, Record.PinCount, PinCount);
+			Body->pins.assign(PinRecords + Record.PinFirst, PinRecords + Record.PinFirst + Record.PinCount);
+		}
+
+		// A cache file is as untrusted as the model itself
+		ModelLoader->validateReferences(Model);
+	}
+	catch (Loader::Exception &) {
+		return false;
+	}
+
+	// The contents still match, store the new write time so the next load does not hash the source again
+	if (Touched) {
+		File.close();
+
+		fs::fstream Output(fs::path(getCachePath(FileName)), std::ios::binary | std::ios::in | std::ios::out);
+		Output.seekp(offsetof(FileHeader, SourceTime));
+		Output.write((const char*)&Info.Time, sizeof(Info.Time));
+	}
+
+	return true;
+}
+
+bool Cache::save(Model *Model, Loader *ModelLoader, const std::wstring &FileName, const SourceInfo *Source)
+{
+	FileHeader Header;
+	memset(&Header, 0, sizeof(FileHeader));
+	memcpy(Header.Magic, "PMXC", 4);
+	Header.Version = Version;
+
+	if (Source != nullptr && Source->Hashed) {
+		// load() hashed the source before it was parsed, so the cache matches what was loaded
+		Header.SourceSize = Source->Size;
+		Header.SourceTime = Source->Time;
+		Header.SourceHash = Source->Hash;
+	}
+	else {
+		if (!getSourceInfo(FileName, Header.SourceSize, Header.SourceTime))
+			return false;
+
+		MappedFile SourceFile;
+		if (!SourceFile.open(FileName) || SourceFile.size() != Header.SourceSize)
+			return false;
+		Header.SourceHash = hash(SourceFile.data(), SourceFile.size());
+	}
+
+	Writer Output;
+
+	Output.push(Description, Output.addName(Model->description.name));
+	Output.push(Description, Output.addName(Model->description.comment));
+	Output.setCount(Description, 2);
+
+	auto &Vertices = Model->vertexData;
+	Output.pushArray(Positions, Vertices.positions);
+	Output.pushArray(Normals, Vertices.normals);
+	Output.pushArray(UVs, Vertices.uvs);
+	Output.pushArray(AdditionalUVs, Vertices.additionalUVs);
+	Output.pushArray(WeightMethods, Vertices.weightMethods);
+	Output.pushArray(BoneIndices, Vertices.boneIndices);
+	Output.pushArray(BoneWeights, Vertices.boneWeights);
+	Output.pushArray(EdgeWeights, Vertices.edgeWeights);
+	Output.pushArray(SDEFVertices, Vertices.sdefVertices);
+	Output.pushArray(SDEFParameters, Vertices.sdefParameters);
+
+	Output.pushArray(Indices, Model->verticesIndex);
+
+	for (auto &Texture : Model->textures)
+		Output.push(Textures, Output.addString(Texture));
+	Output.setCount(Textures, Model->textures.size());
+
+	for (auto &Material : Model->materials) {
+		MaterialRecord Record;
+		memset(&Record, 0, sizeof(MaterialRecord));
+		Record.Name = Output.addName(Material->name);
+		Record.Diffuse = Material->diffuse;
+		Record.Specular = Material->specular;
+		Record.SpecularCoefficient = Material->specularCoefficient;
+		Record.Ambient = Material->ambient;
+		Record.Flags = Material->flags;
+		Record.EdgeColor = Material->edgeColor;
+		Record.EdgeSize = Material->edgeSize;
+		Record.BaseTexture = Material->baseTexture;
+		Record.SphereTexture = Material->sphereTexture;
+		Record.SphereMode = Material->sphereMode;
+		Record.ToonFlag = Material->toonFlag;
+		Record.ToonTexture = Material->toonFlag == MaterialToonMode::DefaultTexture ? Material->toonTexture.default : Material->toonTexture.custom;
+		Record.FreeField = Output.addString(Material->freeField);
+		Record.IndexCount = Material->indexCount;
+		Output.push(Materials, Record);
+	}
+	Output.setCount(Materials, Model->materials.size());
+
+	uint32_t LinkCount = 0;
+	for (auto &Bone : ModelLoader->Bones) {
+		BoneRecord Record;
+		memset(&Record, 0, sizeof(BoneRecord));
+		Record.Name = Output.addName(Bone.Name);
+		Record.InitialPosition = Bone.InitialPosition;
+		Record.Parent = Bone.Parent;
+		Record.DeformationOrder = Bone.DeformationOrder;
+		Record.Flags = Bone.Flags;
+		Record.Size = Bone.Size;
+		Record.Inherit = Bone.Inherit;
+		Record.AxisTranslation = Bone.AxisTranslation;
+		Record.LocalAxes = Bone.LocalAxes;
+		Record.ExternalDeformationKey = Bone.ExternalDeformationKey;
+
+		if (Bone.IkData) {
+			Record.HasIK = 1;
+			Record.IKTarget = Bone.IkData->targetIndex;
+			Record.IKLoopCount = Bone.IkData->loopCount;
+			Record.IKAngleLimit = Bone.IkData->angleLimit;
+			Record.IKLinkFirst = LinkCount;
+			Record.IKLinkCount = (uint32_t)Bone.IkData->links.size();
+			for (auto &Link : Bone.IkData->links)
+				Output.push(IKLinks, Link);
+			LinkCount += Record.IKLinkCount;
+		}
+
+		Output.push(Bones, Record);
+	}
+	Output.setCount(Bones, ModelLoader->Bones.size());
+	Output.setCount(IKLinks, LinkCount);
+
+	uint32_t DataCount = 0;
+	for (auto &Morph : Model->morphs) {
+		MorphRecord Record;
+		memset(&Record, 0, sizeof(MorphRecord));
+		Record.Name = Output.addName(Morph->name);
+		Record.Operation = Morph->operation;
+		Record.Type = Morph->type;
+		Record.DataFirst = DataCount;
+		Record.DataCount = (uint32_t)Morph->data.size();
+		for (auto &Data : Morph->data)
+			Output.push(MorphData, Data);
+		DataCount += Record.DataCount;
+		Output.push(Morphs, Record);
+	}
+	Output.setCount(Morphs, Model->morphs.size());
+	Output.setCount(MorphData, DataCount);
+
+	uint32_t ElementCount = 0;
+	for (auto &Frame : Model->frames) {
+		FrameRecord Record;
+		memset(&Record, 0, sizeof(FrameRecord));
+		Record.Name = Output.addName(Frame->name);
+		Record.Type = Frame->type;
+		Record.ElementFirst = ElementCount;
+		Record.ElementCount = (uint32_t)Frame->morphs.size();
+		for (auto &Element : Frame->morphs)
+			Output.push(FrameElements, Element);
+		ElementCount += Record.ElementCount;
+		Output.push(Frames, Record);
+	}
+	Output.setCount(Frames, Model->frames.size());
+	Output.setCount(FrameElements, ElementCount);
+
+	for (auto &Body : ModelLoader->RigidBodies) {
+		RigidBodyRecord Record;
+		memset(&Record, 0, sizeof(RigidBodyRecord));
+		Record.Name = Output.addName(Body.name);
+		Record.TargetBone = Body.targetBone;
+		Record.Group = Body.group;
+		Record.GroupMask = Body.groupMask;
+		Record.Shape = Body.shape;
+		Record.Size = Body.size;
+		Record.Position = Body.position;
+		Record.Rotation = Body.rotation;
+		Record.Mass = Body.mass;
+		Record.LinearDamping = Body.linearDamping;
+		Record.AngularDamping = Body.angularDamping;
+		Record.Restitution = Body.restitution;
+		Record.Friction = Body.friction;
+		Record.Mode = Body.mode;
+		Output.push(RigidBodies, Record);
+	}
+	Output.setCount(RigidBodies, ModelLoader->RigidBodies.size());
+
+	for (auto &Joint : ModelLoader->Joints) {
+		JointRecord Record;
+		memset(&Record, 0, sizeof(JointRecord));
+		Record.Name = Output.addName(Joint.name);
+		Record.Type = Joint.type;
+		Record.Data = Joint.data;
+		Output.push(Joints, Record);
+	}
+	Output.setCount(Joints, ModelLoader->Joints.size());
+
+	uint32_t AnchorCount = 0, PinCount = 0;
+	for (auto &Body : Model->softBodies) {
+		SoftBodyRecord Record;
+		memset(&Record, 0, sizeof(SoftBodyRecord));
+		Record.Name = Output.addName(Body->name);
+		Record.Shape = Body->shape;
+		Record.Material = Body->material;
+		Record.Group = Body->group;
+		Record.GroupFlags = Body->groupFlags;
+		Record.Flags = Body->flags;
+		Record.BlinkCreationDistance = Body->blinkCreationDistance;
+		Record.ClusterCount = Body->clusterCount;
+		Record.Mass = Body->mass;
+		Record.CollisionMargin = Body->collisionMargin;
+		Record.AeroModel = Body->model;
+		Record.Config = Body->config;
+		Record.Cluster = Body->cluster;
+		Record.Iteration = Body->iteration;
+		Record.MaterialInfo = Body->materialInfo;
+		Record.AnchorFirst = AnchorCount;
+		Record.AnchorCount = (uint32_t)Body->anchors.size();
+		Record.PinFirst = PinCount;
+		Record.PinCount = (uint32_t)Body->pins.size();
+		for (auto &Anchor : Body->anchors)
+			Output.push(Anchors, Anchor);
+		for (auto &Pin : Body->pins)
+			Output.push(Pins, Pin);
+		AnchorCount += Record.AnchorCount;
+		PinCount += Record.PinCount;
+		Output.push(SoftBodies, Record);
+	}
+	Output.setCount(SoftBodies, Model->softBodies.size());
+	Output.setCount(Anchors, AnchorCount);
+	Output.setCount(Pins, PinCount);
+
+	// The string sections are filled while the others are built, so they are counted last
+	Output.setCount(StringTable, Output.count(StringTable));
+	Output.setCount(StringData, Output.count(StringData));
+
+	fs::path CachePath(getCachePath(FileName)), TemporaryPath(CachePath);
+	TemporaryPath += L".tmp";
+
+	if (!Output.write(TemporaryPath, Header)) {
+		boost::system::error_code Error;
+		fs::remove(TemporaryPath, Error);
+		return false;
+	}
+
+	// Replace the old cache only once the new one is complete
+	boost::system::error_code Error;
+	fs::rename(TemporaryPath, CachePath, Error);
+	if (Error) {
+		fs::remove(TemporaryPath, Error);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,80 @@
+//===-- PMX/PMXCache.h - Declares the precompiled PMX model cache ----*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the PMX::Cache class, which reads and writes the
+/// precompiled binary model cache (.pmxc)
+///
+//===--------------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace PMX {
+
+class Loader;
+class Model;
+
+/// \brief Reads and writes precompiled models
+///
+/// A .pmxc file is stored next to its .pmx source and holds the model already
+/// decoded into flat arrays (one per vertex attribute, indices, bones, morphs, rigid bodies,
+/// joints...)
+/// with every string stored once as UTF-16 in a string table. All references inside
+/// the file are offsets relative to its start, so it can be mapped at any address and
+/// read back without decoding anything.
+///
+/// A cache is considered valid for a source file when the size and the last write time
+/// stored in it match the source; if only the size matches, the content hash of the
+/// source is compared before the cache is discarded, and the last write time of a cache
+/// whose hash matched is updated, so the source is hashed only once.
+class Cache
+{
+public:
+	/// \brief The version of the cache format, bump whenever the layout changes
+	static const uint32_t Version = 2;
+
+	/// \brief What load() found out about a source file, so save() does not hash it again
+	struct SourceInfo {
+		uint64_t Size;
+		int64_t Time;
+		uint64_t Hash;
+		/// \brief Whether Hash was computed
+		bool Hashed;
+	};
+
+	/// \brief Returns the path of the cache file for a model
+	static std::wstring getCachePath(const std::wstring &FileName);
+
+	/// \brief Loads a model from its cache, if it is valid
+	///
+	/// \param [in] Model The model to be filled
+	/// \param [in] ModelLoader The loader that will hold the bones, rigid bodies and joints
+	/// \param [in] FileName The path of the .pmx source file
+	/// \param [out] Source What was found out about the source file, to be given to save(), may be nullptr
+	/// \returns false if the cache does not exist, is outdated or is corrupt
+	static bool load(Model *Model, Loader *ModelLoader, const std::wstring &FileName, SourceInfo *Source = nullptr);
+
+	/// \brief Writes the cache for an already loaded model
+	///
+	/// \param [in] Model The model, just loaded from its source
+	/// \param [in] ModelLoader The loader used to load the model
+	/// \param [in] FileName The path of the .pmx source file
+	/// \param [in] Source What the failed load() found out about the source file, may be nullptr
+	/// \returns Whether the cache file was written or not
+	static bool save(Model *Model, Loader *ModelLoader, const std::wstring &FileName, const SourceInfo *Source = nullptr);
+
+	/// \brief Computes the 64-bit FNV-1a hash of a buffer
+	static uint64_t hash(const char *Data, size_t Size);
+};
+
+}
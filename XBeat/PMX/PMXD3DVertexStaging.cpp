@@ -0,0 +1,38 @@
+//===-- PMX/PMXD3DVertexStaging.cpp - Defines vertex uploads to Direct3D --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the PMX::D3DVertexStaging class, which uploads vertex
+/// ranges to a Direct3D 11 buffer
+///
+//===--------------------------------------------------------------------------------===//
+
+#include "PMXD3DVertexStaging.h"
+
+using namespace PMX;
+
+D3DVertexStaging::D3DVertexStaging(ID3D11DeviceContext *Context, ID3D11Buffer *Buffer, UINT Stride)
+	: Context(Context), Buffer(Buffer), Stride(Stride)
+{
+}
+
+bool D3DVertexStaging::upload(uint32_t First, uint32_t Count, const void *Data)
+{
+	if (Context == nullptr || Buffer == nullptr)
+		return false;
+
+	D3D11_BOX Box;
+	Box.left = First * Stride;
+	Box.right = (First + Count) * Stride;
+	Box.top = Box.front = 0;
+	Box.bottom = Box.back = 1;
+
+	Context->UpdateSubresource(Buffer, 0, &Box, Data, 0, 0);
+	return true;
+}
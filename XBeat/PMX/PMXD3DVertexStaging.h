@@ -0,0 +1,38 @@
+//===-- PMX/PMXD3DVertexStaging.h - Declares vertex uploads to Direct3D --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the PMX::D3DVertexStaging class, which uploads vertex
+/// ranges to a Direct3D 11 buffer
+///
+//===-------------------------------------------------------------------------------===//
+
+#pragma once
+
+#include "PMXVertexStaging.h"
+
+#include <D3D11.h>
+
+namespace PMX {
+
+/// \brief Uploads to a D3D11_USAGE_DEFAULT buffer through UpdateSubresource
+class D3DVertexStaging : public VertexStaging
+{
+public:
+	D3DVertexStaging(ID3D11DeviceContext *Context, ID3D11Buffer *Buffer, UINT Stride);
+
+	virtual bool upload(uint32_t First, uint32_t Count, const void *Data);
+
+private:
+	ID3D11DeviceContext *Context;
+	ID3D11Buffer *Buffer;
+	UINT Stride;
+};
+
+}
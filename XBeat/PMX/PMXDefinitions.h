@@ -250,48 +250,70 @@ union MorphType {
 	};
 };
 
-struct Vertex {
-	DirectX::XMFLOAT3 position;
-	DirectX::XMFLOAT3 normal;
-	float uv[2];
-	DirectX::XMFLOAT4 uvEx[4];
-	VertexWeightMethod weightMethod;
-	union {
-		struct {
-			uint32_t boneIndexes[4];
-			float weights[4];
-		} BDEF;
-		struct {
-			uint32_t boneIndexes[2];
-			float weightBias;
-			float C[3];
-			float R0[3];
-			float R1[3];
-		} SDEF;
-	} boneInfo;
-	float edgeWeight;
-
-	Bone *bones[4];
-	std::list<std::pair<RenderMaterial*, UINT>> materials;
-	struct MorphData {
-		Morph *morph;
-		MorphType *type;
-		float weight;
-	};
-	std::list<MorphData*> morphs;
-	DirectX::XMVECTOR MorphOffset;
-
-	uint32_t index;
+struct SDEFParameters {
+	DirectX::XMFLOAT3 C;
+	DirectX::XMFLOAT3 R0;
+	DirectX::XMFLOAT3 R1;
+};
 
-#if defined _M_IX86 && defined _MSC_VER
-	void *__cdecl operator new(size_t count) {
-		return _aligned_malloc(count, 16);
+/**
+ * \brief Stores every vertex of a model as a set of contiguous arrays, one per attribute
+ *
+ * Vertex i is made of the i-th element of each per-vertex array.
+ */
+struct VertexData {
+	std::vector<DirectX::XMFLOAT3> positions;
+	std::vector<DirectX::XMFLOAT3> normals;
+	std::vector<DirectX::XMFLOAT2> uvs;
+	/**
+	 * \brief additionalUVCount consecutive entries per vertex
+	 */
+	std::vector<DirectX::XMFLOAT4> additionalUVs;
+	uint32_t additionalUVCount;
+	std::vector<VertexWeightMethod> weightMethods;
+	/**
+	 * \brief Unused influences have index 0 and weight 0, SDEF vertices store (bias, 1 - bias) as weights
+	 */
+	std::vector<DirectX::XMUINT4> boneIndices;
+	std::vector<DirectX::XMFLOAT4> boneWeights;
+	std::vector<float> edgeWeights;
+	/**
+	 * \brief The extra SDEF parameters, only for SDEF vertices, along with the vertex each one belongs to
+	 */
+	std::vector<uint32_t> sdefVertices;
+	std::vector<SDEFParameters> sdefParameters;
+
+	/**
+	 * \brief The sum of every vertex morph currently applied to each vertex
+	 */
+	std::vector<DirectX::XMFLOAT4> morphOffsets;
+
+	VertexData() : additionalUVCount(0) {}
+
+	size_t size() const { return positions.size(); }
+
+	/**
+	 * \brief Resizes every per-vertex array
+	 */
+	void resize(size_t count, uint32_t uvCount) {
+		positions.resize(count);
+		normals.resize(count);
+		uvs.resize(count);
+		additionalUVCount = uvCount;
+		additionalUVs.resize(count * uvCount);
+		weightMethods.resize(count);
+		boneIndices.resize(count);
+		boneWeights.resize(count);
+		edgeWeights.resize(count);
+		morphOffsets.assign(count, DirectX::XMFLOAT4(0.0f, 0.0f, 0.0f, 0.0f));
 	}
 
-	void __cdecl operator delete(void *object) {
-		_aligned_free(object);
+	/**
+	 * \brief Releases the memory of every array
+	 */
+	void clear() {
+		*this = VertexData();
 	}
-#endif
 };
 
 struct Material{
@@ -14,14 +14,32 @@
 
 #include "PMXBone.h"
 #include "PMXModel.h"
+#include "../MappedFile.h"
 
+#include "../Dispatcher.h"
+
+#include <algorithm>
+#include <atomic>
 #include <codecvt>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 using namespace std;
 using namespace PMX;
 
 bool Loader::loadFromFile(Model* model, const std::wstring &filename)
 {
+	MappedFile mapping;
+	if (mapping.open(filename)) {
+		const char *cursor = mapping.data();
+		return loadFromMemory(model, cursor, mapping.size());
+	}
+
+	// Fallback for files that cannot be mapped
 	std::ifstream ifile;
 	ifile.open(filename, std::ios::binary);
 	if (!ifile.good())
@@ -32,6 +50,16 @@ bool Loader::loadFromFile(Model* model, const std::wstring &filename)
 	return ret;
 }
 
+bool Loader::loadFromMappedFile(Model* model, const std::wstring &filename)
+{
+	MappedFile mapping;
+	if (!mapping.open(filename))
+		return false;
+
+	const char *cursor = mapping.data();
+	return loadFromMemory(model, cursor, mapping.size());
+}
+
 bool Loader::loadFromStream(Model* model, std::istream &in)
 {
 	std::istream::pos_type pos = in.tellg();
@@ -40,49 +68,62 @@ bool Loader::loadFromStream(Model* model, std::istream &in)
 	len -= pos;
 	in.seekg(pos, in.beg);
 
-	char *data = new char[len];
-	const char *cursor = data;
-
-	in.read(data, len);
-	bool ret = loadFromMemory(model, cursor);
-	in.seekg(pos + (std::istream::pos_type)(cursor - data), in.beg);
+	// Owned by a vector, so a malformed file throwing out of loadFromMemory does not leak it
+	std::vector<char> data((size_t)len);
+	const char *cursor = data.data();
 
-	delete[] data;
+	in.read(data.data(), len);
+	bool ret = loadFromMemory(model, cursor, data.size());
+	in.seekg(pos + (std::istream::pos_type)(cursor - data.data()), in.beg);
 
 	return ret;
 }
 
-bool Loader::loadFromMemory(Model* model, const char *&data)
+bool Loader::loadFromMemory(Model* model, const char *&data, size_t length)
 {
-	Header = loadHeader(data);
+	Cursor cursor(data, data + length);
+
+	if (length < sizeof(FileHeader) + sizeof(FileSizeInfo))
+		return false;
+
+	Header = loadHeader(cursor);
 	// Check if we have a valid header
 	if (Header == nullptr)
 		return false;
 
-	SizeInfo = loadSizeInfo(data);
+	SizeInfo = loadSizeInfo(cursor);
 
-	loadDescription(model->description, data);
+	loadDescription(model->description, cursor);
 
-	loadVertexData(model, data);
+	if (Tasks != nullptr) {
+		loadSectionsInParallel(model, cursor);
+	}
+	else {
+		loadVertexData(model, cursor);
 
-	loadIndexData(model, data);
+		loadIndexData(model, cursor);
 
-	loadTextures(model, data);
+		loadTextures(model, cursor);
 
-	loadMaterials(model, data);
+		loadMaterials(model, cursor);
 
-	loadBones(model, data);
+		loadBones(model, cursor);
 
-	loadMorphs(model, data);
+		loadMorphs(model, cursor);
 
-	loadFrames(model, data);
+		loadFrames(model, cursor);
 
-	loadRigidBodies(model, data);
+		loadRigidBodies(model, cursor);
 
-	loadJoints(model, data);
+		loadJoints(model, cursor);
 
-	if (Header->Version >= 2.1f)
-		loadSoftBodies(model, data);
+		if (Header->Version >= 2.1f && cursor.remaining() > 0)
+			loadSoftBodies(model, cursor);
+	}
+
+	validateReferences(model);
+
+	data = cursor.Data;
 
 	return true;
 }
@@ -95,53 +136,266 @@ ModelDescription Loader::getDescription(const std::wstring &filename)
 		throw Exception("Unable to open the requested filename");
 
 	ifile.seekg(0, ifile.end);
-	std::istream::pos_type len = ifile.tellg();
+	size_t fileSize = (size_t)ifile.tellg();
 	ifile.seekg(0, ifile.beg);
 
-	char *data = new char[len];
-	const char *cursor = data;
-
-	ifile.read(data, len);
-
-	auto header = loadHeader(cursor);
-	if (header == nullptr) throw Exception("Unrecognized file format");
-	SizeInfo = loadSizeInfo(cursor);
-	ModelDescription output;
-	loadDescription(output, cursor);
-
-	delete[] data;
-	ifile.close();
+	// The header and both names almost always fit in the first few kilobytes
+	std::vector<char> data;
+	size_t wanted = std::min<size_t>(4096, fileSize);
+
+	for (;;) {
+		size_t read = data.size();
+		data.resize(wanted);
+		ifile.read(data.data() + read, wanted - read);
+		data.resize(read + (size_t)ifile.gcount());
+
+		Cursor cursor(data.data(), data.data() + data.size());
+
+		try {
+			auto header = loadHeader(cursor);
+			if (header == nullptr) throw Exception("Unrecognized file format");
+			SizeInfo = loadSizeInfo(cursor);
+			ModelDescription output;
+			loadDescription(output, cursor);
+			return output;
+		}
+		catch (UnexpectedEnd &e) {
+			// The name lengths come from the file, so read only what they ask for and never past its end
+			size_t needed = data.size() + e.Missing;
+			if (data.size() < wanted || needed > fileSize)
+				throw;
 
-	return output;
+			wanted = needed;
+		}
+	}
 }
 
 template <class T>
-void readInfo(T& value, const char *&data)
+void readInfo(T& value, Loader::Cursor &data)
 {
-	memcpy(&value, data, sizeof (T));
-	data += sizeof (T);
+	memcpy(&value, data.take(sizeof (T)), sizeof (T));
 }
 template <class T>
-T readInfo(const char *&data)
+T readInfo(Loader::Cursor &data)
 {
 	T value;
-	memcpy(&value, data, sizeof (T));
-	data += sizeof (T);
+	memcpy(&value, data.take(sizeof (T)), sizeof (T));
 
 	return value;
 }
 template <class T>
-void readVector(T* vec, size_t size, const char *&data)
+void readVector(T* vec, size_t size, Loader::Cursor &data)
+{
+	memcpy(vec, data.take(sizeof (T) * size), sizeof (T) * size);
+}
+
+namespace {
+	/// \brief A section decoded on the dispatcher
+	///
+	/// The loading thread runs the task itself if no dispatcher thread picked it up by the
+	/// time its result is needed, so loading never stalls behind a busy thread pool (or
+	/// deadlocks when the model is loaded from a dispatcher thread).
+	class SectionTask {
+	public:
+		SectionTask(std::function<void(void)> Body) : Body(Body), Claimed(false), Done(false) {}
+
+		void run() {
+			if (Claimed.exchange(true))
+				return;
+
+			try {
+				Body();
+			}
+			catch (...) {
+				Error = std::current_exception();
+			}
+
+			std::lock_guard<std::mutex> Lock(Synchronizer);
+			Done = true;
+			Finished.notify_all();
+		}
+
+		/// \brief Waits for the task to finish and returns the exception it threw, if any
+		std::exception_ptr wait() {
+			run();
+
+			std::unique_lock<std::mutex> Lock(Synchronizer);
+			while (!Done) Finished.wait(Lock);
+
+			return Error;
+		}
+
+	private:
+		std::function<void(void)> Body;
+		std::atomic<bool> Claimed;
+		bool Done;
+		std::exception_ptr Error;
+		std::mutex Synchronizer;
+		std::condition_variable Finished;
+	};
+
+	std::shared_ptr<SectionTask> startSection(Dispatcher *Tasks, std::function<void(void)> Body)
+	{
+		auto Task = std::make_shared<SectionTask>(Body);
+		Tasks->addTask([Task] { Task->run(); });
+		return Task;
+	}
+}
+
+void Loader::loadSectionsInParallel(Model *model, Cursor &data)
 {
-	for (size_t s = 0; s < size; s++) {
-		readInfo<T>(vec[s], data);
+	// The skip functions only check what they need to find the end of a section. When one
+	// of them fails, the section is decoded right away so the error is the one the serial
+	// path would have reported
+	auto skipOrLoad = [this, model, &data](void (Loader::*skip)(Cursor&), void (Loader::*load)(Model*, Cursor&)) {
+		Cursor section = data;
+		try {
+			(this->*skip)(data);
+		}
+		catch (Exception &) {
+			(this->*load)(model, section);
+			throw;
+		}
+		return section;
+	};
+
+	// Vertices come first and can be decoded without anything else
+	Cursor vertexData = skipOrLoad(&Loader::skipVertexData, &Loader::loadVertexData);
+	auto vertexTask = startSection(Tasks, [this, model, &vertexData] { loadVertexData(model, vertexData); });
+	std::shared_ptr<SectionTask> indexTask, morphTask;
+
+	// Errors are kept per section and reported in file order, so a broken file fails with
+	// the same exception it would have failed with when decoded serially
+	std::exception_ptr earlyError, lateError;
+	Cursor indexData = data, morphData = data;
+
+	try {
+		indexData = skipOrLoad(&Loader::skipIndexData, &Loader::loadIndexData);
+		indexTask = startSection(Tasks, [this, model, &indexData] { loadIndexData(model, indexData); });
+
+		loadTextures(model, data);
+		loadMaterials(model, data);
+		loadBones(model, data);
+
+		morphData = skipOrLoad(&Loader::skipMorphs, &Loader::loadMorphs);
+		morphTask = startSection(Tasks, [this, model, &morphData] { loadMorphs(model, morphData); });
+
+		loadFrames(model, data);
+		loadRigidBodies(model, data);
+		loadJoints(model, data);
+
+		if (Header->Version >= 2.1f && data.remaining() > 0)
+			loadSoftBodies(model, data);
+	}
+	catch (...) {
+		if (morphTask) lateError = std::current_exception();
+		else earlyError = std::current_exception();
+	}
+
+	// Every task must be finished before leaving, they all write to the model
+	std::exception_ptr errors[] = {
+		vertexTask->wait(),
+		indexTask ? indexTask->wait() : nullptr,
+		earlyError,
+		morphTask ? morphTask->wait() : nullptr,
+		lateError
+	};
+
+	for (auto &error : errors) {
+		if (error) std::rethrow_exception(error);
 	}
 }
 
-Loader::FileHeader* Loader::loadHeader(const char *&data)
+void Loader::skipVertexData(Cursor &data)
 {
-	FileHeader *header = (FileHeader*)data;
-	data += sizeof FileHeader;
+	size_t minimumSize = sizeof(float) * 8 + sizeof(float) * 4 * SizeInfo->UVVectorSize + 1 + SizeInfo->BoneIndexSize + sizeof(float);
+	size_t count = readCount(minimumSize, data);
+
+	while (count-- > 0) {
+		data.take(sizeof(float) * 8 + sizeof(float) * 4 * SizeInfo->UVVectorSize);
+
+		switch (readInfo<VertexWeightMethod>(data)) {
+		case VertexWeightMethod::BDEF1:
+			data.take(SizeInfo->BoneIndexSize);
+			break;
+		case VertexWeightMethod::BDEF2:
+			data.take(SizeInfo->BoneIndexSize * 2 + sizeof(float));
+			break;
+		case VertexWeightMethod::QDEF:
+		case VertexWeightMethod::BDEF4:
+			data.take(SizeInfo->BoneIndexSize * 4 + sizeof(float) * 4);
+			break;
+		case VertexWeightMethod::SDEF:
+			data.take(SizeInfo->BoneIndexSize * 2 + sizeof(float) * 10);
+			break;
+		default:
+			throw Exception("Invalid value for vertex weight method");
+		}
+
+		data.take(sizeof(float));
+	}
+}
+
+void Loader::skipIndexData(Cursor &data)
+{
+	data.take(readCount(SizeInfo->VertexIndexSize, data) * SizeInfo->VertexIndexSize);
+}
+
+void Loader::skipMorphs(Cursor &data)
+{
+	size_t count = readCount(sizeof(uint32_t) * 2 + 2 + sizeof(int), data);
+
+	while (count-- > 0) {
+		// Both names
+		data.take(readInfo<uint32_t>(data));
+		data.take(readInfo<uint32_t>(data));
+
+		readInfo<uint8_t>(data);
+		uint8_t type = readInfo<uint8_t>(data);
+		size_t dataCount = readCount(std::min({ SizeInfo->VertexIndexSize, SizeInfo->BoneIndexSize, SizeInfo->MaterialIndexSize, SizeInfo->MorphIndexSize, SizeInfo->RigidBodyIndexSize }), data);
+
+		size_t recordSize;
+		switch (type) {
+		case MorphType::Flip:
+		case MorphType::Group:
+			recordSize = SizeInfo->MorphIndexSize + sizeof(float);
+			break;
+		case MorphType::Vertex:
+			recordSize = SizeInfo->VertexIndexSize + sizeof(float) * 3;
+			break;
+		case MorphType::Bone:
+			recordSize = SizeInfo->BoneIndexSize + sizeof(float) * 7;
+			break;
+		case MorphType::UV:
+		case MorphType::UV1:
+		case MorphType::UV2:
+		case MorphType::UV3:
+		case MorphType::UV4:
+			recordSize = SizeInfo->VertexIndexSize + sizeof(float) * 4;
+			break;
+		case MorphType::Material:
+			recordSize = SizeInfo->MaterialIndexSize + 1 + sizeof(float) * 28;
+			break;
+		case MorphType::Impulse:
+			recordSize = SizeInfo->RigidBodyIndexSize + 1 + sizeof(float) * 6;
+			break;
+		default:
+			// An empty morph of an unknown type is accepted by loadMorphs
+			if (dataCount > 0)
+				throw Exception("Invalid morph type");
+			recordSize = 0;
+			break;
+		}
+
+		if (dataCount > data.remaining() / std::max<size_t>(recordSize, 1))
+			throw Exception("Unexpected end of file");
+		data.take(dataCount * recordSize);
+	}
+}
+
+Loader::FileHeader* Loader::loadHeader(Cursor &data)
+{
+	FileHeader *header = (FileHeader*)data.take(sizeof FileHeader);
 
 	// Check file signature
 	if (strncmp("Pmx ", header->Magic, 4) != 0 && strncmp("PMX ", header->Magic, 4) != 0)
@@ -154,82 +408,109 @@ Loader::FileHeader* Loader::loadHeader(const char *&data)
 	return header;
 }
 
-Loader::FileSizeInfo* Loader::loadSizeInfo(const char *&data)
+Loader::FileSizeInfo* Loader::loadSizeInfo(Cursor &data)
 {
-	FileSizeInfo *sizeInfo = (FileSizeInfo*)data;
-	data += sizeof FileSizeInfo;
+	FileSizeInfo *sizeInfo = (FileSizeInfo*)data.take(sizeof FileSizeInfo);
+
+	if (sizeInfo->Encoding > 1)
+		throw Exception("Invalid string encoding");
+
+	if (sizeInfo->UVVectorSize > 4)
+		throw Exception("Invalid amount of additional UV components");
+
+	auto isValidIndexSize = [](uint8_t size) { return size == 1 || size == 2 || size == 4; };
+	if (!isValidIndexSize(sizeInfo->VertexIndexSize) || !isValidIndexSize(sizeInfo->TextureIndexSize) ||
+		!isValidIndexSize(sizeInfo->MaterialIndexSize) || !isValidIndexSize(sizeInfo->BoneIndexSize) ||
+		!isValidIndexSize(sizeInfo->MorphIndexSize) || !isValidIndexSize(sizeInfo->RigidBodyIndexSize))
+		throw Exception("Invalid index size");
 
 	return sizeInfo;
 }
 
-void Loader::loadDescription(ModelDescription &desc, const char *&data)
+size_t Loader::readCount(size_t minimumSize, Cursor &data)
+{
+	int count = readInfo<int>(data);
+
+	// A negative count or one that cannot fit in what is left of the file is a sign of a corrupt file,
+	// so refuse it before anyone tries to allocate memory for it
+	if (count < 0 || (size_t)count > data.remaining() / minimumSize)
+		throw Exception("Invalid element count");
+
+	return (size_t)count;
+}
+
+void Loader::loadDescription(ModelDescription &desc, Cursor &data)
 {
 	readName(desc.name, data);
 	readName(desc.comment, data);
 }
 
-void Loader::loadVertexData(Model *model, const char*& data) {
-	model->vertices.resize(readInfo<int>(data));
+void Loader::loadVertexData(Model *model, Cursor &data) {
+	// Position, normal, UV, additional UVs, weight method, a single bone index and the edge weight
+	size_t minimumSize = sizeof(float) * 8 + sizeof(float) * 4 * SizeInfo->UVVectorSize + 1 + SizeInfo->BoneIndexSize + sizeof(float);
+	auto &vertices = model->vertexData;
+	vertices.resize(readCount(minimumSize, data), SizeInfo->UVVectorSize);
 
 	int i;
-	uint32_t id = 0;
 
-	for (auto &vertex : model->vertices)
+	for (uint32_t id = 0; id < vertices.size(); ++id)
 	{
-		vertex = new Vertex;
-		readVector<float>(&vertex->position.x, 3, data);
-		readVector<float>(&vertex->normal.x, 3, data);
-		readVector<float>(vertex->uv, 2, data);
-		readVector<float>(&vertex->uvEx[0].x, SizeInfo->UVVectorSize, data);
-		vertex->weightMethod = readInfo<VertexWeightMethod>(data);
-		std::memset(&vertex->boneInfo, 0, sizeof(vertex->boneInfo));
-		switch (vertex->weightMethod)
+		readVector<float>(&vertices.positions[id].x, 3, data);
+		readVector<float>(&vertices.normals[id].x, 3, data);
+		readVector<float>(&vertices.uvs[id].x, 2, data);
+		if (SizeInfo->UVVectorSize > 0)
+			readVector<float>(&vertices.additionalUVs[id * SizeInfo->UVVectorSize].x, 4 * SizeInfo->UVVectorSize, data);
+
+		auto &method = vertices.weightMethods[id];
+		auto &indices = vertices.boneIndices[id];
+		auto &weights = vertices.boneWeights[id];
+		method = readInfo<VertexWeightMethod>(data);
+		indices = DirectX::XMUINT4(0, 0, 0, 0);
+		weights = DirectX::XMFLOAT4(0.0f, 0.0f, 0.0f, 0.0f);
+
+		switch (method)
 		{
 		case VertexWeightMethod::BDEF1:
-			vertex->boneInfo.BDEF.boneIndexes[0] = readAsU32(SizeInfo->BoneIndexSize, data);
-			vertex->boneInfo.BDEF.weights[0] = 1.0f;
+			indices.x = readAsU32(SizeInfo->BoneIndexSize, data);
+			weights.x = 1.0f;
 			break;
 		case VertexWeightMethod::BDEF2:
-			for (i = 0; i < 2; i++)
-				vertex->boneInfo.BDEF.boneIndexes[i] = readAsU32(SizeInfo->BoneIndexSize, data);
+			indices.x = readAsU32(SizeInfo->BoneIndexSize, data);
+			indices.y = readAsU32(SizeInfo->BoneIndexSize, data);
 
-			vertex->boneInfo.BDEF.weights[0] = readInfo<float>(data);
-			vertex->boneInfo.BDEF.weights[1] = 1.0f - vertex->boneInfo.BDEF.weights[0];
+			weights.x = readInfo<float>(data);
+			weights.y = 1.0f - weights.x;
 			break;
 		case VertexWeightMethod::QDEF:
 			if (Header->Version < 2.1f)
 				throw Exception("QDEF not supported on PMX version lower than 2.1");
 		case VertexWeightMethod::BDEF4:
 			for (i = 0; i < 4; i++)
-				vertex->boneInfo.BDEF.boneIndexes[i] = readAsU32(SizeInfo->BoneIndexSize, data);
-			readVector(vertex->boneInfo.BDEF.weights, 4, data);
+				(&indices.x)[i] = readAsU32(SizeInfo->BoneIndexSize, data);
+			readVector<float>(&weights.x, 4, data);
 			break;
 		case VertexWeightMethod::SDEF:
-			vertex->boneInfo.SDEF.boneIndexes[0] = readAsU32(SizeInfo->BoneIndexSize, data);
-			vertex->boneInfo.SDEF.boneIndexes[1] = readAsU32(SizeInfo->BoneIndexSize, data);
-			vertex->boneInfo.SDEF.weightBias = readInfo<float>(data);
-			readVector<float>(vertex->boneInfo.SDEF.C, 3, data);
-			readVector<float>(vertex->boneInfo.SDEF.R0, 3, data);
-			readVector<float>(vertex->boneInfo.SDEF.R1, 3, data);
+			indices.x = readAsU32(SizeInfo->BoneIndexSize, data);
+			indices.y = readAsU32(SizeInfo->BoneIndexSize, data);
+			weights.x = readInfo<float>(data);
+			weights.y = 1.0f - weights.x;
+
+			vertices.sdefVertices.push_back(id);
+			vertices.sdefParameters.emplace_back();
+			readVector<float>(&vertices.sdefParameters.back().C.x, 3, data);
+			readVector<float>(&vertices.sdefParameters.back().R0.x, 3, data);
+			readVector<float>(&vertices.sdefParameters.back().R1.x, 3, data);
 			break;
 		default:
 			throw Exception("Invalid value for vertex weight method");
 		}
-		vertex->edgeWeight = readInfo<float>(data);
-		vertex->index = id++;
-
-		// Set some defaults
-		for (int i = 0; i < 4; i++) {
-			vertex->bones[i] = nullptr;
-		}
-
-		vertex->MorphOffset = DirectX::XMVectorZero();
+		vertices.edgeWeights[id] = readInfo<float>(data);
 	}
 }
 
-void Loader::loadIndexData(Model *model, const char *&data)
+void Loader::loadIndexData(Model *model, Cursor &data)
 {
-	model->verticesIndex.resize(readInfo<int>(data));
+	model->verticesIndex.resize(readCount(SizeInfo->VertexIndexSize, data));
 
 	for (auto &index : model->verticesIndex)
 	{
@@ -237,9 +518,9 @@ void Loader::loadIndexData(Model *model, const char *&data)
 	}
 }
 
-void Loader::loadTextures(Model *model, const char *&data)
+void Loader::loadTextures(Model *model, Cursor &data)
 {
-	model->textures.resize(readInfo<int>(data));
+	model->textures.resize(readCount(sizeof(uint32_t), data));
 
 	for (auto &texture : model->textures)
 	{
@@ -247,9 +528,11 @@ void Loader::loadTextures(Model *model, const char *&data)
 	}
 }
 
-void Loader::loadMaterials(Model *model, const char *&data)
+void Loader::loadMaterials(Model *model, Cursor &data)
 {
-	model->materials.resize(readInfo<int>(data));
+	// Name, colors, flags, edge, textures, sphere and toon modes, memo and index count
+	size_t minimumSize = sizeof(uint32_t) * 2 + sizeof(float) * 11 + 1 + sizeof(float) * 5 + SizeInfo->TextureIndexSize * 2 + 3 + sizeof(uint32_t) + sizeof(int);
+	model->materials.resize(readCount(minimumSize, data));
 
 	for (auto &material : model->materials)
 	{
@@ -266,8 +549,8 @@ void Loader::loadMaterials(Model *model, const char *&data)
 		readInfo<Color4>(material->edgeColor, data);
 		material->edgeSize = readInfo<float>(data);
 
-		material->baseTexture = readAsU32(SizeInfo->MaterialIndexSize, data);
-		material->sphereTexture = readAsU32(SizeInfo->MaterialIndexSize, data);
+		material->baseTexture = readAsU32(SizeInfo->TextureIndexSize, data);
+		material->sphereTexture = readAsU32(SizeInfo->TextureIndexSize, data);
 		material->sphereMode = readInfo<MaterialSphereMode>(data);
 		material->toonFlag = readInfo<MaterialToonMode>(data);
 
@@ -278,17 +561,23 @@ void Loader::loadMaterials(Model *model, const char *&data)
 		case MaterialToonMode::CustomTexture:
 			material->toonTexture.custom = readAsU32(SizeInfo->TextureIndexSize, data);
 			break;
+		default:
+			throw Exception("Invalid material toon mode");
 		}
 
 		material->freeField = getString(data);
 
 		material->indexCount = readInfo<int>(data);
+		if (material->indexCount < 0 || material->indexCount % 3 != 0)
+			throw Exception("Invalid material index count");
 	}
 }
 
-void Loader::loadBones(Model *model, const char *&data)
+void Loader::loadBones(Model *model, Cursor &data)
 {
-	Bones.resize(readInfo<int>(data));
+	// Name, position, parent, deformation order, flags and the smallest possible connection
+	size_t minimumSize = sizeof(uint32_t) * 2 + sizeof(float) * 3 + SizeInfo->BoneIndexSize * 2 + sizeof(int) + sizeof(uint16_t);
+	Bones.resize(readCount(minimumSize, data));
 
 	uint32_t id = 0;
 
@@ -334,7 +623,7 @@ void Loader::loadBones(Model *model, const char *&data)
 			Bone.IkData->loopCount = readInfo<int>(data);
 			Bone.IkData->angleLimit = readInfo<float>(data);
 
-			Bone.IkData->links.resize(readInfo<int>(data));
+			Bone.IkData->links.resize(readCount(SizeInfo->BoneIndexSize + 1, data));
 			for (auto &Link : Bone.IkData->links) {
 				Link.boneIndex = readAsU32(SizeInfo->BoneIndexSize, data);
 				Link.limitAngle = readInfo<bool>(data);
@@ -348,9 +637,9 @@ void Loader::loadBones(Model *model, const char *&data)
 	}
 }
 
-void Loader::loadMorphs(Model *model, const char *&data)
+void Loader::loadMorphs(Model *model, Cursor &data)
 {
-	model->morphs.resize(readInfo<int>(data));
+	model->morphs.resize(readCount(sizeof(uint32_t) * 2 + 2 + sizeof(int), data));
 	
 	for (auto &morph : model->morphs)
 	{
@@ -359,7 +648,7 @@ void Loader::loadMorphs(Model *model, const char *&data)
 
 		morph->operation = readInfo<uint8_t>(data);
 		morph->type = readInfo<uint8_t>(data);
-		morph->data.resize(readInfo<int>(data));
+		morph->data.resize(readCount(std::min({ SizeInfo->VertexIndexSize, SizeInfo->BoneIndexSize, SizeInfo->MaterialIndexSize, SizeInfo->MorphIndexSize, SizeInfo->RigidBodyIndexSize }), data));
 
 		for (auto &mdata : morph->data)
 		{
@@ -377,7 +666,7 @@ void Loader::loadMorphs(Model *model, const char *&data)
 				readVector<float>(mdata.vertex.offset, 3, data);
 				break;
 			case MorphType::Bone:
-				mdata.bone.index = readAsU32(SizeInfo->VertexIndexSize, data);
+				mdata.bone.index = readAsU32(SizeInfo->BoneIndexSize, data);
 				readVector<float>(mdata.bone.movement, 3, data);
 				readVector<float>(mdata.bone.rotation, 4, data);
 				break;
@@ -418,16 +707,16 @@ void Loader::loadMorphs(Model *model, const char *&data)
 	}
 }
 
-void Loader::loadFrames(Model *model, const char *&data)
+void Loader::loadFrames(Model *model, Cursor &data)
 {
-	model->frames.resize(readInfo<int>(data));
+	model->frames.resize(readCount(sizeof(uint32_t) * 2 + 1 + sizeof(int), data));
 
 	for (auto &frame : model->frames)
 	{
 		frame = new Frame;
 		readName(frame->name, data);
 		frame->type = readInfo<uint8_t>(data);
-		frame->morphs.resize(readInfo<int>(data));
+		frame->morphs.resize(readCount(1 + std::min(SizeInfo->BoneIndexSize, SizeInfo->MorphIndexSize), data));
 
 		for (auto &morph : frame->morphs)
 		{
@@ -439,14 +728,18 @@ void Loader::loadFrames(Model *model, const char *&data)
 			case FrameMorphTarget::Morph:
 				morph.id = readAsU32(SizeInfo->MorphIndexSize, data);
 				break;
+			default:
+				throw Exception("Invalid frame element target");
 			}
 		}
 	}
 }
 
-void Loader::loadRigidBodies(Model *Model, const char *&Data)
+void Loader::loadRigidBodies(Model *Model, Cursor &Data)
 {
-	RigidBodies.resize(readInfo<int>(Data));
+	// Name, bone, group, mask, shape, size, position, rotation, physical properties and mode
+	size_t minimumSize = sizeof(uint32_t) * 2 + SizeInfo->BoneIndexSize + 1 + sizeof(uint16_t) + 1 + sizeof(float) * 14 + 1;
+	RigidBodies.resize(readCount(minimumSize, Data));
 
 	for (auto &Body : RigidBodies)
 	{
@@ -474,9 +767,11 @@ void Loader::loadRigidBodies(Model *Model, const char *&Data)
 	}
 }
 
-void Loader::loadJoints(Model *model, const char *&data)
+void Loader::loadJoints(Model *model, Cursor &data)
 {
-	Joints.resize(readInfo<int>(data));
+	// Name, type, both bodies and the parameters
+	size_t minimumSize = sizeof(uint32_t) * 2 + 1 + SizeInfo->RigidBodyIndexSize * 2 + sizeof(float) * 24;
+	Joints.resize(readCount(minimumSize, data));
 
 	for (auto &Joint : Joints)
 	{
@@ -502,9 +797,9 @@ void Loader::loadJoints(Model *model, const char *&data)
 	}
 }
 
-void Loader::loadSoftBodies(Model *model, const char *&data)
+void Loader::loadSoftBodies(Model *model, Cursor &data)
 {
-	model->softBodies.resize(readInfo<int>(data));
+	model->softBodies.resize(readCount(sizeof(uint32_t) * 2 + 1 + SizeInfo->MaterialIndexSize + 1 + sizeof(uint16_t) + 1, data));
 
 	for (auto &body : model->softBodies)
 	{
@@ -532,7 +827,7 @@ void Loader::loadSoftBodies(Model *model, const char *&data)
 		readInfo<SoftBody::Iteration>(body->iteration, data);
 		readInfo<SoftBody::Material>(body->materialInfo, data);
 
-		body->anchors.resize(readInfo<int>(data));
+		body->anchors.resize(readCount(SizeInfo->RigidBodyIndexSize + SizeInfo->VertexIndexSize + 1, data));
 		for (auto &anchor : body->anchors)
 		{
 			anchor.rigidBodyIndex = readAsU32(SizeInfo->RigidBodyIndexSize, data);
@@ -540,45 +835,51 @@ void Loader::loadSoftBodies(Model *model, const char *&data)
 			anchor.nearMode = readInfo<uint8_t>(data);
 		}
 
-		int count = readInfo<int>(data);
+		size_t count = readCount(sizeof(SoftBody::Pin), data);
 		body->pins.resize(count);
 		readVector<SoftBody::Pin>(body->pins.data(), count, data);
 	}
 }
 
 template <class T>
-T __getString(const char *&data)
+T __getString(Loader::Cursor &data)
 {
 	// Read length
 	uint32_t len = readInfo<uint32_t>(data);
-	len /= sizeof (T::value_type);
+	if (len % sizeof (typename T::value_type) != 0)
+		throw Loader::Exception("Invalid string length");
 
 	// Read the string itself
-	T retval((T::pointer)data, len);
-	data += len * sizeof(T::value_type);
-	return retval;
+	const char *chars = data.take(len);
+	return T((typename T::const_pointer)chars, len / sizeof (typename T::value_type));
 }
 
-std::wstring Loader::getString(const char *&data) {
-	static wstring_convert<codecvt_utf8_utf16<wchar_t>, wchar_t> conversor;
+std::wstring Loader::getString(Cursor &data) {
+	// Not shared between calls, sections may be decoded concurrently
+	wstring_convert<codecvt_utf8_utf16<wchar_t>, wchar_t> conversor;
 
 	switch (SizeInfo->Encoding) {
 	case 0:
 		return __getString<wstring>(data);
 	case 1:
-		return conversor.from_bytes(__getString<string>(data));
+		try {
+			return conversor.from_bytes(__getString<string>(data));
+		}
+		catch (std::range_error &) {
+			throw Exception("Invalid UTF-8 string");
+		}
 	}
 
 	return L"";
 }
 
-void Loader::readName(Name &name, const char *&data)
+void Loader::readName(Name &name, Cursor &data)
 {
 	name.japanese = getString(data);
 	name.english = getString(data);
 }
 
-uint32_t Loader::readAsU32(uint8_t size, const char *&data)
+uint32_t Loader::readAsU32(uint8_t size, Cursor &data)
 {
 	uint8_t u8val;
 	uint16_t u16val;
@@ -586,20 +887,103 @@ uint32_t Loader::readAsU32(uint8_t size, const char *&data)
 
 	switch (size) {
 	case 1:
-		u8val = *(uint8_t*)data;
-		data += size;
+		u8val = readInfo<uint8_t>(data);
 		if (u8val == 0xFF) return 0xFFFFFFFF;
 		return u8val;
 	case 2:
-		u16val = *(uint16_t*)data;
-		data += size;
+		u16val = readInfo<uint16_t>(data);
 		if (u16val == 0xFFFF) return 0xFFFFFFFF;
 		return u16val;
 	case 4:
-		u32val = *(uint32_t*)data;
-		data += size;
+		u32val = readInfo<uint32_t>(data);
 		return u32val;
 	}
 
 	return 0;
 }
+
+void Loader::validateReferences(Model *model)
+{
+	const uint32_t none = 0xFFFFFFFFU;
+	auto vertexCount = model->vertexData.size();
+	auto boneCount = Bones.size();
+	auto morphCount = model->morphs.size();
+	auto materialCount = model->materials.size();
+	auto bodyCount = RigidBodies.size();
+
+	auto check = [](bool condition, const char *message) {
+		if (!condition) throw Exception(message);
+	};
+	auto isBone = [boneCount, none](uint32_t index) { return index == none || index < boneCount; };
+
+	for (auto &index : model->verticesIndex)
+		check(index < vertexCount, "Vertex index out of range");
+
+	auto &vertices = model->vertexData;
+	for (size_t id = 0; id < vertexCount; ++id) {
+		auto method = vertices.weightMethods[id];
+		check(method < VertexWeightMethod::Count, "Invalid value for vertex weight method");
+
+		int count = method == VertexWeightMethod::BDEF1 ? 1 : (method == VertexWeightMethod::BDEF4 || method == VertexWeightMethod::QDEF) ? 4 : 2;
+		for (int i = 0; i < count; i++)
+			check(isBone((&vertices.boneIndices[id].x)[i]), "Vertex bone index out of range");
+	}
+
+	for (auto &vertex : vertices.sdefVertices)
+		check(vertex < vertexCount && vertices.weightMethods[vertex] == VertexWeightMethod::SDEF, "Invalid SDEF vertex");
+
+	size_t indexCount = 0;
+	for (auto &material : model->materials) {
+		check(material->indexCount >= 0 && material->indexCount % 3 == 0, "Invalid material index count");
+		indexCount += material->indexCount;
+	}
+	check(indexCount <= model->verticesIndex.size(), "Materials reference more indices than available");
+
+	for (auto &bone : Bones) {
+		check(isBone(bone.Parent), "Bone parent index out of range");
+		if (bone.Flags & (uint16_t)BoneFlags::Attached)
+			check(isBone(bone.Size.AttachTo), "Bone connection index out of range");
+		check(isBone(bone.Inherit.From), "Bone inheritance index out of range");
+		if (bone.IkData) {
+			check(bone.IkData->targetIndex < boneCount, "IK target index out of range");
+			for (auto &link : bone.IkData->links)
+				check(link.boneIndex < boneCount, "IK link index out of range");
+		}
+	}
+
+	for (auto &morph : model->morphs) {
+		for (auto &mdata : morph->data) {
+			switch (morph->type) {
+			case MorphType::Group:
+			case MorphType::Flip:
+				check(mdata.group.index < morphCount, "Group morph index out of range");
+				break;
+			case MorphType::Vertex:
+				check(mdata.vertex.index < vertexCount, "Vertex morph index out of range");
+				break;
+			case MorphType::Bone:
+				check(mdata.bone.index < boneCount, "Bone morph index out of range");
+				break;
+			case MorphType::UV:
+			case MorphType::UV1:
+			case MorphType::UV2:
+			case MorphType::UV3:
+			case MorphType::UV4:
+				check(mdata.uv.index < vertexCount, "UV morph index out of range");
+				break;
+			case MorphType::Material:
+				check(mdata.material.index == none || mdata.material.index < materialCount, "Material morph index out of range");
+				break;
+			case MorphType::Impulse:
+				check(mdata.impulse.index < bodyCount, "Impulse morph index out of range");
+				break;
+			}
+		}
+	}
+
+	for (auto &body : RigidBodies)
+		check(isBone(body.targetBone), "Rigid body bone index out of range");
+
+	for (auto &joint : Joints)
+		check(joint.data.bodyA < bodyCount && joint.data.bodyB < bodyCount, "Joint rigid body index out of range");
+}
@@ -21,6 +21,8 @@
 #include <istream>
 #include <string>
 
+class Dispatcher;
+
 namespace PMX {
 
 class Model;
@@ -89,6 +91,49 @@ public:
 		}
 	};
 
+	/**
+	 * \brief Thrown when the data ends before the element being read
+	 */
+	class UnexpectedEnd : public Exception
+	{
+	public:
+		UnexpectedEnd(size_t Missing = 0) throw() : Exception("Unexpected end of file"), Missing(Missing) {}
+
+		/**
+		 * \brief The amount of bytes the failed read was missing
+		 */
+		size_t Missing;
+	};
+
+	/**
+	 * \brief A read cursor over a buffer that knows where the buffer ends
+	 *
+	 * Every read through a cursor is checked against End, and a Loader::Exception
+	 * is thrown instead of reading past it.
+	 */
+	struct Cursor {
+		Cursor(const char *Data, const char *End) : Data(Data), End(End) {}
+
+		/**
+		 * \brief Returns the amount of bytes left to be read
+		 */
+		size_t remaining() const { return (size_t)(End - Data); }
+
+		/**
+		 * \brief Returns a pointer to the next Bytes bytes and advances past them
+		 */
+		const char* take(size_t Bytes) {
+			if (Bytes > remaining())
+				throw UnexpectedEnd(Bytes - remaining());
+			const char *Value = Data;
+			Data += Bytes;
+			return Value;
+		}
+
+		const char *Data;
+		const char *End;
+	};
+
 	struct Bone {
 		Name Name;
 		DirectX::XMFLOAT3 InitialPosition;
@@ -144,9 +189,31 @@ public:
 		} data;
 	};
 
+	Loader() : Header(nullptr), SizeInfo(nullptr), Tasks(nullptr) {}
+
+	/**
+	 * \brief Sets the dispatcher used to decode the largest sections of a model concurrently
+	 *
+	 * When set, the vertex, index and morph sections are decoded on the dispatcher threads
+	 * while the loading thread decodes the remaining ones. The resulting model is identical
+	 * to the one decoded serially. Pass nullptr to go back to serial decoding.
+	 */
+	void setDispatcher(Dispatcher *Tasks) { this->Tasks = Tasks; }
+
 	bool loadFromFile(Model* model, const std::wstring &filename);
+	/**
+	 * \brief Loads a model parsing it directly from a read-only mapping of the file
+	 *
+	 * This avoids copying the whole file into a temporary buffer before decoding it.
+	 */
+	bool loadFromMappedFile(Model* model, const std::wstring &filename);
 	bool loadFromStream(Model* model, std::istream &in);
-	bool loadFromMemory(Model* model, const char *&data);
+	bool loadFromMemory(Model* model, const char *&data, size_t length);
+	/**
+	 * \brief Reads only the name and comment of a model
+	 *
+	 * Only the beginning of the file is read, and more of it only if the names do not fit there.
+	 */
 	ModelDescription getDescription(const std::wstring &filename);
 
 	std::vector<Loader::Bone> Bones;
@@ -154,23 +221,51 @@ public:
 	std::vector<Loader::Joint> Joints;
 
 private:
-	FileHeader* loadHeader(const char *&data);
-	FileSizeInfo* loadSizeInfo(const char *&data);
-	void loadDescription(ModelDescription &desc, const char *&data);
-	void loadVertexData(Model* model, const char *&data);
-	void loadIndexData(Model* model, const char *&data);
-	void loadTextures(Model* model, const char *&data);
-	void loadMaterials(Model* model, const char *&data);
-	void loadBones(Model* model, const char *&data);
-	void loadMorphs(Model* model, const char *&data);
-	void loadFrames(Model* model, const char *&data);
-	void loadRigidBodies(Model* model, const char *&data);
-	void loadJoints(Model* model, const char *&data);
-	void loadSoftBodies(Model* model, const char *&data);
-
-	std::wstring getString(const char *&data);
-	void readName(Name &name, const char *&data);
-	uint32_t readAsU32(uint8_t size, const char *&data);
+	friend class Cache;
+
+	FileHeader* loadHeader(Cursor &data);
+	FileSizeInfo* loadSizeInfo(Cursor &data);
+	void loadDescription(ModelDescription &desc, Cursor &data);
+	void loadVertexData(Model* model, Cursor &data);
+	void loadIndexData(Model* model, Cursor &data);
+	void loadTextures(Model* model, Cursor &data);
+	void loadMaterials(Model* model, Cursor &data);
+	void loadBones(Model* model, Cursor &data);
+	void loadMorphs(Model* model, Cursor &data);
+	void loadFrames(Model* model, Cursor &data);
+	void loadRigidBodies(Model* model, Cursor &data);
+	void loadJoints(Model* model, Cursor &data);
+	void loadSoftBodies(Model* model, Cursor &data);
+
+	/**
+	 * \brief Decodes every section after the description, spreading the largest ones over the dispatcher
+	 */
+	void loadSectionsInParallel(Model* model, Cursor &data);
+
+	/**
+	 * \brief Advances past a section without decoding it, so the following sections can be located
+	 */
+	void skipVertexData(Cursor &data);
+	void skipIndexData(Cursor &data);
+	void skipMorphs(Cursor &data);
+
+	/**
+	 * \brief Checks that every index stored in the model refers to an existing element
+	 */
+	void validateReferences(Model* model);
+
+	/**
+	 * \brief Reads an element count, rejecting it if the remaining data cannot hold that many elements
+	 *
+	 * \param [in] minimumSize The smallest size, in bytes, a single element may take in the file
+	 */
+	size_t readCount(size_t minimumSize, Cursor &data);
+
+	std::wstring getString(Cursor &data);
+	void readName(Name &name, Cursor &data);
+	uint32_t readAsU32(uint8_t size, Cursor &data);
+
+	Dispatcher *Tasks;
 };
 
 }
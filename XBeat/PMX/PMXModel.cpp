@@ -5,6 +5,8 @@
 #include "PMXBone.h"
 #include "PMXMaterial.h"
 #include "PMXShader.h"
+#include "PMXCache.h"
+#include "PMXD3DVertexStaging.h"
 #include "../Renderer/D3DRenderer.h"
 
 #include <fstream>
@@ -42,6 +44,9 @@ PMX::Model::Model(void)
 
 	m_indexBuffer = m_vertexBuffer = m_materialBuffer = nullptr;
 
+	m_cpuSkinnedMethods = VertexSkinning::NoMethods;
+	m_identityBone = 0;
+
 	rootBone = PMX::Bone::createBone(this, -1, BoneType::Root);
 }
 
@@ -53,13 +58,32 @@ PMX::Model::~Model(void)
 
 bool PMX::Model::LoadModel(const wstring &filename)
 {
-	Loader *loader = new Loader;
-	
-	if (!loader->loadFromFile(this, filename))
-		return false;
+	std::unique_ptr<Loader> loader(new Loader);
+
+	Cache::SourceInfo source;
+	if (!Cache::load(this, loader.get(), filename, &source)) {
+		// Drop whatever a stale or corrupt cache may have left behind
+		ReleaseModel();
+		loader.reset(new Loader);
+		loader->setDispatcher(m_dispatcher.get());
+
+		try {
+			if (!loader->loadFromFile(this, filename))
+				return false;
+		}
+		catch (Loader::Exception &) {
+			// Corrupt or unsupported file, drop whatever was decoded so far
+			ReleaseModel();
+			return false;
+		}
+
+		Cache::save(this, loader.get(), filename, &source);
+	}
 
 	basePath = filename.substr(0, filename.find_last_of(L"\\/") + 1);
 
+	m_vertexMorphs.initialize(morphs);
+
 	// Initialize the bones
 	rootBone->initialize(nullptr);
 	for (uint32_t Id = 0; Id < loader->Bones.size(); ++Id) {
@@ -86,6 +110,18 @@ bool PMX::Model::LoadModel(const wstring &filename)
 	std::sort(m_prePhysicsBones.begin(), m_prePhysicsBones.end(), sortFn);
 	std::sort(m_postPhysicsBones.begin(), m_postPhysicsBones.end(), sortFn);
 
+	// The vertex shader blends matrices linearly and only has room for so many bones,
+	// anything else is skinned on the CPU and bound to an identity shader bone
+	m_skinning.initialize(vertexData, (uint32_t)bones.size());
+	if (bones.size() >= PMXShader::Limits::Bones) {
+		m_cpuSkinnedMethods = VertexSkinning::AllMethods;
+		m_identityBone = 0;
+	}
+	else {
+		m_cpuSkinnedMethods = VertexSkinning::maskOf(VertexWeightMethod::SDEF) | VertexSkinning::maskOf(VertexWeightMethod::QDEF);
+		m_identityBone = (uint32_t)bones.size();
+	}
+
 	// Initialize the rigid bodies
 	for (auto &Body : loader->RigidBodies) {
 		std::shared_ptr<RigidBody> RigidBody(new RigidBody);
@@ -104,6 +140,11 @@ bool PMX::Model::LoadModel(const wstring &filename)
 		Constraint->Initialize(m_physics, this, &Joint);
 	}
 
+	// The rigid bodies mark the bones they simulate, so the evaluator is built after them
+	m_boneEvaluator.build(rootBone, m_prePhysicsBones, m_postPhysicsBones);
+
+	buildNameIndexes();
+
 	// Initialize the soft bodies
 	for (auto &body : softBodies)
 	{
@@ -115,42 +156,46 @@ bool PMX::Model::LoadModel(const wstring &filename)
 
 void PMX::Model::ReleaseModel()
 {
-	for (std::vector<PMX::Vertex*>::size_type i = 0; i < vertices.size(); i++) {
-		delete vertices[i];
-		vertices[i] = nullptr;
-	}
-	vertices.clear();
-	vertices.shrink_to_fit();
+	vertexData.clear();
+	m_vertexMorphs.clear();
+	m_skinning.clear();
+	m_cpuSkinnedMethods = VertexSkinning::NoMethods;
 
 	verticesIndex.clear();
 	verticesIndex.shrink_to_fit();
 	
+	textures.clear();
 	textures.shrink_to_fit();
 
 	for (std::vector<PMX::Material*>::size_type i = 0; i < materials.size(); i++) {
 		delete materials[i];
 		materials[i] = nullptr;
 	}
+	materials.clear();
 	materials.shrink_to_fit();
 
 	for (std::vector<PMX::Bone*>::size_type i = 0; i < bones.size(); i++) {
 		delete bones[i];
 		bones[i] = nullptr;
 	}
+	bones.clear();
 	bones.shrink_to_fit();
 	m_prePhysicsBones.clear();
 	m_postPhysicsBones.clear();
+	m_boneEvaluator.clear();
 
 	for (std::vector<PMX::Morph*>::size_type i = 0; i < morphs.size(); i++) {
 		delete morphs[i];
 		morphs[i] = nullptr;
 	}
+	morphs.clear();
 	morphs.shrink_to_fit();
 
 	for (std::vector<PMX::Frame*>::size_type i = 0; i < frames.size(); i++) {
 		delete frames[i];
 		frames[i] = nullptr;
 	}
+	frames.clear();
 	frames.shrink_to_fit();
 
 	m_rigidBodies.clear();
@@ -166,10 +211,18 @@ void PMX::Model::ReleaseModel()
 		delete softBodies[i];
 		softBodies[i] = nullptr;
 	}
+	softBodies.clear();
 	softBodies.shrink_to_fit();
 
 	m_vertices.clear();
 	m_vertices.shrink_to_fit();
+	m_vertexSlotOffsets.clear();
+	m_vertexSlots.clear();
+
+	m_boneNames.clear();
+	m_boneENNames.clear();
+	m_morphNames.clear();
+	m_rigidBodyNames.clear();
 }
 
 DirectX::XMFLOAT4 color4ToFloat4(const PMX::Color4 &c) 
@@ -177,6 +230,49 @@ DirectX::XMFLOAT4 color4ToFloat4(const PMX::Color4 &c)
 	return DirectX::XMFLOAT4(c.red, c.green, c.blue, c.alpha);
 }
 
+void PMX::Model::buildRenderVertices()
+{
+	uint32_t lastIndex = 0;
+
+	m_vertices.clear();
+	m_vertices.reserve(verticesIndex.size());
+
+	for (uint32_t k = 0; k < (uint32_t)this->materials.size(); k++) {
+		for (uint32_t i = 0; i < (uint32_t)this->materials[k]->indexCount; i++) {
+			uint32_t vertex = this->verticesIndex[i + lastIndex];
+
+			m_vertices.emplace_back(PMXShader::VertexType{
+				vertexData.positions[vertex],
+				vertexData.normals[vertex],
+				vertexData.uvs[vertex],
+				vertexData.boneIndices[vertex],
+				vertexData.boneWeights[vertex],
+				k,
+			});
+
+			// Vertices skinned on the CPU are uploaded already deformed
+			if ((m_cpuSkinnedMethods & VertexSkinning::maskOf(vertexData.weightMethods[vertex])) != 0) {
+				m_vertices.back().boneIndices = DirectX::XMUINT4(m_identityBone, 0, 0, 0);
+				m_vertices.back().boneWeights = DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 0.0f);
+			}
+		}
+
+		lastIndex += this->materials[k]->indexCount;
+	}
+
+	// Every vertex is replicated once per index referencing it, so keep track of where each one ended up
+	m_vertexSlotOffsets.assign(vertexData.size() + 1, 0);
+	for (uint32_t slot = 0; slot < lastIndex; slot++)
+		m_vertexSlotOffsets[verticesIndex[slot] + 1]++;
+	for (size_t vertex = 0; vertex < vertexData.size(); vertex++)
+		m_vertexSlotOffsets[vertex + 1] += m_vertexSlotOffsets[vertex];
+
+	std::vector<uint32_t> slotCursor(m_vertexSlotOffsets.begin(), m_vertexSlotOffsets.end() - 1);
+	m_vertexSlots.resize(lastIndex);
+	for (uint32_t slot = 0; slot < lastIndex; slot++)
+		m_vertexSlots[slotCursor[verticesIndex[slot]]++] = slot;
+}
+
 bool PMX::Model::InitializeBuffers(std::shared_ptr<Renderer::D3DRenderer> d3d)
 {
 	if (d3d == nullptr)
@@ -187,7 +283,7 @@ bool PMX::Model::InitializeBuffers(std::shared_ptr<Renderer::D3DRenderer> d3d)
 	ID3D11Device *device = d3d->GetDevice();
 
 	D3D11_BUFFER_DESC vertexBufferDesc, indexBufferDesc, materialBufferDesc;
-	D3D11_SUBRESOURCE_DATA vertexData, indexData;
+	D3D11_SUBRESOURCE_DATA vertexInitData, indexData;
 	HRESULT result;
 
 	materialBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
@@ -206,52 +302,13 @@ bool PMX::Model::InitializeBuffers(std::shared_ptr<Renderer::D3DRenderer> d3d)
 	uint32_t lastIndex = 0;
 
 	std::vector<UINT> idx;
-	DirectX::XMFLOAT4 boneWeights;
-	DirectX::XMUINT4 boneIndices;
+	buildRenderVertices();
 
 	for (uint32_t k = 0; k < this->rendermaterials.size(); k++) {
 		rendermaterials[k].startIndex = lastIndex;
 
-		for (uint32_t i = 0; i < (uint32_t)this->materials[k]->indexCount; i++) {
-			Vertex* vertex = vertices[this->verticesIndex[i + lastIndex]];
-			vertex->materials.push_front(std::pair<RenderMaterial*,UINT>(&rendermaterials[k], i));
-
-			switch (vertex->weightMethod) {
-			case VertexWeightMethod::BDEF1:
-				boneWeights = DirectX::XMFLOAT4(vertex->boneInfo.BDEF.weights[0], 0, 0, 0);
-				boneIndices = DirectX::XMUINT4(vertex->boneInfo.BDEF.boneIndexes[0], 0, 0, 0);
-				break;
-			case VertexWeightMethod::BDEF2:
-				boneWeights = DirectX::XMFLOAT4(vertex->boneInfo.BDEF.weights[0], vertex->boneInfo.BDEF.weights[1], 0, 0);
-				boneIndices = DirectX::XMUINT4(vertex->boneInfo.BDEF.boneIndexes[0], vertex->boneInfo.BDEF.boneIndexes[1], 0, 0);
-				break;
-			case VertexWeightMethod::QDEF:
-			case VertexWeightMethod::BDEF4:
-				boneWeights = DirectX::XMFLOAT4(vertex->boneInfo.BDEF.weights[0], vertex->boneInfo.BDEF.weights[1], vertex->boneInfo.BDEF.weights[2], vertex->boneInfo.BDEF.weights[3]);
-				boneIndices = DirectX::XMUINT4(vertex->boneInfo.BDEF.boneIndexes[0], vertex->boneInfo.BDEF.boneIndexes[1], vertex->boneInfo.BDEF.boneIndexes[2], vertex->boneInfo.BDEF.boneIndexes[3]);
-				break;
-			case VertexWeightMethod::SDEF:
-				boneWeights = DirectX::XMFLOAT4(vertex->boneInfo.SDEF.weightBias, 1.0f - vertex->boneInfo.SDEF.weightBias, 0, 0);
-				boneIndices = DirectX::XMUINT4(vertex->boneInfo.SDEF.boneIndexes[0], vertex->boneInfo.SDEF.boneIndexes[1], 0, 0);
-				break;
-			}
-			m_vertices.emplace_back(PMXShader::VertexType{
-				DirectX::XMFLOAT3(vertex->position.x, vertex->position.y, vertex->position.z),
-				DirectX::XMFLOAT3(vertex->normal.x, vertex->normal.y, vertex->normal.z),
-				DirectX::XMFLOAT2(vertex->uv[0], vertex->uv[1]),
-				/*{
-					vertex->uvEx[0].get128(),
-					vertex->uvEx[1].get128(),
-					vertex->uvEx[2].get128(),
-					vertex->uvEx[3].get128()
-				},*/
-				boneIndices,
-				boneWeights,
-				k,
-			});
-
+		for (uint32_t i = 0; i < (uint32_t)this->materials[k]->indexCount; i++)
 			idx.emplace_back(i);
-		}
 
 		lastIndex += this->materials[k]->indexCount;
 
@@ -272,18 +329,11 @@ bool PMX::Model::InitializeBuffers(std::shared_ptr<Renderer::D3DRenderer> d3d)
 	vertexBufferDesc.MiscFlags = 0;
 	vertexBufferDesc.StructureByteStride = 0;
 
-	vertexData.pSysMem = m_vertices.data();
-	vertexData.SysMemPitch = 0;
-	vertexData.SysMemSlicePitch = 0;
+	vertexInitData.pSysMem = m_vertices.data();
+	vertexInitData.SysMemPitch = 0;
+	vertexInitData.SysMemSlicePitch = 0;
 
-	result = device->CreateBuffer(&vertexBufferDesc, &vertexData, &m_vertexBuffer);
-	if (FAILED(result))
-		return false;
-
-	vertexBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
-	vertexBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-
-	result = device->CreateBuffer(&vertexBufferDesc, &vertexData, &m_tmpVertexBuffer);
+	result = device->CreateBuffer(&vertexBufferDesc, &vertexInitData, &m_vertexBuffer);
 	if (FAILED(result))
 		return false;
 
@@ -303,7 +353,6 @@ bool PMX::Model::InitializeBuffers(std::shared_ptr<Renderer::D3DRenderer> d3d)
 		return false;
 
 #ifdef DEBUG
-	m_tmpVertexBuffer->SetPrivateData(WKPDID_D3DDebugObjectName, 6, "PMX SO");
 	m_vertexBuffer->SetPrivateData(WKPDID_D3DDebugObjectName, 6, "PMX VB");
 	m_indexBuffer->SetPrivateData(WKPDID_D3DDebugObjectName, 6, "PMX IB");
 #endif
@@ -324,7 +373,6 @@ bool PMX::Model::InitializeBuffers(std::shared_ptr<Renderer::D3DRenderer> d3d)
 void PMX::Model::ShutdownBuffers()
 {
 	DX_DELETEIF(m_materialBuffer);
-	DX_DELETEIF(m_tmpVertexBuffer);
 	DX_DELETEIF(m_vertexBuffer);
 	DX_DELETEIF(m_indexBuffer);
 
@@ -380,52 +428,90 @@ bool PMX::Model::updateMaterialBuffer(uint32_t material, ID3D11DeviceContext *co
 
 bool PMX::Model::updateVertexBuffer(ID3D11DeviceContext *Context)
 {
-	bool Touched = false;
-
-	for (auto &Material : rendermaterials) {
-		if ((Material.dirty & RenderMaterial::DirtyFlags::VertexBuffer) != 0) {
-			Material.dirty &= ~RenderMaterial::DirtyFlags::VertexBuffer;
+	D3DVertexStaging Staging(Context, m_vertexBuffer, sizeof(PMXShader::VertexType));
+	return UploadVertices(Staging);
+}
 
-			for (uint32_t i = Material.startIndex; i < Material.indexCount + Material.startIndex; ++i) {
-				auto Vertex = this->vertices[this->verticesIndex[i]];
-				DirectX::XMVECTOR Position = DirectX::XMVectorAdd(DirectX::XMLoadFloat3(&Vertex->position), Vertex->MorphOffset);
-				DirectX::XMStoreFloat3(&m_vertices[i].position, Position);
+bool PMX::Model::UploadVertices(VertexStaging &Staging)
+{
+	// Models without a renderer never had their buffers initialized
+	if (m_vertices.empty())
+		buildRenderVertices();
+
+	updateMorphedVertices();
+
+	VertexSkinning::MethodMask Methods = m_cpuSkinnedMethods & m_skinning.getUsedMethods();
+	if (Methods != VertexSkinning::NoMethods) {
+		updateSkinnedVertices(Methods);
+
+		// Only the vertices whose bones or morphs changed were skinned again
+		auto &Positions = m_skinning.getPositions();
+		auto &Normals = m_skinning.getNormals();
+		for (auto &Range : m_skinning.getUpdatedRanges()) {
+			auto &Group = m_skinning.getVertices(Range.Method);
+			for (uint32_t Entry = Range.First; Entry < Range.First + Range.Count; Entry++) {
+				uint32_t Vertex = Group[Entry];
+				for (uint32_t i = m_vertexSlotOffsets[Vertex]; i < m_vertexSlotOffsets[Vertex + 1]; i++) {
+					uint32_t Slot = m_vertexSlots[i];
+					m_vertices[Slot].position = Positions[Vertex];
+					m_vertices[Slot].normal = Normals[Vertex];
+					m_dirtyVertices.add(Slot);
+				}
 			}
-
-			Touched = true;
 		}
 	}
 
-	if (!Touched) return true;
+	return m_dirtyVertices.flush(Staging, m_vertices.data(), sizeof(PMXShader::VertexType));
+}
 
-	D3D11_MAPPED_SUBRESOURCE MappedResource;
-	HRESULT Result = Context->Map(m_tmpVertexBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &MappedResource);
-	if (FAILED(Result))
-		return false;
+void PMX::Model::updateMorphedVertices()
+{
+	if (!m_vertexMorphs.update(vertexData.morphOffsets))
+		return;
 
-	memcpy(MappedResource.pData, m_vertices.data(), m_vertices.size() * sizeof(PMX::PMXShader::VertexType));
+	m_skinning.invalidate(m_vertexMorphs.getDirtyVertices());
+	if (m_vertexSlotOffsets.empty())
+		return;
 
-	Context->Unmap(m_tmpVertexBuffer, 0);
+	for (auto Vertex : m_vertexMorphs.getDirtyVertices()) {
+		// The skinning applies the offsets of the vertices it deforms itself
+		if ((m_cpuSkinnedMethods & VertexSkinning::maskOf(vertexData.weightMethods[Vertex])) != 0)
+			continue;
 
-	Context->CopyResource(m_vertexBuffer, m_tmpVertexBuffer);
+		DirectX::XMVECTOR Position = DirectX::XMVectorAdd(DirectX::XMLoadFloat3(&vertexData.positions[Vertex]), DirectX::XMLoadFloat4(&vertexData.morphOffsets[Vertex]));
 
-	return true;
+		for (uint32_t i = m_vertexSlotOffsets[Vertex]; i < m_vertexSlotOffsets[Vertex + 1]; i++) {
+			uint32_t Slot = m_vertexSlots[i];
+			DirectX::XMStoreFloat3(&m_vertices[Slot].position, Position);
+			m_dirtyVertices.add(Slot);
+		}
+	}
+}
+
+void PMX::Model::updateSkinnedVertices(VertexSkinning::MethodMask Methods)
+{
+	for (auto &bone : bones)
+		m_skinning.setBone(bone->getId(), bone->getSkinningTransform(), bone->getStartPosition());
+
+	m_skinning.skin(vertexData, Methods, m_dispatcher.get());
+}
+
+void PMX::Model::SkinVertices()
+{
+	updateMorphedVertices();
+	updateSkinnedVertices(VertexSkinning::AllMethods);
 }
 
 bool PMX::Model::Update(float msec)
 {
 	if ((m_debugFlags & DebugFlags::DontUpdatePhysics) == 0) {
-		for (auto &bone : m_prePhysicsBones) {
-			bone->update();
-		}
+		m_boneEvaluator.updatePrePhysics();
 
 		for (auto &body : m_rigidBodies) {
 			body->Update();
 		}
 
-		for (auto &bone : m_postPhysicsBones) {
-			bone->update();
-		}
+		m_boneEvaluator.updatePostPhysics();
 
 		for (auto &bone : m_ikBones) {
 			bone->performIK();
@@ -464,13 +550,20 @@ void PMX::Model::Render(ID3D11DeviceContext *context, std::shared_ptr<ViewFrustu
 
 		auto shader = std::dynamic_pointer_cast<PMXShader>(m_shader);
 
-		for (auto & bone : bones) {
-			auto &shaderBone = shader->GetBone(bone->getId());
-			shaderBone.position = bone->getStartPosition().get128();
-			auto t = bone->getSkinningTransform();
-			shaderBone.transform = DirectX::XMMatrixTranspose(DirectX::XMMatrixAffineTransformation(DirectX::XMVectorSplatOne(), bone->getStartPosition().get128(), t.getRotation().get128(), t.getOrigin().get128()));
+		// Bone matrices are useless to the shader when every vertex is skinned on the CPU
+		if (m_cpuSkinnedMethods != VertexSkinning::AllMethods) {
+			for (auto & bone : bones) {
+				auto &shaderBone = shader->GetBone(bone->getId());
+				shaderBone.position = bone->getStartPosition().get128();
+				auto t = bone->getSkinningTransform();
+				shaderBone.transform = DirectX::XMMatrixTranspose(DirectX::XMMatrixAffineTransformation(DirectX::XMVectorSplatOne(), bone->getStartPosition().get128(), t.getRotation().get128(), t.getOrigin().get128()));
+			}
 		}
 
+		auto &identityBone = shader->GetBone(m_identityBone);
+		identityBone.position = DirectX::XMVectorZero();
+		identityBone.transform = DirectX::XMMatrixIdentity();
+
 		shader->UpdateBoneBuffer(context);
 
 		updateVertexBuffer(context);
@@ -585,24 +678,40 @@ void PMX::Model::ReleaseTexture()
 	renderTextures.clear();
 }
 
-PMX::Bone* PMX::Model::GetBoneByName(const std::wstring &JPname)
+void PMX::Model::buildNameIndexes()
 {
-	for (auto bone : bones) {
-		if (bone->getName().japanese.compare(JPname) == 0)
-			return bone;
-	}
+	m_boneNames.build((uint32_t)bones.size(), [this](uint32_t id) -> const std::wstring& { return bones[id]->getName().japanese; });
+	m_boneENNames.build((uint32_t)bones.size(), [this](uint32_t id) -> const std::wstring& { return bones[id]->getName().english; });
+	m_morphNames.build((uint32_t)morphs.size(), [this](uint32_t id) -> const std::wstring& { return morphs[id]->name.japanese; });
+	m_rigidBodyNames.build((uint32_t)m_rigidBodies.size(), [this](uint32_t id) -> const std::wstring& { return m_rigidBodies[id]->GetName().japanese; });
+}
 
-	return nullptr;
+PMX::BoneHandle PMX::Model::FindBone(const std::wstring &JPname)
+{
+	return BoneHandle(m_boneNames.find(JPname));
 }
 
-PMX::Bone* PMX::Model::GetBoneByENName(const std::wstring &ENname)
+PMX::BoneHandle PMX::Model::FindBoneByENName(const std::wstring &ENname)
 {
-	for (auto bone : bones) {
-		if (bone->getName().english.compare(ENname) == 0)
-			return bone;
-	}
+	return BoneHandle(m_boneENNames.find(ENname));
+}
+
+PMX::Bone* PMX::Model::GetBone(BoneHandle handle)
+{
+	if (handle.Id >= bones.size())
+		return nullptr;
 
-	return nullptr;
+	return bones[handle.Id];
+}
+
+PMX::Bone* PMX::Model::GetBoneByName(const std::wstring &JPname)
+{
+	return GetBone(FindBone(JPname));
+}
+
+PMX::Bone* PMX::Model::GetBoneByENName(const std::wstring &ENname)
+{
+	return GetBone(FindBoneByENName(ENname));
 }
 
 PMX::Bone* PMX::Model::GetBoneById(uint32_t id)
@@ -640,24 +749,47 @@ std::shared_ptr<PMX::RigidBody> PMX::Model::GetRigidBodyById(uint32_t id)
 	return m_rigidBodies[id];
 }
 
+PMX::RigidBodyHandle PMX::Model::FindRigidBody(const std::wstring &JPname)
+{
+	return RigidBodyHandle(m_rigidBodyNames.find(JPname));
+}
+
+std::shared_ptr<PMX::RigidBody> PMX::Model::GetRigidBody(RigidBodyHandle handle)
+{
+	if (handle.Id >= m_rigidBodies.size())
+		return nullptr;
+
+	return m_rigidBodies[handle.Id];
+}
+
 std::shared_ptr<PMX::RigidBody> PMX::Model::GetRigidBodyByName(const std::wstring &JPname)
 {
-	for (auto body : m_rigidBodies) {
-		if (body->GetName().japanese.compare(JPname) == 0)
-			return body;
-	}
+	return GetRigidBody(FindRigidBody(JPname));
+}
+
+PMX::MorphHandle PMX::Model::FindMorph(const std::wstring &JPname)
+{
+	return MorphHandle(m_morphNames.find(JPname));
+}
+
+PMX::Morph* PMX::Model::GetMorph(MorphHandle handle)
+{
+	if (handle.Id >= morphs.size())
+		return nullptr;
 
-	return nullptr;
+	return morphs[handle.Id];
 }
 
 void PMX::Model::ApplyMorph(const std::wstring &nameJP, float weight)
 {
-	for (auto morph : morphs) {
-		if (morph->name.japanese.compare(nameJP) == 0) {
-			ApplyMorph(morph, weight);
-			break;
-		}
-	}
+	ApplyMorph(FindMorph(nameJP), weight);
+}
+
+void PMX::Model::ApplyMorph(MorphHandle handle, float weight)
+{
+	Morph *morph = GetMorph(handle);
+	if (morph != nullptr)
+		ApplyMorph(morph, weight);
 }
 
 void PMX::Model::ApplyMorph(Morph *morph, float weight)
@@ -708,35 +840,8 @@ void PMX::Model::ApplyMorph(Morph *morph, float weight)
 
 void PMX::Model::applyVertexMorph(Morph *morph, float weight)
 {
-	for (auto i : morph->data) {
-		Vertex *v = vertices[i.vertex.index];
-
-		auto it = ([morph, v]() { for (auto i = v->morphs.begin(); i != v->morphs.end(); i++) if ((*i)->morph == morph) return i; return v->morphs.end(); })();
-		if (it == v->morphs.end()) {
-			if (weight == 0.0f)
-				continue;
-			else {
-				Vertex::MorphData *md = new Vertex::MorphData;
-				md->morph = morph; md->type = &i; md->weight = weight;
-				v->morphs.push_back(md);
-			}
-		}
-		else {
-			if (weight == 0.0f)
-				v->morphs.erase(it);
-			else
-				(*it)->weight = weight;
-		}
-
-		v->MorphOffset = DirectX::XMVectorZero();
-		for (auto &m : v->morphs) {
-			v->MorphOffset = v->MorphOffset + DirectX::XMVectorSet(m->type->vertex.offset[0] * m->weight, m->type->vertex.offset[1] * m->weight, m->type->vertex.offset[2] * m->weight, 0.0f);
-		}
-
-		// Mark the material for update next frame
-		for (auto &m : v->materials)
-			m.first->dirty |= RenderMaterial::DirtyFlags::VertexBuffer;
-	}
+	// The offsets are accumulated once per frame, in updateVertexBuffer
+	m_vertexMorphs.setWeight(morph, weight);
 }
 
 void PMX::Model::applyBoneMorph(Morph *morph, float weight)
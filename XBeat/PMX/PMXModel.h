@@ -18,6 +18,11 @@
 #include "PMXJoint.h"
 #include "PMXShader.h"
 #include "PMXBone.h"
+#include "PMXBoneEvaluator.h"
+#include "PMXNameIndex.h"
+#include "PMXSkinning.h"
+#include "PMXVertexMorph.h"
+#include "PMXVertexStaging.h"
 
 namespace PMX {
 
@@ -35,8 +40,21 @@ public:
 	Bone* GetBoneByENName(const std::wstring &ENname);
 	Bone* GetBoneById(uint32_t id);
 	Bone* GetRootBone() { return rootBone; }
+	uint32_t GetBoneCount() const { return (uint32_t)bones.size(); }
+	uint32_t GetMorphCount() const { return (uint32_t)morphs.size(); }
+
+	/**
+	 * \brief Resolves a bone name once, so it can be looked up afterwards with GetBone()
+	 */
+	BoneHandle FindBone(const std::wstring &JPname);
+	BoneHandle FindBoneByENName(const std::wstring &ENname);
+	Bone* GetBone(BoneHandle handle);
+
+	MorphHandle FindMorph(const std::wstring &JPname);
+	Morph* GetMorph(MorphHandle handle);
 
 	void ApplyMorph(const std::wstring &JPname, float weight);
+	void ApplyMorph(MorphHandle handle, float weight);
 	void ApplyMorph(Morph *morph, float weight);
 
 	struct DebugFlags {
@@ -60,14 +78,44 @@ public:
 	RenderMaterial* GetRenderMaterialById(uint32_t id);
 	std::shared_ptr<RigidBody> GetRigidBodyById(uint32_t id);
 	std::shared_ptr<RigidBody> GetRigidBodyByName(const std::wstring &JPname);
+	RigidBodyHandle FindRigidBody(const std::wstring &JPname);
+	std::shared_ptr<RigidBody> GetRigidBody(RigidBodyHandle handle);
 
 	virtual bool Update(float msec);
 	virtual void Render(ID3D11DeviceContext *context, std::shared_ptr<Renderer::ViewFrustum> frustum);
 
 	virtual bool LoadModel(const std::wstring &filename);
 
+	/**
+	 * \brief Sets the dispatcher used to decode the model in parallel when it is loaded
+	 */
+	void SetDispatcher(std::shared_ptr<Dispatcher> dispatcher) { m_dispatcher = dispatcher; }
+
 	void Reset();
 
+	/**
+	 * \brief Deforms every vertex on the CPU with the current bone transforms and morphs
+	 *
+	 * Meant for queries on the deformed mesh, such as collisions, which need no renderer.
+	 */
+	void SkinVertices();
+	/**
+	 * \brief Returns the vertices deformed on the CPU, as of the last SkinVertices() or Render()
+	 */
+	const VertexSkinning& GetSkinning() const { return m_skinning; }
+
+	/**
+	 * \brief Refreshes the vertices changed by morphs and skinning, and uploads only them through Staging
+	 *
+	 * Render() uploads to the vertex buffer of the model. Without a renderer, callers needing
+	 * the deformed vertices pass a RecordingVertexStaging, which collects the ranges instead.
+	 */
+	bool UploadVertices(VertexStaging &Staging);
+	/**
+	 * \brief Returns the vertices as uploaded to the vertex buffer, each one replicated once per index
+	 */
+	const std::vector<PMXShader::VertexType>& GetRenderVertices() const { return m_vertices; }
+
 #if defined _M_IX86 && defined _MSC_VER
 	void *__cdecl operator new(size_t count) {
 		return _aligned_malloc(count, 16);
@@ -79,7 +127,8 @@ public:
 #endif
 
 private:
-	std::vector<Vertex*> vertices;
+	VertexData vertexData;
+	VertexMorphs m_vertexMorphs;
 
 	std::vector<uint32_t> verticesIndex;
 	std::vector<std::wstring> textures;
@@ -108,19 +157,63 @@ private:
 	std::vector<std::shared_ptr<Joint>> m_joints;
 
 	std::vector<PMXShader::VertexType> m_vertices;
+	/**
+	 * \brief The slots of m_vertices holding each vertex, as compressed rows: those of vertex i are
+	 * the elements of m_vertexSlots from m_vertexSlotOffsets[i] up to, but not including, m_vertexSlotOffsets[i + 1]
+	 */
+	std::vector<uint32_t> m_vertexSlotOffsets;
+	std::vector<uint32_t> m_vertexSlots;
+	DirtyVertexRanges m_dirtyVertices;
+
+	/**
+	 * \brief Deforms on the CPU the vertices the vertex shader cannot, SDEF and QDEF ones,
+	 * or every vertex if the model has more bones than the shader takes
+	 */
+	VertexSkinning m_skinning;
+	VertexSkinning::MethodMask m_cpuSkinnedMethods;
+	/**
+	 * \brief The shader bone left as an identity, which the vertices skinned on the CPU are bound to
+	 */
+	uint32_t m_identityBone;
 
 	bool updateVertexBuffer(ID3D11DeviceContext *Context);
+	/**
+	 * \brief Builds m_vertices and the slots of each vertex from the materials index ranges
+	 */
+	void buildRenderVertices();
+	/**
+	 * \brief Recomputes the morph offsets and refreshes the vertices skinned by the vertex shader
+	 */
+	void updateMorphedVertices();
+	/**
+	 * \brief Skins the vertices of some weight methods on the CPU with the current bone transforms
+	 */
+	void updateSkinnedVertices(VertexSkinning::MethodMask Methods);
 	bool updateMaterialBuffer(uint32_t material, ID3D11DeviceContext *context);
 	bool m_dirtyBuffer;
 	ID3D11Buffer *m_materialBuffer;
-	ID3D11Buffer *m_vertexBuffer, *m_tmpVertexBuffer;
+	ID3D11Buffer *m_vertexBuffer;
 	ID3D11Buffer *m_indexBuffer;
 
 	uint32_t m_debugFlags;
 
+	std::shared_ptr<Dispatcher> m_dispatcher;
+
 	std::vector<Bone*> m_prePhysicsBones;
 	std::vector<Bone*> m_postPhysicsBones;
 	std::vector<Bone*> m_ikBones;
+	/**
+	 * \brief Computes m_prePhysicsBones and m_postPhysicsBones from flat arrays
+	 */
+	BoneEvaluator m_boneEvaluator;
+
+	/**
+	 * \brief Name lookup tables, built once the model is loaded
+	 */
+	NameIndex m_boneNames;
+	NameIndex m_boneENNames;
+	NameIndex m_morphNames;
+	NameIndex m_rigidBodyNames;
 
 protected:
 	virtual bool InitializeBuffers(std::shared_ptr<Renderer::D3DRenderer> d3d);
@@ -132,6 +225,11 @@ protected:
 	virtual void ReleaseTexture();
 
 private:
+	/**
+	 * \brief Builds the name lookup tables of the bones, morphs and rigid bodies
+	 */
+	void buildNameIndexes();
+
 	void applyVertexMorph(Morph* morph, float weight);
 	void applyMaterialMorph(Morph* morph, float weight);
 	void applyMaterialMorph(MorphType* morph, RenderMaterial* material, float weight);
@@ -140,6 +238,7 @@ private:
 	void applyImpulseMorph(Morph* morph, float weight);
 
 	friend class Loader;
+	friend class Cache;
 #ifdef PMX_TEST
 	friend class PMXTest::BoneTest;
 #endif
@@ -0,0 +1,94 @@
+//===-- PMX/PMXNameIndex.cpp - Defines the name lookup hash index ----*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===---------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the PMX::NameIndex class, an open-addressing hash
+/// table mapping the names of bones, morphs and rigid bodies to their ids
+///
+//===---------------------------------------------------------------------------===//
+
+#include "PMXNameIndex.h"
+
+using namespace PMX;
+
+NameIndex::NameIndex()
+{
+	Mask = 0;
+}
+
+void NameIndex::clear()
+{
+	Slots.clear();
+	Names.clear();
+	Ids.clear();
+	Mask = 0;
+}
+
+void NameIndex::reserve(uint32_t Count)
+{
+	// Keep the load factor at or below 0.5 so probe sequences stay short
+	uint32_t Capacity = 8;
+	while (Capacity < Count * 2)
+		Capacity <<= 1;
+
+	Slot EmptySlot = { 0, Empty };
+	Slots.assign(Capacity, EmptySlot);
+	Mask = Capacity - 1;
+
+	Names.reserve(Count);
+	Ids.reserve(Count);
+}
+
+uint32_t NameIndex::hash(const std::wstring &Name)
+{
+	uint32_t Hash = 2166136261U;
+	for (wchar_t C : Name) {
+		Hash ^= (uint32_t)C;
+		Hash *= 16777619U;
+	}
+	return Hash;
+}
+
+void NameIndex::insert(const std::wstring &Name, uint32_t Id)
+{
+	if (Name.empty())
+		return;
+
+	uint32_t Hash = hash(Name);
+	for (uint32_t Position = Hash & Mask;; Position = (Position + 1) & Mask) {
+		Slot &Current = Slots[Position];
+		if (Current.Entry == Empty) {
+			Current.Hash = Hash;
+			Current.Entry = (uint32_t)Names.size();
+			Names.push_back(Name);
+			Ids.push_back(Id);
+			return;
+		}
+
+		// Keep the first element with this name, like the linear scans this replaces
+		if (Current.Hash == Hash && Names[Current.Entry] == Name)
+			return;
+	}
+}
+
+uint32_t NameIndex::find(const std::wstring &Name) const
+{
+	if (Slots.empty())
+		return Empty;
+
+	uint32_t Hash = hash(Name);
+	for (uint32_t Position = Hash & Mask;; Position = (Position + 1) & Mask) {
+		const Slot &Current = Slots[Position];
+		if (Current.Entry == Empty)
+			return Empty;
+
+		if (Current.Hash == Hash && Names[Current.Entry] == Name)
+			return Ids[Current.Entry];
+	}
+}
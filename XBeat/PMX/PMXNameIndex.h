@@ -0,0 +1,111 @@
+//===-- PMX/PMXNameIndex.h - Declares the name lookup hash index ----*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the PMX::NameIndex class, an open-addressing hash
+/// table mapping the names of bones, morphs and rigid bodies to their ids, and
+/// the handles returned by it
+///
+//===--------------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace PMX {
+
+class Bone;
+struct Morph;
+class RigidBody;
+
+/// \brief A resolved reference to an element of a model
+///
+/// A handle is just the id of the element, so it stays valid for as long as the
+/// model it was obtained from is not released or reloaded.
+template <class T>
+struct Handle
+{
+	static const uint32_t Invalid = 0xFFFFFFFFU;
+
+	Handle() : Id(Invalid) {}
+	explicit Handle(uint32_t Id) : Id(Id) {}
+
+	bool isValid() const { return Id != Invalid; }
+
+	bool operator==(const Handle &Other) const { return Id == Other.Id; }
+	bool operator!=(const Handle &Other) const { return Id != Other.Id; }
+
+	uint32_t Id;
+};
+
+typedef Handle<Bone> BoneHandle;
+typedef Handle<Morph> MorphHandle;
+typedef Handle<RigidBody> RigidBodyHandle;
+
+/// \brief Maps names to element ids
+///
+/// The table uses linear probing over a power of two number of slots, kept at most
+/// half full. Each slot stores the full hash of its name, so names are only compared
+/// when their hashes match.
+class NameIndex
+{
+public:
+	NameIndex();
+
+	/// \brief Rebuilds the index
+	///
+	/// \param [in] Count The number of elements
+	/// \param [in] GetName Returns the name of the element with the given id
+	/// \remarks When many elements share a name, the one with the lowest id is kept;
+	/// empty names are not indexed.
+	template <class NameFn>
+	void build(uint32_t Count, NameFn GetName) {
+		clear();
+		reserve(Count);
+		for (uint32_t Id = 0; Id < Count; ++Id)
+			insert(GetName(Id), Id);
+	}
+
+	/// \brief Removes every name from the index
+	void clear();
+
+	/// \brief Looks up a name
+	///
+	/// \returns The id of the element, or Handle<T>::Invalid if no element has that name
+	uint32_t find(const std::wstring &Name) const;
+
+	/// \brief Returns the number of indexed names
+	uint32_t size() const { return (uint32_t)Names.size(); }
+
+	/// \brief Computes the 32-bit FNV-1a hash of a name
+	static uint32_t hash(const std::wstring &Name);
+
+private:
+	void reserve(uint32_t Count);
+	void insert(const std::wstring &Name, uint32_t Id);
+
+	struct Slot {
+		/// \brief The hash of the name
+		uint32_t Hash;
+		/// \brief The position of the name in Names, or Empty
+		uint32_t Entry;
+	};
+	static const uint32_t Empty = 0xFFFFFFFFU;
+
+	std::vector<Slot> Slots;
+	uint32_t Mask;
+
+	/// \brief The indexed names and the id of their element, in insertion order
+	std::vector<std::wstring> Names;
+	std::vector<uint32_t> Ids;
+};
+
+}
@@ -0,0 +1,413 @@
+//===-- PMX/PMXSkinning.cpp - Defines the CPU vertex skinning ---*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the PMX::VertexSkinning class, which deforms the
+/// vertices of a model by its bones on the CPU
+///
+//===--------------------------------------------------------------------===//
+
+#include "PMXSkinning.h"
+
+#include "../Dispatcher.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace PMX;
+using namespace DirectX;
+
+namespace {
+	/// \brief Loads a vertex position with its morph offset applied
+	inline XMVECTOR XM_CALLCONV loadPosition(const VertexData &Vertices, uint32_t Vertex)
+	{
+		return XMVectorAdd(XMLoadFloat3(&Vertices.positions[Vertex]), XMVectorSetW(XMLoadFloat4(&Vertices.morphOffsets[Vertex]), 0.0f));
+	}
+
+	/// \brief The bones moving a vertex, sorted, with unused entries left at UINT32_MAX
+	struct BoneSet {
+		uint32_t Bones[4];
+
+		bool operator== (const BoneSet &Other) const { return std::equal(Bones, Bones + 4, Other.Bones); }
+		bool operator< (const BoneSet &Other) const { return std::lexicographical_compare(Bones, Bones + 4, Other.Bones, Other.Bones + 4); }
+	};
+
+	BoneSet getBoneSet(const VertexData &Vertices, uint32_t Vertex)
+	{
+		auto Method = Vertices.weightMethods[Vertex];
+		const uint32_t *Indices = &Vertices.boneIndices[Vertex].x;
+		const float *Weights = &Vertices.boneWeights[Vertex].x;
+
+		uint32_t Influences = 4;
+		if (Method == VertexWeightMethod::BDEF1)
+			Influences = 1;
+		else if (Method == VertexWeightMethod::BDEF2 || Method == VertexWeightMethod::SDEF)
+			Influences = 2;
+
+		// Bones without weight do not move linearly blended vertices, but SDEF and QDEF read both rotations
+		bool Linear = Method == VertexWeightMethod::BDEF1 || Method == VertexWeightMethod::BDEF2 || Method == VertexWeightMethod::BDEF4;
+
+		BoneSet Set;
+		uint32_t Count = 0;
+		std::fill(Set.Bones, Set.Bones + 4, UINT32_MAX);
+		for (uint32_t Influence = 0; Influence < Influences; ++Influence) {
+			if (Influence == 0 || !Linear || Weights[Influence] != 0.0f)
+				Set.Bones[Count++] = Indices[Influence];
+		}
+
+		std::sort(Set.Bones, Set.Bones + Count);
+		std::fill(std::unique(Set.Bones, Set.Bones + Count), Set.Bones + 4, UINT32_MAX);
+		return Set;
+	}
+}
+
+VertexSkinning::VertexSkinning()
+{
+	UsedMethods = NoMethods;
+}
+
+void VertexSkinning::initialize(const VertexData &Vertices, uint32_t BoneCount)
+{
+	clear();
+
+	uint32_t VertexCount = (uint32_t)Vertices.size();
+
+	Bones.resize(BoneCount);
+	Skinnings.resize(BoneCount, btTransform::getIdentity());
+	StartPositions.resize(BoneCount, btVector3(0, 0, 0));
+	ChangedBones.assign(BoneCount, 0);
+	for (auto &Bone : Bones) {
+		XMStoreFloat4x3(&Bone.Matrix, XMMatrixIdentity());
+		XMStoreFloat4(&Bone.Real, XMQuaternionIdentity());
+		XMStoreFloat4(&Bone.Dual, XMVectorZero());
+	}
+
+	for (uint32_t Vertex = 0; Vertex < VertexCount; ++Vertex) {
+		auto Method = Vertices.weightMethods[Vertex];
+		// SDEF vertices are taken from the list holding their parameters
+		if (Method != VertexWeightMethod::SDEF)
+			Groups[(size_t)Method].push_back(Vertex);
+	}
+
+	auto &SDEFGroup = Groups[(size_t)VertexWeightMethod::SDEF];
+	SDEFGroup.reserve(Vertices.sdefVertices.size());
+	SDEFVertices.reserve(Vertices.sdefVertices.size());
+	for (size_t Index = 0; Index < Vertices.sdefVertices.size(); ++Index) {
+		uint32_t Vertex = Vertices.sdefVertices[Index];
+		auto &Parameters = Vertices.sdefParameters[Index];
+
+		XMVECTOR Weight0 = XMVectorReplicate(Vertices.boneWeights[Vertex].x);
+		XMVECTOR Weight1 = XMVectorReplicate(1.0f - Vertices.boneWeights[Vertex].x);
+		XMVECTOR C = XMLoadFloat3(&Parameters.C);
+		XMVECTOR R0 = XMLoadFloat3(&Parameters.R0);
+		XMVECTOR R1 = XMLoadFloat3(&Parameters.R1);
+
+		// R0 and R1 are corrected so their weighted average lies on C, then taken halfway to C
+		XMVECTOR Average = XMVectorAdd(XMVectorMultiply(R0, Weight0), XMVectorMultiply(R1, Weight1));
+		R0 = XMVectorSubtract(XMVectorAdd(C, R0), Average);
+		R1 = XMVectorSubtract(XMVectorAdd(C, R1), Average);
+
+		SDEFVertex Entry;
+		Entry.C = Parameters.C;
+		XMStoreFloat3(&Entry.R0, XMVectorScale(XMVectorAdd(C, R0), 0.5f));
+		XMStoreFloat3(&Entry.R1, XMVectorScale(XMVectorAdd(C, R1), 0.5f));
+
+		SDEFGroup.push_back(Vertex);
+		SDEFVertices.push_back(Entry);
+	}
+
+	// Sort every group by bone set, then split it where the set changes
+	std::vector<BoneSet> Sets(VertexCount);
+	for (uint32_t Vertex = 0; Vertex < VertexCount; ++Vertex)
+		Sets[Vertex] = getBoneSet(Vertices, Vertex);
+
+	VertexClusters.resize(VertexCount);
+	for (size_t Method = 0; Method < (size_t)VertexWeightMethod::Count; ++Method) {
+		auto &Group = Groups[Method];
+		uint32_t Count = (uint32_t)Group.size();
+		if (Count == 0)
+			continue;
+		UsedMethods |= 1u << Method;
+
+		std::vector<uint32_t> Order(Count);
+		for (uint32_t Entry = 0; Entry < Count; ++Entry)
+			Order[Entry] = Entry;
+		std::sort(Order.begin(), Order.end(), [&Group, &Sets](uint32_t A, uint32_t B) {
+			auto &SetA = Sets[Group[A]];
+			auto &SetB = Sets[Group[B]];
+			return SetA < SetB || (SetA == SetB && Group[A] < Group[B]);
+		});
+
+		std::vector<uint32_t> Sorted(Count);
+		for (uint32_t Entry = 0; Entry < Count; ++Entry)
+			Sorted[Entry] = Group[Order[Entry]];
+		if (Method == (size_t)VertexWeightMethod::SDEF) {
+			std::vector<SDEFVertex> SortedParameters(Count);
+			for (uint32_t Entry = 0; Entry < Count; ++Entry)
+				SortedParameters[Entry] = SDEFVertices[Order[Entry]];
+			SDEFVertices.swap(SortedParameters);
+		}
+		Group.swap(Sorted);
+
+		for (uint32_t Entry = 0; Entry < Count; ++Entry) {
+			uint32_t Vertex = Group[Entry];
+			if (Entry == 0 || !(Sets[Vertex] == Sets[Group[Entry - 1]]) || Clusters.back().Vertices.Count == ChunkSize) {
+				Cluster New;
+				New.Vertices.Method = (VertexWeightMethod)Method;
+				New.Vertices.First = Entry;
+				New.Vertices.Count = 0;
+				New.FirstBone = (uint32_t)ClusterBones.size();
+				New.BoneCount = 0;
+				for (auto Bone : Sets[Vertex].Bones) {
+					if (Bone != UINT32_MAX) {
+						ClusterBones.push_back(Bone);
+						New.BoneCount++;
+					}
+				}
+				Clusters.push_back(New);
+			}
+
+			Clusters.back().Vertices.Count++;
+			VertexClusters[Vertex] = (uint32_t)Clusters.size() - 1;
+		}
+	}
+	StaleClusters.assign(Clusters.size(), 1);
+
+	Positions.resize(VertexCount);
+	Normals.resize(VertexCount);
+	for (uint32_t Vertex = 0; Vertex < VertexCount; ++Vertex) {
+		XMStoreFloat3(&Positions[Vertex], loadPosition(Vertices, Vertex));
+		Normals[Vertex] = Vertices.normals[Vertex];
+	}
+}
+
+void VertexSkinning::clear()
+{
+	Bones.clear();
+	Skinnings.clear();
+	StartPositions.clear();
+	ChangedBones.clear();
+
+	for (auto &Group : Groups)
+		Group.clear();
+	SDEFVertices.clear();
+	UsedMethods = NoMethods;
+
+	Clusters.clear();
+	ClusterBones.clear();
+	VertexClusters.clear();
+	StaleClusters.clear();
+	Updated.clear();
+	Chunks.clear();
+
+	Positions.clear();
+	Normals.clear();
+}
+
+void VertexSkinning::setBone(uint32_t Index, const btTransform &Skinning, const btVector3 &StartPosition)
+{
+	// Bones a motion leaves alone keep the very same transform from frame to frame
+	if (memcmp(&Skinnings[Index], &Skinning, sizeof(btTransform)) == 0 && memcmp(&StartPositions[Index], &StartPosition, sizeof(btVector3)) == 0)
+		return;
+
+	Skinnings[Index] = Skinning;
+	StartPositions[Index] = StartPosition;
+	ChangedBones[Index] = 1;
+
+	auto &Bone = Bones[Index];
+
+	// The same matrix the vertex shader gets, rotating around the initial position of the bone
+	XMVECTOR Rotation = Skinning.getRotation().get128();
+	XMMATRIX Matrix = XMMatrixAffineTransformation(XMVectorSplatOne(), StartPosition.get128(), Rotation, Skinning.getOrigin().get128());
+	XMStoreFloat4x3(&Bone.Matrix, Matrix);
+
+	// The dual part is half the translation, as a pure quaternion, times the rotation
+	XMVECTOR Translation = XMVectorSetW(Matrix.r[3], 0.0f);
+	XMStoreFloat4(&Bone.Real, Rotation);
+	XMStoreFloat4(&Bone.Dual, XMVectorScale(XMQuaternionMultiply(Rotation, Translation), 0.5f));
+}
+
+void VertexSkinning::invalidate(const std::vector<uint32_t> &Vertices)
+{
+	for (auto Vertex : Vertices)
+		StaleClusters[VertexClusters[Vertex]] = 1;
+}
+
+void VertexSkinning::skin(const VertexData &Vertices, MethodMask Methods, Dispatcher *Tasks)
+{
+	// Clusters of methods not skinned now stay stale until they are
+	if (std::find(ChangedBones.begin(), ChangedBones.end(), 1) != ChangedBones.end()) {
+		for (size_t Index = 0; Index < Clusters.size(); ++Index) {
+			auto &Entry = Clusters[Index];
+			for (uint32_t Bone = Entry.FirstBone; Bone < Entry.FirstBone + Entry.BoneCount; ++Bone) {
+				if (ChangedBones[ClusterBones[Bone]] != 0) {
+					StaleClusters[Index] = 1;
+					break;
+				}
+			}
+		}
+		std::fill(ChangedBones.begin(), ChangedBones.end(), 0);
+	}
+
+	Updated.clear();
+	Chunks.clear();
+	uint32_t ChunkVertices = 0;
+	for (size_t Index = 0; Index < Clusters.size(); ++Index) {
+		auto &Entries = Clusters[Index].Vertices;
+		if (StaleClusters[Index] == 0 || (Methods & maskOf(Entries.Method)) == 0)
+			continue;
+		StaleClusters[Index] = 0;
+
+		if (Chunks.empty() || ChunkVertices + Entries.Count > ChunkSize) {
+			Chunk New;
+			New.First = (uint32_t)Updated.size();
+			New.Count = 0;
+			Chunks.push_back(New);
+			ChunkVertices = 0;
+		}
+
+		Updated.push_back(Entries);
+		Chunks.back().Count++;
+		ChunkVertices += Entries.Count;
+	}
+
+	auto Run = [this, &Vertices](size_t Index) {
+		auto &Entry = Chunks[Index];
+		for (uint32_t Cluster = Entry.First; Cluster < Entry.First + Entry.Count; ++Cluster) {
+			auto &Entries = Updated[Cluster];
+			switch (Entries.Method) {
+			case VertexWeightMethod::BDEF1:
+				skinLinear<1>(Vertices, Entries);
+				break;
+			case VertexWeightMethod::BDEF2:
+				skinLinear<2>(Vertices, Entries);
+				break;
+			case VertexWeightMethod::BDEF4:
+				skinLinear<4>(Vertices, Entries);
+				break;
+			case VertexWeightMethod::SDEF:
+				skinSDEF(Vertices, Entries);
+				break;
+			case VertexWeightMethod::QDEF:
+				skinQDEF(Vertices, Entries);
+				break;
+			}
+		}
+	};
+
+	if (Tasks != nullptr && Chunks.size() > 1) {
+		Tasks->parallelFor(Chunks.size(), Run);
+	}
+	else {
+		for (size_t Index = 0; Index < Chunks.size(); ++Index)
+			Run(Index);
+	}
+}
+
+template <uint32_t Influences>
+void VertexSkinning::skinLinear(const VertexData &Vertices, const Range &Entries)
+{
+	auto &Group = Groups[(size_t)Entries.Method];
+
+	for (uint32_t Entry = Entries.First; Entry < Entries.First + Entries.Count; ++Entry) {
+		uint32_t Vertex = Group[Entry];
+		const uint32_t *Indices = &Vertices.boneIndices[Vertex].x;
+
+		XMMATRIX Matrix = XMLoadFloat4x3(&Bones[Indices[0]].Matrix);
+		if (Influences > 1) {
+			const float *Weights = &Vertices.boneWeights[Vertex].x;
+
+			XMVECTOR Weight = XMVectorReplicate(Weights[0]);
+			Matrix.r[0] = XMVectorMultiply(Matrix.r[0], Weight);
+			Matrix.r[1] = XMVectorMultiply(Matrix.r[1], Weight);
+			Matrix.r[2] = XMVectorMultiply(Matrix.r[2], Weight);
+			Matrix.r[3] = XMVectorMultiply(Matrix.r[3], Weight);
+
+			for (uint32_t Influence = 1; Influence < Influences; ++Influence) {
+				XMMATRIX Other = XMLoadFloat4x3(&Bones[Indices[Influence]].Matrix);
+				Weight = XMVectorReplicate(Weights[Influence]);
+				Matrix.r[0] = XMVectorMultiplyAdd(Other.r[0], Weight, Matrix.r[0]);
+				Matrix.r[1] = XMVectorMultiplyAdd(Other.r[1], Weight, Matrix.r[1]);
+				Matrix.r[2] = XMVectorMultiplyAdd(Other.r[2], Weight, Matrix.r[2]);
+				Matrix.r[3] = XMVectorMultiplyAdd(Other.r[3], Weight, Matrix.r[3]);
+			}
+		}
+
+		XMStoreFloat3(&Positions[Vertex], XMVector3Transform(loadPosition(Vertices, Vertex), Matrix));
+		XMStoreFloat3(&Normals[Vertex], XMVector3Normalize(XMVector3TransformNormal(XMLoadFloat3(&Vertices.normals[Vertex]), Matrix)));
+	}
+}
+
+void VertexSkinning::skinSDEF(const VertexData &Vertices, const Range &Entries)
+{
+	auto &Group = Groups[(size_t)VertexWeightMethod::SDEF];
+
+	for (uint32_t Entry = Entries.First; Entry < Entries.First + Entries.Count; ++Entry) {
+		uint32_t Vertex = Group[Entry];
+		auto &Parameters = SDEFVertices[Entry];
+		auto &Bone0 = Bones[Vertices.boneIndices[Vertex].x];
+		auto &Bone1 = Bones[Vertices.boneIndices[Vertex].y];
+		float Weight0 = Vertices.boneWeights[Vertex].x;
+		float Weight1 = 1.0f - Weight0;
+
+		XMVECTOR Rotation = XMQuaternionSlerp(XMLoadFloat4(&Bone0.Real), XMLoadFloat4(&Bone1.Real), Weight1);
+
+		XMVECTOR C = XMLoadFloat3(&Parameters.C);
+		XMVECTOR R0 = XMVector3Transform(XMLoadFloat3(&Parameters.R0), XMLoadFloat4x3(&Bone0.Matrix));
+		XMVECTOR R1 = XMVector3Transform(XMLoadFloat3(&Parameters.R1), XMLoadFloat4x3(&Bone1.Matrix));
+
+		XMVECTOR Position = XMVector3Rotate(XMVectorSubtract(loadPosition(Vertices, Vertex), C), Rotation);
+		Position = XMVectorMultiplyAdd(R0, XMVectorReplicate(Weight0), Position);
+		Position = XMVectorMultiplyAdd(R1, XMVectorReplicate(Weight1), Position);
+
+		XMStoreFloat3(&Positions[Vertex], Position);
+		XMStoreFloat3(&Normals[Vertex], XMVector3Rotate(XMLoadFloat3(&Vertices.normals[Vertex]), Rotation));
+	}
+}
+
+void VertexSkinning::skinQDEF(const VertexData &Vertices, const Range &Entries)
+{
+	auto &Group = Groups[(size_t)VertexWeightMethod::QDEF];
+
+	for (uint32_t Entry = Entries.First; Entry < Entries.First + Entries.Count; ++Entry) {
+		uint32_t Vertex = Group[Entry];
+		const uint32_t *Indices = &Vertices.boneIndices[Vertex].x;
+		const float *Weights = &Vertices.boneWeights[Vertex].x;
+
+		XMVECTOR Pivot = XMLoadFloat4(&Bones[Indices[0]].Real);
+		XMVECTOR Real = XMVectorZero();
+		XMVECTOR Dual = XMVectorZero();
+
+		for (uint32_t Influence = 0; Influence < 4; ++Influence) {
+			auto &Bone = Bones[Indices[Influence]];
+			XMVECTOR BoneReal = XMLoadFloat4(&Bone.Real);
+
+			// q and -q are the same rotation, blend every bone on the hemisphere of the first one
+			float Weight = Weights[Influence];
+			if (XMVectorGetX(XMVector4Dot(BoneReal, Pivot)) < 0.0f)
+				Weight = -Weight;
+
+			XMVECTOR Scale = XMVectorReplicate(Weight);
+			Real = XMVectorMultiplyAdd(BoneReal, Scale, Real);
+			Dual = XMVectorMultiplyAdd(XMLoadFloat4(&Bone.Dual), Scale, Dual);
+		}
+
+		XMVECTOR Length = XMVector4Length(Real);
+		Real = XMVectorDivide(Real, Length);
+		Dual = XMVectorDivide(Dual, Length);
+
+		// The translation is twice the dual part times the conjugate of the real one
+		XMVECTOR Translation = XMVectorScale(XMQuaternionMultiply(XMQuaternionConjugate(Real), Dual), 2.0f);
+
+		XMVECTOR Position = XMVectorAdd(XMVector3Rotate(loadPosition(Vertices, Vertex), Real), Translation);
+
+		XMStoreFloat3(&Positions[Vertex], Position);
+		XMStoreFloat3(&Normals[Vertex], XMVector3Rotate(XMLoadFloat3(&Vertices.normals[Vertex]), Real));
+	}
+}
@@ -0,0 +1,180 @@
+//===-- PMX/PMXSkinning.h - Declares the CPU vertex skinning ---*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the PMX::VertexSkinning class, which deforms the
+/// vertices of a model by its bones on the CPU
+///
+//===-------------------------------------------------------------------===//
+
+#pragma once
+
+#include "PMXDefinitions.h"
+
+#include <LinearMath/btAlignedObjectArray.h>
+#include <LinearMath/btTransform.h>
+#include <cstdint>
+#include <vector>
+
+class Dispatcher;
+
+namespace PMX {
+
+/// \brief Deforms the vertices of a model on the CPU, with every PMX weight method
+///
+/// Vertices are grouped by weight method when the skinning is initialized, so each
+/// group runs through its own SIMD kernel without branching on the method:
+/// - BDEF1, BDEF2 and BDEF4 blend the bone matrices linearly, like the vertex shader.
+/// - SDEF rotates the vertex around its C point by the spherical interpolation of both
+/// bone rotations, and moves it by the blended transforms of the R0 and R1 points.
+/// - QDEF blends the bones as dual quaternions, which keeps the volume of twisted joints.
+///
+/// Each group is sorted by the bones moving its vertices and split in clusters of vertices
+/// sharing the same bones. A cluster is only skinned again when the skinning transform of
+/// one of its bones or the morph offset of one of its vertices changed, so the vertices
+/// bound to bones a motion leaves alone are not touched. The clusters to skin are run in
+/// parallel, in chunks of consecutive clusters.
+///
+/// Only the selected weight methods are skinned, so a renderer can leave the linear ones
+/// to the GPU and skin only SDEF and QDEF vertices here.
+class VertexSkinning
+{
+public:
+	/// \brief A set of weight methods, bit N standing for VertexWeightMethod N
+	typedef uint32_t MethodMask;
+
+	enum : MethodMask {
+		NoMethods = 0,
+		AllMethods = (1u << (uint32_t)VertexWeightMethod::Count) - 1,
+	};
+
+	/// \brief Returns the mask of a single weight method
+	static MethodMask maskOf(VertexWeightMethod Method) { return 1u << (uint32_t)Method; }
+
+	/// \brief A range of consecutive entries of the group of a weight method
+	struct Range {
+		VertexWeightMethod Method;
+		uint32_t First;
+		uint32_t Count;
+	};
+
+	VertexSkinning();
+
+	/// \brief Groups the vertices of a model by weight method
+	///
+	/// \param [in] Vertices The vertices of the model
+	/// \param [in] BoneCount The amount of bones of the model
+	void initialize(const VertexData &Vertices, uint32_t BoneCount);
+
+	/// \brief Releases every array
+	void clear();
+
+	/// \brief Sets the transform a bone deforms its vertices with
+	///
+	/// Nothing is recomputed when the transform is bitwise equal to the one last set.
+	///
+	/// \param [in] Index The index of the bone
+	/// \param [in] Skinning The skinning transform of the bone, as returned by Bone::getSkinningTransform()
+	/// \param [in] StartPosition The initial position of the bone, the center of its rotation
+	void setBone(uint32_t Index, const btTransform &Skinning, const btVector3 &StartPosition);
+
+	/// \brief Marks vertices whose morph offsets changed, so they are skinned again
+	void invalidate(const std::vector<uint32_t> &Vertices);
+
+	/// \brief Deforms the vertices of the selected weight methods whose bones or morph offsets changed
+	///
+	/// The vertex morph offsets of Vertices are applied before the vertices are deformed.
+	///
+	/// \param [in] Vertices The vertices given to initialize(), with the current morph offsets
+	/// \param [in] Methods The weight methods whose vertices are deformed
+	/// \param [in] Tasks The dispatcher running the chunks in parallel, or nullptr to run them on this thread
+	void skin(const VertexData &Vertices, MethodMask Methods = AllMethods, Dispatcher *Tasks = nullptr);
+
+	/// \brief Returns the deformed position of each vertex, as of the last skin() of its weight method
+	const std::vector<DirectX::XMFLOAT3>& getPositions() const { return Positions; }
+	/// \brief Returns the deformed normal of each vertex, as of the last skin() of its weight method
+	const std::vector<DirectX::XMFLOAT3>& getNormals() const { return Normals; }
+
+	/// \brief Returns the vertices using a weight method, sorted by the bones moving them
+	const std::vector<uint32_t>& getVertices(VertexWeightMethod Method) const { return Groups[(size_t)Method]; }
+
+	/// \brief Returns the ranges of getVertices() deformed by the last skin()
+	const std::vector<Range>& getUpdatedRanges() const { return Updated; }
+
+	/// \brief Returns the weight methods used by at least one vertex
+	MethodMask getUsedMethods() const { return UsedMethods; }
+
+private:
+	/// \brief The transform of a bone, as a matrix and as a dual quaternion
+	struct BoneState {
+		DirectX::XMFLOAT4X3 Matrix;
+		/// \brief The rotation of the bone, also the real part of the dual quaternion
+		DirectX::XMFLOAT4 Real;
+		DirectX::XMFLOAT4 Dual;
+	};
+
+	/// \brief The SDEF parameters of a vertex, with R0 and R1 already moved halfway to C
+	struct SDEFVertex {
+		DirectX::XMFLOAT3 C;
+		DirectX::XMFLOAT3 R0;
+		DirectX::XMFLOAT3 R1;
+	};
+
+	/// \brief Vertices of a group moved by the same bones
+	struct Cluster {
+		Range Vertices;
+		/// \brief The bones of the cluster in ClusterBones
+		uint32_t FirstBone;
+		uint32_t BoneCount;
+	};
+
+	/// \brief A range of consecutive entries of Updated, skinned by a single task
+	struct Chunk {
+		uint32_t First;
+		uint32_t Count;
+	};
+
+	enum : uint32_t {
+		/// \brief The amount of vertices skinned by a single task, and the most a cluster holds
+		ChunkSize = 4096,
+	};
+
+	std::vector<BoneState> Bones;
+	/// \brief The transforms each bone was last set with
+	btAlignedObjectArray<btTransform> Skinnings;
+	btAlignedObjectArray<btVector3> StartPositions;
+	/// \brief Whether each bone was set with a different transform since the last skin()
+	std::vector<uint8_t> ChangedBones;
+
+	std::vector<uint32_t> Groups[(size_t)VertexWeightMethod::Count];
+	/// \brief The parameters of each vertex of the SDEF group, in the same order
+	std::vector<SDEFVertex> SDEFVertices;
+	MethodMask UsedMethods;
+
+	std::vector<Cluster> Clusters;
+	std::vector<uint32_t> ClusterBones;
+	/// \brief The cluster of each vertex
+	std::vector<uint32_t> VertexClusters;
+	/// \brief Whether each cluster has to be skinned again
+	std::vector<uint8_t> StaleClusters;
+
+	/// \brief The clusters skinned by the last skin()
+	std::vector<Range> Updated;
+	std::vector<Chunk> Chunks;
+
+	std::vector<DirectX::XMFLOAT3> Positions;
+	std::vector<DirectX::XMFLOAT3> Normals;
+
+	template <uint32_t Influences>
+	void skinLinear(const VertexData &Vertices, const Range &Entries);
+	void skinSDEF(const VertexData &Vertices, const Range &Entries);
+	void skinQDEF(const VertexData &Vertices, const Range &Entries);
+};
+
+}
@@ -0,0 +1,139 @@
+//===-- PMX/PMXVertexMorph.cpp - Defines the vertex morph accumulator --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-----------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the PMX::VertexMorphs class, which accumulates the
+/// weighted offsets of every vertex morph of a model
+///
+//===-----------------------------------------------------------------------------===//
+
+#include "PMXVertexMorph.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace PMX;
+
+VertexMorphs::VertexMorphs()
+{
+	Pending = false;
+	DirtyBegin = DirtyEnd = 0;
+}
+
+void VertexMorphs::initialize(const std::vector<Morph*> &Morphs)
+{
+	clear();
+
+	std::vector<std::pair<uint32_t, DirectX::XMFLOAT4>> Entries;
+
+	for (auto &Morph : Morphs) {
+		if (Morph->type != MorphType::Vertex)
+			continue;
+
+		Entries.clear();
+		for (auto &Data : Morph->data)
+			Entries.emplace_back(Data.vertex.index, DirectX::XMFLOAT4(Data.vertex.offset[0], Data.vertex.offset[1], Data.vertex.offset[2], 0.0f));
+
+		// Sorted entries let update() find the part of a morph inside the dirty range with a binary search
+		std::stable_sort(Entries.begin(), Entries.end(), [](const std::pair<uint32_t, DirectX::XMFLOAT4> &A, const std::pair<uint32_t, DirectX::XMFLOAT4> &B) { return A.first < B.first; });
+
+		MorphRange Range;
+		Range.First = (uint32_t)Indices.size();
+		Range.Count = (uint32_t)Entries.size();
+		Range.Begin = Entries.empty() ? 0 : Entries.front().first;
+		Range.End = Entries.empty() ? 0 : Entries.back().first + 1;
+		Range.Weight = Range.AppliedWeight = 0.0f;
+
+		for (auto &Entry : Entries) {
+			Indices.push_back(Entry.first);
+			Deltas.push_back(Entry.second);
+		}
+
+		MorphIds[Morph] = (uint32_t)this->Morphs.size();
+		this->Morphs.push_back(Range);
+	}
+}
+
+void VertexMorphs::clear()
+{
+	Morphs.clear();
+	MorphIds.clear();
+	Indices.clear();
+	Deltas.clear();
+	DirtyVertices.clear();
+	Pending = false;
+	DirtyBegin = DirtyEnd = 0;
+}
+
+void VertexMorphs::setWeight(const Morph *Morph, float Weight)
+{
+	auto Id = MorphIds.find(Morph);
+	if (Id == MorphIds.end())
+		return;
+
+	Morphs[Id->second].Weight = Weight;
+	Pending = true;
+}
+
+bool VertexMorphs::update(std::vector<DirectX::XMFLOAT4> &Offsets)
+{
+	DirtyBegin = UINT32_MAX;
+	DirtyEnd = 0;
+	DirtyVertices.clear();
+
+	if (Pending) {
+		for (auto &Range : Morphs) {
+			if (Range.Weight == Range.AppliedWeight)
+				continue;
+
+			Range.AppliedWeight = Range.Weight;
+			if (Range.Count == 0)
+				continue;
+
+			DirtyBegin = std::min(DirtyBegin, Range.Begin);
+			DirtyEnd = std::max(DirtyEnd, Range.End);
+			DirtyVertices.insert(DirtyVertices.end(), Indices.begin() + Range.First, Indices.begin() + Range.First + Range.Count);
+		}
+
+		Pending = false;
+	}
+
+	if (DirtyBegin >= DirtyEnd) {
+		DirtyBegin = DirtyEnd = 0;
+		return false;
+	}
+
+	std::sort(DirtyVertices.begin(), DirtyVertices.end());
+	DirtyVertices.erase(std::unique(DirtyVertices.begin(), DirtyVertices.end()), DirtyVertices.end());
+
+	// Rebuild the whole range from every active morph instead of adding weight differences,
+	// so the offsets never drift away from zero when all morphs are released
+	memset(&Offsets[DirtyBegin], 0, sizeof(DirectX::XMFLOAT4) * (DirtyEnd - DirtyBegin));
+
+	for (auto &Range : Morphs) {
+		if (Range.AppliedWeight == 0.0f || Range.End <= DirtyBegin || Range.Begin >= DirtyEnd)
+			continue;
+
+		auto First = Indices.begin() + Range.First, Last = First + Range.Count;
+		First = std::lower_bound(First, Last, DirtyBegin);
+		Last = std::lower_bound(First, Last, DirtyEnd);
+		if (First == Last)
+			continue;
+
+		DirectX::XMVECTOR Weight = DirectX::XMVectorReplicate(Range.AppliedWeight);
+		const DirectX::XMFLOAT4 *Delta = &Deltas[First - Indices.begin()];
+
+		for (auto Index = First; Index != Last; ++Index, ++Delta) {
+			auto &Offset = Offsets[*Index];
+			DirectX::XMStoreFloat4(&Offset, DirectX::XMVectorMultiplyAdd(DirectX::XMLoadFloat4(Delta), Weight, DirectX::XMLoadFloat4(&Offset)));
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,83 @@
+//===-- PMX/PMXVertexMorph.h - Declares the vertex morph accumulator --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the PMX::VertexMorphs class, which accumulates the
+/// weighted offsets of every vertex morph of a model
+///
+//===----------------------------------------------------------------------------===//
+
+#pragma once
+
+#include "PMXDefinitions.h"
+
+#include <unordered_map>
+#include <vector>
+
+namespace PMX {
+
+/// \brief Accumulates the vertex morphs of a model into its vertex offsets
+///
+/// Every vertex morph is stored as a pair of compact arrays (vertex indices sorted
+/// in ascending order and their deltas). Weights are only recorded when they are set;
+/// update() then recomputes, once per frame, the offsets of the smallest vertex range
+/// holding every vertex of the morphs that changed.
+class VertexMorphs
+{
+public:
+	VertexMorphs();
+
+	/// \brief Builds the compact arrays for the vertex morphs of a model
+	///
+	/// \param [in] Morphs Every morph of the model, morphs of other types are skipped
+	void initialize(const std::vector<Morph*> &Morphs);
+
+	/// \brief Releases every array
+	void clear();
+
+	/// \brief Sets the weight of a vertex morph, the offsets are not changed until update() is called
+	void setWeight(const Morph *Morph, float Weight);
+
+	/// \brief Recomputes the offsets of the vertices affected by the morphs whose weight changed
+	///
+	/// \param [in,out] Offsets The morph offset of each vertex
+	/// \returns false if no offset changed since the last call
+	bool update(std::vector<DirectX::XMFLOAT4> &Offsets);
+
+	/// \brief Returns the vertices of the morphs changed by the last update(), in ascending order
+	const std::vector<uint32_t>& getDirtyVertices() const { return DirtyVertices; }
+
+private:
+	struct MorphRange {
+		/// \brief The first entry of the morph in Indices and Deltas
+		uint32_t First;
+		uint32_t Count;
+		/// \brief The lowest vertex index of the morph
+		uint32_t Begin;
+		/// \brief One past the highest vertex index of the morph
+		uint32_t End;
+		float Weight;
+		float AppliedWeight;
+	};
+
+	std::vector<MorphRange> Morphs;
+	std::unordered_map<const Morph*, uint32_t> MorphIds;
+
+	std::vector<uint32_t> Indices;
+	std::vector<DirectX::XMFLOAT4> Deltas;
+
+	/// \brief Whether any weight changed since the last update
+	bool Pending;
+
+	/// \brief The vertex range cleared and rebuilt by the last update()
+	uint32_t DirtyBegin, DirtyEnd;
+	std::vector<uint32_t> DirtyVertices;
+};
+
+}
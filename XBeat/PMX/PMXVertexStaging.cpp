@@ -0,0 +1,51 @@
+//===-- PMX/PMXVertexStaging.cpp - Defines partial vertex buffer uploads --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===--------------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the classes used to upload only the changed parts of a
+/// vertex buffer
+///
+//===--------------------------------------------------------------------------------===//
+
+#include "PMXVertexStaging.h"
+
+#include <algorithm>
+
+using namespace PMX;
+
+bool RecordingVertexStaging::upload(uint32_t First, uint32_t Count, const void *Data)
+{
+	Range Uploaded = { First, Count };
+	Ranges.push_back(Uploaded);
+	return true;
+}
+
+bool DirtyVertexRanges::flush(VertexStaging &Staging, const void *Data, size_t Stride)
+{
+	if (Vertices.empty())
+		return true;
+
+	std::sort(Vertices.begin(), Vertices.end());
+
+	bool Result = true;
+	uint32_t First = Vertices.front(), Last = First;
+
+	for (auto Vertex : Vertices) {
+		if (Vertex - Last > MaximumGap + 1) {
+			Result &= Staging.upload(First, Last - First + 1, (const char*)Data + First * Stride);
+			First = Vertex;
+		}
+		Last = Vertex;
+	}
+
+	Result &= Staging.upload(First, Last - First + 1, (const char*)Data + First * Stride);
+
+	Vertices.clear();
+	return Result;
+}
@@ -0,0 +1,85 @@
+//===-- PMX/PMXVertexStaging.h - Declares partial vertex buffer uploads --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the classes used to upload only the changed parts of a
+/// vertex buffer
+///
+//===-------------------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace PMX {
+
+/// \brief Destination of vertex buffer uploads
+///
+/// The renderer uploads through D3DVertexStaging, declared in PMXD3DVertexStaging.h.
+class VertexStaging
+{
+public:
+	virtual ~VertexStaging() {}
+
+	/// \brief Uploads a range of consecutive vertices
+	///
+	/// \param [in] First The first vertex of the range
+	/// \param [in] Count The amount of vertices in the range
+	/// \param [in] Data The data of vertex First, followed by the other ones
+	/// \returns Whether the upload succeeded or not
+	virtual bool upload(uint32_t First, uint32_t Count, const void *Data) = 0;
+};
+
+/// \brief Only records the ranges it is asked to upload, so uploads can be checked without a GPU
+class RecordingVertexStaging : public VertexStaging
+{
+public:
+	struct Range {
+		uint32_t First;
+		uint32_t Count;
+	};
+
+	virtual bool upload(uint32_t First, uint32_t Count, const void *Data);
+
+	const std::vector<Range>& getRanges() const { return Ranges; }
+	void clear() { Ranges.clear(); }
+
+private:
+	std::vector<Range> Ranges;
+};
+
+/// \brief Collects the vertices changed during a frame and uploads them as few ranges
+class DirtyVertexRanges
+{
+public:
+	/// \param [in] MaximumGap Two changed vertices separated by at most this many unchanged
+	/// vertices are uploaded in the same range
+	DirtyVertexRanges(uint32_t MaximumGap = 16) : MaximumGap(MaximumGap) {}
+
+	/// \brief Marks a vertex as changed
+	void add(uint32_t Vertex) { Vertices.push_back(Vertex); }
+
+	bool empty() const { return Vertices.empty(); }
+
+	/// \brief Uploads every changed vertex, coalescing them into ranges, and forgets them
+	///
+	/// \param [in] Staging The destination of the uploads
+	/// \param [in] Data The whole vertex array
+	/// \param [in] Stride The size of a single vertex
+	/// \returns false if any upload failed
+	bool flush(VertexStaging &Staging, const void *Data, size_t Stride);
+
+private:
+	std::vector<uint32_t> Vertices;
+	uint32_t MaximumGap;
+};
+
+}
@@ -33,7 +33,7 @@ Scenes::Menu::Menu()
 {
 	std::random_device RandomDevice;
 	RandomGenerator.seed(RandomDevice());
-	Paused = false;
+	MotionStart = 0.0;
 }
 
 Scenes::Menu::~Menu()
@@ -116,6 +116,8 @@ void Scenes::Menu::shutdown()
 void Scenes::Menu::frame(float FrameTime)
 {
 #if 1
+	Clock.update();
+
 	// Check if a new motion should be loaded
 	if (!KnownMotions.empty()) {
 		if (!Motion || Motion->isFinished()) {
@@ -123,8 +125,10 @@ void Scenes::Menu::frame(float FrameTime)
 			Model->Reset();
 
 			// Add a waiting time 
+			double WaitTime = 0.0;
 			if (Motion != nullptr)
-				WaitTime = (float)RandomGenerator() / (float)RandomGenerator.max() * 15.0f;
+				WaitTime = (double)RandomGenerator() / (double)RandomGenerator.max() * 15.0;
+			MotionStart = Clock.getTime() + WaitTime;
 
 			// Initialize a new random VMD motion
 			Motion.reset(new VMD::Motion);
@@ -134,11 +138,9 @@ void Scenes::Menu::frame(float FrameTime)
 
 			Motion->attachModel(Model);
 		}
-		else if (!Paused) {
-			if (WaitTime <= 0.0f)
-				Motion->advanceFrame(FrameTime * 30.0f);
-			else 
-				WaitTime -= FrameTime;
+		else if (!Clock.isPaused() && Clock.getTime() >= MotionStart) {
+			// The frame is computed from the clock, so render hitches do not make the motion drift
+			Motion->setFrame((Clock.getTime() - MotionStart) * 30.0);
 		}
 	}
 #endif
@@ -170,13 +172,14 @@ void Scenes::Menu::onAttached()
 	InputManager->addBinding(Input::CallbackInfo(Input::CallbackInfo::OnKeyUp, DIK_R), [this](void *unused) {
 		if (this->Motion)
 			this->Motion->reset();
+		this->MotionStart = this->Clock.getTime();
 		this->Model->Reset();
 	});
 	InputManager->addBinding(Input::CallbackInfo(Input::CallbackInfo::OnKeyUp, DIK_E), [this](void *unused) {
-		this->Paused = false;
+		this->Clock.resume();
 	});
 	InputManager->addBinding(Input::CallbackInfo(Input::CallbackInfo::OnKeyUp, DIK_W), [this](void *unused) {
-		this->Paused = true;
+		this->Clock.pause();
 	});
 	InputManager->addBinding(Input::CallbackInfo(Input::CallbackInfo::OnKeyUp, DIK_X), [this](void *unused) {
 		this->Model->GetBoneByName(L"右足ＩＫ")->translate(btVector3(0, 0, -1.0f));
@@ -15,6 +15,7 @@
 #pragma once
 
 #include "Scene.h"
+#include "../VMD/MotionClock.h"
 
 #include <random>
 #include <string>
@@ -64,8 +65,11 @@ namespace Scenes {
 		std::shared_ptr<PMX::PMXShader> Shader;
 
 		std::mt19937 RandomGenerator;
-		float WaitTime;
-		bool Paused;
+
+		/// \brief The timeline the motions are played against
+		VMD::MotionClock Clock;
+		/// \brief The time of the clock at which the current motion starts, after a random wait
+		double MotionStart;
 	};
 
 }
\ No newline at end of file
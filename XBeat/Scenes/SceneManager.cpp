@@ -36,7 +36,7 @@ bool Scenes::SceneManager::initialize(int ScreenWidth, int ScreenHeight, HWND Wi
 		return false;
 	}
 
-	ModelHandler.reset(new ModelManager);
+	ModelHandler.reset(new ModelManager(EventDispatcher));
 	assert(ModelHandler);
 
 	TextureShader.reset(new Renderer::Shaders::Texture);
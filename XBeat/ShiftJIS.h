@@ -0,0 +1,73 @@
+//===-- ShiftJIS.h - Declares the Shift-JIS text decoder -----------*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the ShiftJIS class, a portable decoder and encoder for text
+/// encoded with the Shift-JIS (code page 932) encoding used by MMD files
+///
+//===------------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+/// \brief Decodes Shift-JIS text, as found in VMD and PMD files
+///
+/// The conversion follows the Windows code page 932 and does not depend on any
+/// system library. Unmapped double byte sequences decode to U+30FB, the default
+/// character of that code page.
+///
+/// Names in a motion repeat on every key frame, so an instance also keeps a cache of
+/// the names it already decoded: each distinct name is only decoded and allocated once.
+class ShiftJIS
+{
+public:
+	/// \brief Decodes a string into UTF-16
+	///
+	/// \param [in] Data The encoded bytes
+	/// \param [in] Length The maximum amount of bytes to be decoded, decoding stops at the first NUL
+	/// \param [out] Output The decoded string
+	static void decode(const char *Data, size_t Length, std::wstring &Output);
+
+	/// \brief Decodes a string into UTF-16
+	/// \sa decode(const char *Data, size_t Length, std::wstring &Output)
+	static std::wstring decode(const char *Data, size_t Length);
+
+	/// \brief Decodes a string into UTF-8
+	/// \sa decode(const char *Data, size_t Length, std::wstring &Output)
+	static std::string decodeUTF8(const char *Data, size_t Length);
+
+	/// \brief Decodes a string, reusing the result of a previous call with the same bytes
+	///
+	/// \returns A reference to the decoded string, valid until clear() is called or the
+	/// object is destroyed
+	const std::wstring& intern(const char *Data, size_t Length);
+
+	/// \brief Encodes a string into Shift-JIS
+	///
+	/// \param [in] Text The UTF-16 string to be encoded
+	/// \param [out] Output The encoded bytes, characters without a mapping are written as '?'
+	static void encode(const std::wstring &Text, std::string &Output);
+
+	/// \brief Releases every cached name
+	void clear() { Names.clear(); }
+
+private:
+	/// \brief Decodes a single character
+	///
+	/// \param [in,out] Data The current byte, moved past the character
+	/// \param [in] End One past the last byte to be decoded
+	/// \returns The UTF-16 code unit of the character
+	static wchar_t decodeCharacter(const unsigned char *&Data, const unsigned char *End);
+
+	/// \brief The decoded names, keyed by their encoded bytes
+	std::unordered_map<std::string, std::wstring> Names;
+};
@@ -0,0 +1,486 @@
+//===-- VMD/BakedMotion.cpp - Defines the baked VMD pose stream ------*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the VMD::BakedMotion class, a motion sampled at a
+/// fixed rate into quantized poses
+///
+//===-------------------------------------------------------------------------===//
+
+#include "BakedMotion.h"
+
+#include "Motion.h"
+#include "../MappedFile.h"
+#include "../PMX/PMXModel.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace VMD;
+
+namespace fs = boost::filesystem;
+
+namespace {
+	struct FileHeader {
+		char Magic[4];
+		uint32_t Version;
+		uint64_t SourceSize;
+		int64_t SourceTime;
+		float SampleRate;
+		uint32_t SampleCount;
+		float MaxFrame;
+		uint32_t BoneCount;
+		uint32_t TranslationCount;
+		uint32_t MorphCount;
+	};
+
+	/// \brief The range of the three stored components of a quaternion, [-1/sqrt(2); 1/sqrt(2)]
+	const float ComponentRange = 0.70710678f;
+	/// \brief The largest value of a stored component
+	const float ComponentScale = 32767.0f;
+	/// \brief The largest value of a stored morph weight
+	const float WeightScale = 65535.0f;
+
+	bool getSourceInfo(const std::wstring &FileName, uint64_t &Size, int64_t &Time) {
+		boost::system::error_code Error;
+		Size = (uint64_t)fs::file_size(FileName, Error);
+		if (Error) return false;
+		Time = (int64_t)fs::last_write_time(FileName, Error);
+		return !Error;
+	}
+
+	/// \brief Reads the sections of a bake, checking that each one is complete
+	struct Reader
+	{
+		const char *Current;
+		const char *End;
+
+		bool read(void *Output, size_t Size) {
+			if ((size_t)(End - Current) < Size)
+				return false;
+			memcpy(Output, Current, Size);
+			Current += Size;
+			return true;
+		}
+
+		template <class T>
+		bool readArray(std::vector<T> &Output, size_t Count) {
+			if ((size_t)(End - Current) / sizeof(T) < Count)
+				return false;
+			Output.resize(Count);
+			return read(Output.data(), Count * sizeof(T));
+		}
+
+		bool readName(std::wstring &Name) {
+			uint32_t Length;
+			if (!read(&Length, sizeof(uint32_t)) || (size_t)(End - Current) / sizeof(uint16_t) < Length)
+				return false;
+
+			Name.resize(Length);
+			for (uint32_t i = 0; i < Length; ++i) {
+				uint16_t Unit;
+				memcpy(&Unit, Current, sizeof(uint16_t));
+				Current += sizeof(uint16_t);
+				Name[i] = (wchar_t)Unit;
+			}
+			return true;
+		}
+	};
+
+	void writeName(fs::ofstream &Output, const std::wstring &Name) {
+		// Names are stored as UTF-16, whatever the size of wchar_t
+		uint32_t Length = (uint32_t)Name.size();
+		Output.write((const char*)&Length, sizeof(uint32_t));
+		for (wchar_t C : Name) {
+			uint16_t Unit = (uint16_t)C;
+			Output.write((const char*)&Unit, sizeof(uint16_t));
+		}
+	}
+
+	template <class T>
+	void writeArray(fs::ofstream &Output, const std::vector<T> &Array) {
+		if (!Array.empty())
+			Output.write((const char*)Array.data(), Array.size() * sizeof(T));
+	}
+}
+
+BakedMotion::BakedMotion()
+{
+	SampleRate = 30.0f;
+	SampleCount = 0;
+	MaxFrame = 0.0f;
+	TranslationCount = 0;
+	reset();
+}
+
+void BakedMotion::reset()
+{
+	CurrentFrame = 0.0;
+	Finished = false;
+}
+
+BakedMotion::QuantizedRotation BakedMotion::quantize(const float *Rotation)
+{
+	uint32_t Largest = 0;
+	for (uint32_t i = 1; i < 4; ++i) {
+		if (fabsf(Rotation[i]) > fabsf(Rotation[Largest]))
+			Largest = i;
+	}
+
+	// q and -q are the same rotation, so the dropped component is always made positive
+	float Sign = Rotation[Largest] < 0.0f ? -1.0f : 1.0f;
+
+	QuantizedRotation Quantized;
+	for (uint32_t i = 0, j = 0; i < 4; ++i) {
+		if (i == Largest)
+			continue;
+
+		float Value = std::min(std::max(Rotation[i] * Sign, -ComponentRange), ComponentRange);
+		Quantized.Components[j++] = (uint16_t)((Value + ComponentRange) / (2.0f * ComponentRange) * ComponentScale + 0.5f);
+	}
+
+	Quantized.Components[0] |= (uint16_t)((Largest & 1) << 15);
+	Quantized.Components[1] |= (uint16_t)((Largest >> 1) << 15);
+	return Quantized;
+}
+
+void BakedMotion::dequantize(const QuantizedRotation &Quantized, float *Rotation)
+{
+	uint32_t Largest = (Quantized.Components[0] >> 15) | ((Quantized.Components[1] >> 15) << 1);
+
+	float Sum = 0.0f;
+	for (uint32_t i = 0, j = 0; i < 4; ++i) {
+		if (i == Largest)
+			continue;
+
+		float Value = (float)(Quantized.Components[j++] & 0x7FFF) / ComponentScale * (2.0f * ComponentRange) - ComponentRange;
+		Rotation[i] = Value;
+		Sum += Value * Value;
+	}
+
+	Rotation[Largest] = sqrtf(std::max(0.0f, 1.0f - Sum));
+}
+
+void BakedMotion::bake(Motion &Source, float SampleRate)
+{
+	this->SampleRate = SampleRate;
+	MaxFrame = Source.MaxFrame;
+	SampleCount = (uint32_t)ceilf(MaxFrame * SampleRate / 30.0f) + 1;
+
+	// Every track is baked, the tracks a model lacks are skipped when it is bound
+	BoneNames.clear();
+	MorphNames.clear();
+	for (auto &Track : Source.BoneTracks)
+		BoneNames.push_back(Track.BoneName);
+	for (auto &Track : Source.MorphTracks)
+		MorphNames.push_back(Track.MorphName);
+
+	size_t BoneCount = BoneNames.size(), MorphCount = MorphNames.size();
+	Rotations.resize(BoneCount * SampleCount);
+	MorphWeights.resize(MorphCount * SampleCount);
+
+	// Translations are kept for every bone until it is known which ones move
+	std::vector<float> AllTranslations(BoneCount * 3 * SampleCount);
+	std::vector<uint8_t> Moves(BoneCount, 0);
+
+	Source.reset();
+	for (uint32_t Sample = 0; Sample < SampleCount; ++Sample) {
+		float Frame = std::min((float)Sample * 30.0f / SampleRate, MaxFrame);
+		Source.updateBones(Frame);
+		Source.updateMorphs(Frame);
+
+		for (size_t Bone = 0; Bone < BoneCount; ++Bone) {
+			auto &Pose = Source.BonePoses[Bone];
+			float Rotation[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+			float *Translation = &AllTranslations[(Sample * BoneCount + Bone) * 3];
+
+			// A track that has not started yet leaves the bone at rest
+			if (Pose.Active) {
+				Rotation[0] = Pose.Rotation.getX();
+				Rotation[1] = Pose.Rotation.getY();
+				Rotation[2] = Pose.Rotation.getZ();
+				Rotation[3] = Pose.Rotation.getW();
+				Translation[0] = Pose.Translation.getX();
+				Translation[1] = Pose.Translation.getY();
+				Translation[2] = Pose.Translation.getZ();
+				if (Translation[0] != 0.0f || Translation[1] != 0.0f || Translation[2] != 0.0f)
+					Moves[Bone] = 1;
+			}
+
+			Rotations[Sample * BoneCount + Bone] = quantize(Rotation);
+		}
+
+		for (size_t Morph = 0; Morph < MorphCount; ++Morph) {
+			auto &Pose = Source.MorphPoses[Morph];
+			float Weight = Pose.Active ? std::min(std::max(Pose.Weight, 0.0f), 1.0f) : 0.0f;
+			MorphWeights[Sample * MorphCount + Morph] = (uint16_t)(Weight * WeightScale + 0.5f);
+		}
+	}
+	Source.reset();
+
+	TranslationSlots.assign(BoneCount, NoTranslation);
+	TranslationCount = 0;
+	for (size_t Bone = 0; Bone < BoneCount; ++Bone) {
+		if (Moves[Bone])
+			TranslationSlots[Bone] = TranslationCount++;
+	}
+
+	Translations.resize(TranslationCount * 3 * SampleCount);
+	for (uint32_t Sample = 0; Sample < SampleCount; ++Sample) {
+		for (size_t Bone = 0; Bone < BoneCount; ++Bone) {
+			if (TranslationSlots[Bone] != NoTranslation)
+				memcpy(&Translations[(Sample * TranslationCount + TranslationSlots[Bone]) * 3], &AllTranslations[(Sample * BoneCount + Bone) * 3], 3 * sizeof(float));
+		}
+	}
+
+	reset();
+	for (auto &Binding : AttachedModels)
+		bindModel(Binding);
+}
+
+std::wstring BakedMotion::getBakePath(const std::wstring &MotionFile)
+{
+	return fs::path(MotionFile).replace_extension(L".vmdb").wstring();
+}
+
+bool BakedMotion::load(const std::wstring &MotionFile)
+{
+	uint64_t SourceSize;
+	int64_t SourceTime;
+	if (!getSourceInfo(MotionFile, SourceSize, SourceTime))
+		return false;
+
+	MappedFile File;
+	if (!File.open(getBakePath(MotionFile)))
+		return false;
+
+	Reader Input = { File.data(), File.end() };
+	FileHeader Header;
+	if (!Input.read(&Header, sizeof(FileHeader)))
+		return false;
+
+	if (memcmp(Header.Magic, "VMDB", 4) != 0 || Header.Version != Version)
+		return false;
+	if (Header.SourceSize != SourceSize || Header.SourceTime != SourceTime)
+		return false;
+	if (Header.SampleCount == 0 || Header.TranslationCount > Header.BoneCount)
+		return false;
+
+	std::vector<std::wstring> LoadedBones(Header.BoneCount), LoadedMorphs(Header.MorphCount);
+	for (auto &Name : LoadedBones) {
+		if (!Input.readName(Name))
+			return false;
+	}
+	for (auto &Name : LoadedMorphs) {
+		if (!Input.readName(Name))
+			return false;
+	}
+
+	std::vector<uint32_t> LoadedSlots;
+	std::vector<QuantizedRotation> LoadedRotations;
+	std::vector<float> LoadedTranslations;
+	std::vector<uint16_t> LoadedWeights;
+
+	if (!Input.readArray(LoadedSlots, Header.BoneCount) ||
+		!Input.readArray(LoadedRotations, (size_t)Header.BoneCount * Header.SampleCount) ||
+		!Input.readArray(LoadedTranslations, (size_t)Header.TranslationCount * 3 * Header.SampleCount) ||
+		!Input.readArray(LoadedWeights, (size_t)Header.MorphCount * Header.SampleCount))
+		return false;
+
+	for (auto Slot : LoadedSlots) {
+		if (Slot != NoTranslation && Slot >= Header.TranslationCount)
+			return false;
+	}
+
+	SampleRate = Header.SampleRate;
+	SampleCount = Header.SampleCount;
+	MaxFrame = Header.MaxFrame;
+	TranslationCount = Header.TranslationCount;
+	BoneNames.swap(LoadedBones);
+	MorphNames.swap(LoadedMorphs);
+	TranslationSlots.swap(LoadedSlots);
+	Rotations.swap(LoadedRotations);
+	Translations.swap(LoadedTranslations);
+	MorphWeights.swap(LoadedWeights);
+
+	reset();
+	for (auto &Binding : AttachedModels)
+		bindModel(Binding);
+
+	return true;
+}
+
+bool BakedMotion::save(const std::wstring &MotionFile) const
+{
+	FileHeader Header;
+	memset(&Header, 0, sizeof(FileHeader));
+	memcpy(Header.Magic, "VMDB", 4);
+	Header.Version = Version;
+
+	if (!getSourceInfo(MotionFile, Header.SourceSize, Header.SourceTime))
+		return false;
+
+	Header.SampleRate = SampleRate;
+	Header.SampleCount = SampleCount;
+	Header.MaxFrame = MaxFrame;
+	Header.BoneCount = (uint32_t)BoneNames.size();
+	Header.TranslationCount = TranslationCount;
+	Header.MorphCount = (uint32_t)MorphNames.size();
+
+	fs::path BakePath(getBakePath(MotionFile)), TemporaryPath(BakePath);
+	TemporaryPath += L".tmp";
+
+	bool Written;
+	{
+		fs::ofstream Output(TemporaryPath, std::ios::binary | std::ios::trunc);
+		if (!Output.good())
+			return false;
+
+		Output.write((const char*)&Header, sizeof(FileHeader));
+		for (auto &Name : BoneNames)
+			writeName(Output, Name);
+		for (auto &Name : MorphNames)
+			writeName(Output, Name);
+
+		writeArray(Output, TranslationSlots);
+		writeArray(Output, Rotations);
+		writeArray(Output, Translations);
+		writeArray(Output, MorphWeights);
+
+		Written = Output.good();
+	}
+
+	boost::system::error_code Error;
+	if (!Written) {
+		fs::remove(TemporaryPath, Error);
+		return false;
+	}
+
+	// Replace the old bake only once the new one is complete
+	fs::rename(TemporaryPath, BakePath, Error);
+	if (Error) {
+		fs::remove(TemporaryPath, Error);
+		return false;
+	}
+
+	return true;
+}
+
+std::shared_ptr<BakedMotion> BakedMotion::loadOrBake(const std::wstring &MotionFile, float SampleRate)
+{
+	auto Baked = std::make_shared<BakedMotion>();
+	if (Baked->load(MotionFile) && Baked->SampleRate == SampleRate)
+		return Baked;
+
+	Motion Source;
+	if (!Source.loadFromFile(MotionFile))
+		return nullptr;
+
+	Baked->bake(Source, SampleRate);
+
+	// A bake that could not be stored is still usable, it will just be made again next time
+	Baked->save(MotionFile);
+	return Baked;
+}
+
+void BakedMotion::attachModel(std::shared_ptr<PMX::Model> Model)
+{
+	ModelBinding Binding;
+	Binding.Model = Model;
+	bindModel(Binding);
+
+	AttachedModels.push_back(std::move(Binding));
+}
+
+void BakedMotion::bindModel(ModelBinding &Binding)
+{
+	Binding.Bones.resize(BoneNames.size());
+	for (size_t Bone = 0; Bone < BoneNames.size(); ++Bone)
+		Binding.Bones[Bone] = Binding.Model->FindBone(BoneNames[Bone]);
+
+	Binding.Morphs.resize(MorphNames.size());
+	for (size_t Morph = 0; Morph < MorphNames.size(); ++Morph)
+		Binding.Morphs[Morph] = Binding.Model->FindMorph(MorphNames[Morph]);
+}
+
+bool BakedMotion::advanceFrame(float Frames)
+{
+	return setFrame(CurrentFrame + Frames);
+}
+
+bool BakedMotion::setFrame(double Frame)
+{
+	CurrentFrame = Frame;
+
+	Finished = CurrentFrame >= MaxFrame;
+	if (Finished)
+		return true;
+
+	if (AttachedModels.empty() || SampleCount == 0)
+		return false;
+
+	// Find the two samples around the current frame
+	float Position = (float)(std::max(CurrentFrame, 0.0) * SampleRate / 30.0);
+	uint32_t Sample = std::min((uint32_t)Position, SampleCount - 1);
+	uint32_t NextSample = std::min(Sample + 1, SampleCount - 1);
+	float Ratio = std::min(Position - (float)Sample, 1.0f);
+
+	size_t BoneCount = BoneNames.size(), MorphCount = MorphNames.size();
+	const QuantizedRotation *Rotations1 = Rotations.empty() ? nullptr : &Rotations[Sample * BoneCount];
+	const QuantizedRotation *Rotations2 = Rotations.empty() ? nullptr : &Rotations[NextSample * BoneCount];
+	const float *Translations1 = Translations.empty() ? nullptr : &Translations[Sample * TranslationCount * 3];
+	const float *Translations2 = Translations.empty() ? nullptr : &Translations[NextSample * TranslationCount * 3];
+	const uint16_t *Weights1 = MorphWeights.empty() ? nullptr : &MorphWeights[Sample * MorphCount];
+	const uint16_t *Weights2 = MorphWeights.empty() ? nullptr : &MorphWeights[NextSample * MorphCount];
+
+	for (auto &Binding : AttachedModels) {
+		auto &Model = Binding.Model;
+		Model->Reset();
+
+		for (size_t Bone = 0; Bone < BoneCount; ++Bone) {
+			auto Target = Model->GetBone(Binding.Bones[Bone]);
+			if (Target == nullptr)
+				continue;
+
+			float R1[4], R2[4];
+			dequantize(Rotations1[Bone], R1);
+			dequantize(Rotations2[Bone], R2);
+
+			// Quantizing may flip the sign of a rotation, take the shortest path between the samples
+			if (R1[0] * R2[0] + R1[1] * R2[1] + R1[2] * R2[2] + R1[3] * R2[3] < 0.0f) {
+				for (int i = 0; i < 4; ++i)
+					R2[i] = -R2[i];
+			}
+
+			btQuaternion Rotation = btQuaternion(R1[0], R1[1], R1[2], R1[3]).slerp(btQuaternion(R2[0], R2[1], R2[2], R2[3]), Ratio);
+
+			btVector3 Translation(0.0f, 0.0f, 0.0f);
+			uint32_t Slot = TranslationSlots[Bone];
+			if (Slot != NoTranslation) {
+				const float *T1 = &Translations1[Slot * 3], *T2 = &Translations2[Slot * 3];
+				Translation.setValue(T1[0] + (T2[0] - T1[0]) * Ratio, T1[1] + (T2[1] - T1[1]) * Ratio, T1[2] + (T2[2] - T1[2]) * Ratio);
+			}
+
+			Target->transform(btTransform(Rotation, Translation), PMX::DeformationOrigin::Motion);
+		}
+
+		for (size_t Morph = 0; Morph < MorphCount; ++Morph) {
+			if (!Binding.Morphs[Morph].isValid())
+				continue;
+
+			float Weight = ((float)Weights1[Morph] + ((float)Weights2[Morph] - (float)Weights1[Morph]) * Ratio) / WeightScale;
+			Model->ApplyMorph(Binding.Morphs[Morph], Weight);
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,157 @@
+//===-- VMD/BakedMotion.h - Declares the baked VMD pose stream ------*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the VMD::BakedMotion class, a motion sampled at a
+/// fixed rate into quantized poses
+///
+//===-------------------------------------------------------------------------===//
+
+#pragma once
+
+#include "../PMX/PMXNameIndex.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace PMX { class Model; }
+
+namespace VMD {
+
+	class Motion;
+
+	/// \brief A motion sampled at a fixed rate
+	///
+	/// Baking evaluates every bone and morph track of a motion at each sample, and
+	/// stores the results: local rotations as 48-bit quaternions,
+	/// translations only for bones that move at some point, and morph weights as 16-bit
+	/// values. Playing it back then only interpolates between two samples, whatever the
+	/// amount of key frames of the motion, so many models can be animated cheaply.
+	///
+	/// The bake does not depend on any model, the baked names are resolved against each
+	/// attached one, so a single bake is stored next to the .vmd file and is discarded
+	/// when the motion file changes. Since baking a long motion takes a while, loadOrBake() may be run as a
+	/// Dispatcher task.
+	///
+	/// \remarks IK is not part of the bake: IK bones keep being solved when the model is updated.
+	class BakedMotion
+	{
+	public:
+		/// \brief The version of the file format, bump whenever the layout changes
+		static const uint32_t Version = 2;
+
+		BakedMotion();
+
+		/// \brief Samples every track of a motion
+		///
+		/// \param [in] Source The motion to be sampled, it is rewound afterwards
+		/// \param [in] SampleRate The amount of samples per second, usually 30 or 60
+		void bake(Motion &Source, float SampleRate);
+
+		/// \brief Loads a bake from disk, if it is still valid for its motion file
+		///
+		/// \param [in] MotionFile The path of the .vmd file the bake was made from
+		/// \returns false if the bake does not exist, is outdated or is corrupt
+		bool load(const std::wstring &MotionFile);
+
+		/// \brief Stores the bake next to its motion file
+		///
+		/// \returns Whether the file was written or not
+		bool save(const std::wstring &MotionFile) const;
+
+		/// \brief Loads the bake of a motion, baking and storing it if needed
+		///
+		/// \returns The bake, or nullptr if the motion could not be loaded
+		static std::shared_ptr<BakedMotion> loadOrBake(const std::wstring &MotionFile, float SampleRate);
+
+		/// \brief Returns the path of the bake of a motion
+		static std::wstring getBakePath(const std::wstring &MotionFile);
+
+		/// \brief Attaches a model to be animated by the bake
+		void attachModel(std::shared_ptr<PMX::Model> Model);
+
+		/// \brief Advances the frame of the motion
+		///
+		/// \param [in] Frames The amount of 30 Hz frames to advance the motion
+		/// \returns true if the animation is finished, false otherwise
+		bool advanceFrame(float Frames);
+
+		/// \brief Plays the motion at an absolute frame
+		///
+		/// \param [in] Frame The frame to be played, in 30 Hz frames, usually computed from a MotionClock
+		/// \returns true if the animation is finished, false otherwise
+		bool setFrame(double Frame);
+
+		/// \brief Resets the playback state
+		void reset();
+
+		/// \brief Returns the motion finished state
+		bool isFinished() const { return Finished; }
+
+	private:
+		/// \brief A unit quaternion stored in 48 bits
+		///
+		/// The largest component is dropped and rebuilt from the other three, which are
+		/// stored as 15-bit values; the index of the dropped component takes the top bit
+		/// of the first two values.
+		struct QuantizedRotation
+		{
+			uint16_t Components[3];
+		};
+
+		static QuantizedRotation quantize(const float *Rotation);
+		static void dequantize(const QuantizedRotation &Quantized, float *Rotation);
+
+		/// \brief Marks bones whose translation is not baked
+		static const uint32_t NoTranslation = 0xFFFFFFFFU;
+
+		/// \brief The amount of samples per second
+		float SampleRate;
+		/// \brief The amount of samples
+		uint32_t SampleCount;
+		/// \brief The last frame of the motion, in 30 Hz frames
+		float MaxFrame;
+
+		/// \brief The names of the baked bones
+		std::vector<std::wstring> BoneNames;
+		/// \brief The translation slot of each baked bone, or NoTranslation
+		std::vector<uint32_t> TranslationSlots;
+		/// \brief The amount of bones with baked translations
+		uint32_t TranslationCount;
+		/// \brief The names of the baked morphs
+		std::vector<std::wstring> MorphNames;
+
+		/// \brief The rotation of every baked bone, BoneNames.size() per sample
+		std::vector<QuantizedRotation> Rotations;
+		/// \brief The translation of every moving bone, TranslationCount * 3 per sample
+		std::vector<float> Translations;
+		/// \brief The weight of every baked morph, in 1 / 65535 units, MorphNames.size() per sample
+		std::vector<uint16_t> MorphWeights;
+
+		/// \brief The current frame, in 30 Hz frames
+		double CurrentFrame;
+		bool Finished;
+
+		/// \brief An attached model with the baked bones and morphs resolved against it
+		struct ModelBinding
+		{
+			std::shared_ptr<PMX::Model> Model;
+			std::vector<PMX::BoneHandle> Bones;
+			std::vector<PMX::MorphHandle> Morphs;
+		};
+
+		std::vector<ModelBinding> AttachedModels;
+
+		/// \brief Resolves the baked names against a model
+		void bindModel(ModelBinding &Binding);
+	};
+
+}
@@ -0,0 +1,172 @@
+//===-- VMD/CurveTable.cpp - Defines the VMD interpolation curve table --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-----------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the VMD::CurveTable class, which stores every distinct
+/// interpolation curve of a motion once
+///
+//===-----------------------------------------------------------------------------===//
+
+#include "CurveTable.h"
+
+using namespace DirectX;
+using namespace VMD;
+
+CurveTable::CurveTable()
+{
+	clear();
+}
+
+bool CurveTable::getCurve(int8_t X1, int8_t Y1, int8_t X2, int8_t Y2, uint16_t &Curve)
+{
+	if (X1 == Y1 && X2 == Y2) {
+		Curve = Linear;
+		return true;
+	}
+
+	uint32_t Key = (uint32_t)(uint8_t)X1 | ((uint32_t)(uint8_t)Y1 << 8) | ((uint32_t)(uint8_t)X2 << 16) | ((uint32_t)(uint8_t)Y2 << 24);
+	auto Found = Ids.find(Key);
+	if (Found != Ids.end()) {
+		Curve = Found->second;
+		return true;
+	}
+
+	if (Ids.size() >= UINT16_MAX)
+		return false;
+
+	Curve = (uint16_t)Points.size();
+	Ids.emplace(Key, Curve);
+
+	ControlPoints Control = { X1 / 127.0f, X2 / 127.0f, Y1 / 127.0f, Y2 / 127.0f };
+	Points.push_back(Control);
+	Sampled.push_back(0);
+	return true;
+}
+
+void CurveTable::getControlPoints(uint16_t Curve, int8_t &X1, int8_t &Y1, int8_t &X2, int8_t &Y2) const
+{
+	if (Curve == Linear) {
+		X1 = Y1 = 20;
+		X2 = Y2 = 107;
+		return;
+	}
+
+	const ControlPoints &Control = Points[Curve];
+	X1 = (int8_t)(Control.X1 * 127.0f + 0.5f);
+	Y1 = (int8_t)(Control.Y1 * 127.0f + 0.5f);
+	X2 = (int8_t)(Control.X2 * 127.0f + 0.5f);
+	Y2 = (int8_t)(Control.Y2 * 127.0f + 0.5f);
+}
+
+float CurveTable::evaluate(uint16_t Curve, float Ratio)
+{
+	if (Curve == Linear)
+		return Ratio;
+
+	if (!Sampled[Curve])
+		generateInterpolationTable(Curve);
+
+	const float *Table = &Tables[(Curve - 1) * (InterpolationTableSize + 1)];
+	uint32_t InterpolationIndex = (uint32_t)(Ratio * InterpolationTableSize);
+	if (InterpolationIndex >= InterpolationTableSize)
+		return Table[InterpolationTableSize];
+
+	return Table[InterpolationIndex] + (Table[InterpolationIndex + 1] - Table[InterpolationIndex]) * (Ratio * InterpolationTableSize - InterpolationIndex);
+}
+
+XMVECTOR XM_CALLCONV CurveTable::evaluate(const uint16_t *Curves, float Ratio) const
+{
+	const ControlPoints &C0 = Points[Curves[0]], &C1 = Points[Curves[1]], &C2 = Points[Curves[2]], &C3 = Points[Curves[3]];
+
+	XMVECTOR X = XMVectorReplicate(Ratio);
+	XMVECTOR Result = solve(X,
+		XMVectorSet(C0.X1, C1.X1, C2.X1, C3.X1),
+		XMVectorSet(C0.X2, C1.X2, C2.X2, C3.X2),
+		XMVectorSet(C0.Y1, C1.Y1, C2.Y1, C3.Y1),
+		XMVectorSet(C0.Y2, C1.Y2, C2.Y2, C3.Y2));
+
+	// Linear curves are exact without solving anything
+	XMVECTOR IsLinear = XMVectorEqualInt(XMVectorSetInt(Curves[0], Curves[1], Curves[2], Curves[3]), XMVectorZero());
+	return XMVectorSelect(Result, X, IsLinear);
+}
+
+void CurveTable::clear()
+{
+	Ids.clear();
+	Tables.clear();
+	Points.clear();
+	Sampled.clear();
+
+	// The linear curve keeps id 0, its control points lie on the diagonal
+	ControlPoints Diagonal = { 0.0f, 1.0f, 0.0f, 1.0f };
+	Points.push_back(Diagonal);
+	Sampled.push_back(1);
+}
+
+XMVECTOR XM_CALLCONV CurveTable::solve(FXMVECTOR X, FXMVECTOR X1, FXMVECTOR X2, GXMVECTOR Y1, HXMVECTOR Y2)
+{
+	static const XMVECTORF32 Three = { 3.0f, 3.0f, 3.0f, 3.0f };
+	static const XMVECTORF32 Six = { 6.0f, 6.0f, 6.0f, 6.0f };
+
+	// B(T) = ((A * T + B) * T + C) * T, with A = 1 + 3 * P1 - 3 * P2, B = 3 * P2 - 6 * P1 and C = 3 * P1
+	auto coefficients = [](FXMVECTOR P1, FXMVECTOR P2, XMVECTOR &A, XMVECTOR &B, XMVECTOR &C) {
+		C = XMVectorMultiply(P1, Three);
+		B = XMVectorNegativeMultiplySubtract(P1, Six, XMVectorMultiply(P2, Three));
+		A = XMVectorSubtract(XMVectorAdd(g_XMOne, C), XMVectorMultiply(P2, Three));
+	};
+	auto bezier = [](FXMVECTOR T, FXMVECTOR A, FXMVECTOR B, GXMVECTOR C) {
+		return XMVectorMultiply(XMVectorMultiplyAdd(XMVectorMultiplyAdd(A, T, B), T, C), T);
+	};
+
+	XMVECTOR AX, BX, CX;
+	coefficients(X1, X2, AX, BX, CX);
+
+	XMVECTOR Low = XMVectorZero();
+	XMVECTOR High = g_XMOne;
+	for (int Step = 0; Step < SolverSteps; ++Step) {
+		XMVECTOR Middle = XMVectorMultiply(XMVectorAdd(Low, High), g_XMOneHalf);
+		XMVECTOR Below = XMVectorLess(bezier(Middle, AX, BX, CX), X);
+		Low = XMVectorSelect(Low, Middle, Below);
+		High = XMVectorSelect(Middle, High, Below);
+	}
+
+	// Refine inside the bracket with a secant step, keeping the middle where it is flat
+	XMVECTOR XLow = bezier(Low, AX, BX, CX);
+	XMVECTOR Span = XMVectorSubtract(bezier(High, AX, BX, CX), XLow);
+	XMVECTOR Flat = XMVectorLessOrEqual(XMVectorAbs(Span), g_XMEpsilon);
+	XMVECTOR Fraction = XMVectorDivide(XMVectorSubtract(X, XLow), XMVectorSelect(Span, g_XMOne, Flat));
+	Fraction = XMVectorSelect(XMVectorSaturate(Fraction), g_XMOneHalf, Flat);
+	XMVECTOR T = XMVectorMultiplyAdd(XMVectorSubtract(High, Low), Fraction, Low);
+
+	XMVECTOR AY, BY, CY;
+	coefficients(Y1, Y2, AY, BY, CY);
+	return bezier(T, AY, BY, CY);
+}
+
+void CurveTable::generateInterpolationTable(uint16_t Curve)
+{
+	// Curves are added after some tables were sampled, so grow the storage to cover them all
+	size_t Required = (Points.size() - 1) * (InterpolationTableSize + 1);
+	if (Tables.size() < Required)
+		Tables.resize(Required);
+
+	const ControlPoints &Control = Points[Curve];
+	XMVECTOR X1 = XMVectorReplicate(Control.X1), X2 = XMVectorReplicate(Control.X2);
+	XMVECTOR Y1 = XMVectorReplicate(Control.Y1), Y2 = XMVectorReplicate(Control.Y2);
+	float *Table = &Tables[(Curve - 1) * (InterpolationTableSize + 1)];
+
+	// Four entries of the table are solved at once
+	for (int k = 0; k < InterpolationTableSize; k += 4) {
+		XMVECTOR X = XMVectorScale(XMVectorSet((float)k, (float)(k + 1), (float)(k + 2), (float)(k + 3)), 1.0f / (float)InterpolationTableSize);
+		XMStoreFloat4((XMFLOAT4*)&Table[k], solve(X, X1, X2, Y1, Y2));
+	}
+
+	Table[InterpolationTableSize] = 1.0f;
+	Sampled[Curve] = 1;
+}
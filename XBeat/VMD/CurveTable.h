@@ -0,0 +1,114 @@
+//===-- VMD/CurveTable.h - Declares the VMD interpolation curve table --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the VMD::CurveTable class, which stores every distinct
+/// interpolation curve of a motion once
+///
+//===----------------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <DirectXMath.h>
+
+namespace VMD {
+
+	/// \brief Stores the Bezier interpolation curves of a motion
+	///
+	/// A VMD curve is defined by its two control points, 4 bytes in the [0; 127] range.
+	/// Real motions only use a handful of distinct curves, so key frames refer to them by
+	/// a small id. A curve can be solved directly, four channels at a time, or sampled
+	/// into a lookup table, which is only built the first time the curve is evaluated.
+	class CurveTable
+	{
+	public:
+		/// \brief The id of the linear curve, which has no table
+		static const uint16_t Linear = 0;
+
+		CurveTable();
+
+		/// \brief Returns the id of a curve, adding it to the table if needed
+		///
+		/// \param [in] X1 The abscissa of the first control point
+		/// \param [in] Y1 The ordinate of the first control point
+		/// \param [in] X2 The abscissa of the second control point
+		/// \param [in] Y2 The ordinate of the second control point
+		/// \param [out] Curve The id of the curve, Linear if both control points lie on the diagonal
+		/// \returns false if the table is full
+		bool getCurve(int8_t X1, int8_t Y1, int8_t X2, int8_t Y2, uint16_t &Curve);
+
+		/// \brief Returns the control points of a curve, as stored in VMD files
+		///
+		/// \remarks The linear curve is returned with the control points MMD writes for it
+		void getControlPoints(uint16_t Curve, int8_t &X1, int8_t &Y1, int8_t &X2, int8_t &Y2) const;
+
+		/// \brief Evaluates a curve through its lookup table, sampling it if needed
+		///
+		/// \param [in] Curve The id of the curve
+		/// \param [in] Ratio The elapsed fraction of the interpolation, in [0.0; 1.0] range
+		/// \returns The interpolation weight at that point
+		float evaluate(uint16_t Curve, float Ratio);
+
+		/// \brief Solves four curves at once, without lookup tables
+		///
+		/// \param [in] Curves The ids of the four curves
+		/// \param [in] Ratio The elapsed fraction of the interpolation, in [0.0; 1.0] range
+		/// \returns The interpolation weight of each curve, one per component
+		DirectX::XMVECTOR XM_CALLCONV evaluate(const uint16_t *Curves, float Ratio) const;
+
+		/// \brief Removes every curve from the table
+		void clear();
+
+		/// \brief Returns the amount of distinct curves, not counting the linear one
+		size_t size() const { return Ids.size(); }
+
+		/// \brief Solves four cubic Bezier curves starting at (0, 0) and ending at (1, 1)
+		///
+		/// For each component, finds the parameter T for which the abscissa of the curve is X
+		/// and returns the ordinate at T. The abscissa is monotonic when the control points lie in
+		/// the unit square, so the parameter is bracketed by a fixed number of bisection steps
+		/// followed by a secant step; degenerate control points cannot make it loop.
+		///
+		/// \param [in] X The abscissas to be solved
+		/// \param [in] X1 The abscissas of the first control points
+		/// \param [in] X2 The abscissas of the second control points
+		/// \param [in] Y1 The ordinates of the first control points
+		/// \param [in] Y2 The ordinates of the second control points
+		static DirectX::XMVECTOR XM_CALLCONV solve(DirectX::FXMVECTOR X, DirectX::FXMVECTOR X1, DirectX::FXMVECTOR X2, DirectX::GXMVECTOR Y1, DirectX::HXMVECTOR Y2);
+
+	private:
+		enum {
+			InterpolationTableSize = 64,
+			SolverSteps = 16
+		};
+
+		/// \brief The control points of a curve
+		struct ControlPoints {
+			float X1, X2, Y1, Y2;
+		};
+
+		/// \brief Maps the 4 control bytes of a curve to its id
+		std::unordered_map<uint32_t, uint16_t> Ids;
+		/// \brief The control points of each curve, indexed by id, the linear curve included
+		std::vector<ControlPoints> Points;
+		/// \brief The sampled curves, InterpolationTableSize + 1 values each, in id order
+		std::vector<float> Tables;
+		/// \brief Whether the table of each curve was sampled, indexed by id
+		std::vector<uint8_t> Sampled;
+
+		/// \brief Samples the table of a curve
+		void generateInterpolationTable(uint16_t Curve);
+	};
+
+}
@@ -0,0 +1,430 @@
+//===-- VMD/KeyFrameReducer.cpp - Defines the VMD key frame reducer --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the VMD::KeyFrameReducer class, which removes the key
+/// frames of a motion that its interpolation curves can rebuild
+///
+//===-------------------------------------------------------------------------===//
+
+#include "KeyFrameReducer.h"
+
+#include "Motion.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cwchar>
+
+using namespace DirectX;
+using namespace VMD;
+
+namespace {
+	/// \brief The abscissas of the fitted control points, 1/3 and 2/3 so that time maps linearly to the curve parameter
+	const int8_t FittedX1 = 42, FittedX2 = 85;
+	/// \brief The control points MMD uses for linear curves
+	const int8_t LinearX1 = 20, LinearX2 = 107;
+	/// \brief The longest track sampled, over nine hours at 30 frames per second; longer
+	/// spans come from corrupt frame numbers and their tracks are left as they are
+	const uint32_t MaxSampledFrames = 1 << 20;
+
+	/// \brief Returns the angle between two rotations
+	float getAngle(const float *A, const float *B)
+	{
+		float Dot = fabsf(A[0] * B[0] + A[1] * B[1] + A[2] * B[2] + A[3] * B[3]);
+		return 2.0f * acosf(std::min(Dot, 1.0f));
+	}
+
+	/// \brief Accumulates the samples of a curve and fits the ordinates of its control points
+	///
+	/// With the abscissas of the control points at 1/3 and 2/3, the curve parameter is the
+	/// elapsed time itself, so the ordinates are the solution of a linear least squares problem:
+	/// Y(T) = 3 (1 - T)^2 T Y1 + 3 (1 - T) T^2 Y2 + T^3
+	struct CurveFit
+	{
+		double S11, S12, S22, R1, R2;
+
+		CurveFit() : S11(0), S12(0), S22(0), R1(0), R2(0) {}
+
+		void add(double T, double Progress) {
+			double B1 = 3.0 * (1.0 - T) * (1.0 - T) * T, B2 = 3.0 * (1.0 - T) * T * T;
+			double Residual = Progress - T * T * T;
+			S11 += B1 * B1;
+			S12 += B1 * B2;
+			S22 += B2 * B2;
+			R1 += B1 * Residual;
+			R2 += B2 * Residual;
+		}
+
+		/// \brief Writes the fitted control points as X1, Y1, X2 and Y2
+		void solve(int8_t *Control) const {
+			double Y1, Y2;
+			double Determinant = S11 * S22 - S12 * S12;
+			if (fabs(Determinant) > 1e-12) {
+				Y1 = (R1 * S22 - R2 * S12) / Determinant;
+				Y2 = (R2 * S11 - R1 * S12) / Determinant;
+			}
+			else {
+				// A single sample does not define both points, keep them at the same height
+				double Sum = S11 + 2.0 * S12 + S22;
+				Y1 = Y2 = Sum > 0.0 ? (R1 + R2) / Sum : 0.5;
+			}
+
+			Control[0] = FittedX1;
+			Control[1] = (int8_t)(std::min(std::max(Y1, 0.0), 1.0) * 127.0 + 0.5);
+			Control[2] = FittedX2;
+			Control[3] = (int8_t)(std::min(std::max(Y2, 0.0), 1.0) * 127.0 + 0.5);
+		}
+	};
+
+	void setLinear(int8_t *Control)
+	{
+		Control[0] = Control[1] = LinearX1;
+		Control[2] = Control[3] = LinearX2;
+	}
+}
+
+KeyFrameReducer::KeyFrameReducer()
+{
+	Limits.Position = 0.005f;
+	Limits.Angle = 0.005f;
+	Limits.Weight = 0.005f;
+}
+
+KeyFrameReducer::KeyFrameReducer(const Tolerances &Limits)
+	: Limits(Limits)
+{
+}
+
+void KeyFrameReducer::reduce(Motion &Target)
+{
+	Report.clear();
+	Report.reserve(Target.BoneTracks.size() + Target.MorphTracks.size());
+
+	for (auto &Track : Target.BoneTracks) {
+		TrackReport Result;
+		Result.Name = Track.BoneName;
+		Result.IsMorph = false;
+		reduceBoneTrack(Target, Track, Result);
+		Report.push_back(Result);
+	}
+
+	for (auto &Track : Target.MorphTracks) {
+		TrackReport Result;
+		Result.Name = Track.MorphName;
+		Result.IsMorph = true;
+		reduceMorphTrack(Track, Result);
+		Report.push_back(Result);
+	}
+
+	BoneSamples.clear();
+	BoneSamples.shrink_to_fit();
+	MorphSamples.clear();
+	MorphSamples.shrink_to_fit();
+
+	Target.reset();
+}
+
+namespace {
+	/// \brief Returns whether a key frame can be removed, key frames sharing a frame with a neighbour mark a cut
+	template <class KeyFrame>
+	bool isRemovable(const std::vector<KeyFrame> &KeyFrames, size_t Index)
+	{
+		return Index > 0 && Index + 1 < KeyFrames.size() &&
+			KeyFrames[Index].FrameCount != KeyFrames[Index - 1].FrameCount &&
+			KeyFrames[Index].FrameCount != KeyFrames[Index + 1].FrameCount;
+	}
+
+	/// \brief Finds the furthest key frame a segment starting at Anchor can reach
+	///
+	/// The reach grows exponentially until a segment fails, then the boundary is found by
+	/// bisection, so long static or smooth stretches take a logarithmic amount of fits.
+	///
+	/// \param [in] Anchor The key frame the segment starts at
+	/// \param [in] Last The furthest key frame allowed
+	/// \param [in] Fits Returns whether the segment ending at a key frame stays within the tolerances
+	/// \returns The furthest key frame found, Anchor + 1 if no segment fits
+	template <class Predicate>
+	size_t findFurthest(size_t Anchor, size_t Last, Predicate Fits)
+	{
+		size_t Good = Anchor + 1, Bad = Last + 1;
+		for (size_t Step = 1; Good < Last; Step *= 2) {
+			size_t End = std::min(Good + Step, Last);
+			if (!Fits(End)) {
+				Bad = End;
+				break;
+			}
+			Good = End;
+		}
+
+		while (Bad - Good > 1) {
+			size_t Middle = Good + (Bad - Good) / 2;
+			if (Fits(Middle))
+				Good = Middle;
+			else
+				Bad = Middle;
+		}
+
+		return Good;
+	}
+}
+
+void KeyFrameReducer::reduceBoneTrack(Motion &Target, BoneTrack &Track, TrackReport &Result)
+{
+	auto &KeyFrames = Track.KeyFrames;
+	Result.OriginalKeyFrames = Result.ReducedKeyFrames = (uint32_t)KeyFrames.size();
+	Result.MaxError = Result.MaxAngleError = 0.0f;
+
+	if (KeyFrames.size() <= 2)
+		return;
+
+	// Sample the original motion on every frame covered by the track
+	uint32_t First = KeyFrames.front().FrameCount, Last = KeyFrames.back().FrameCount;
+	if (Last - First >= MaxSampledFrames)
+		return;
+
+	SampleOrigin = First;
+	BoneSamples.resize(Last - First + 1);
+	for (uint32_t Frame = First, Next = 0; Frame <= Last; ++Frame) {
+		while (KeyFrames[Next].FrameCount < Frame)
+			++Next;
+
+		BoneSample &Sample = BoneSamples[Frame - First];
+		const BoneKeyFrame &Frame2 = KeyFrames[Next];
+		if (Next == 0 || Frame2.FrameCount == Frame) {
+			std::copy(Frame2.Translation, Frame2.Translation + 3, Sample.Translation);
+			std::copy(Frame2.Rotation, Frame2.Rotation + 4, Sample.Rotation);
+			continue;
+		}
+
+		const BoneKeyFrame &Frame1 = KeyFrames[Next - 1];
+		float Ratio = (float)(Frame - Frame1.FrameCount) / (float)(Frame2.FrameCount - Frame1.FrameCount);
+
+		XMFLOAT4 Weights;
+		XMStoreFloat4(&Weights, Target.Curves.evaluate(Frame2.Curves, Ratio));
+		for (int i = 0; i < 3; ++i)
+			Sample.Translation[i] = Frame1.Translation[i] + (Frame2.Translation[i] - Frame1.Translation[i]) * (&Weights.x)[i];
+
+		btQuaternion Rotation = Frame1.getRotation().slerp(Frame2.getRotation(), Weights.w);
+		Sample.Rotation[0] = Rotation.getX();
+		Sample.Rotation[1] = Rotation.getY();
+		Sample.Rotation[2] = Rotation.getZ();
+		Sample.Rotation[3] = Rotation.getW();
+	}
+
+	std::vector<BoneKeyFrame> Reduced;
+	Reduced.push_back(KeyFrames.front());
+
+	for (size_t Anchor = 0; Anchor + 1 < KeyFrames.size();) {
+		size_t Limit = Anchor + 1;
+		while (isRemovable(KeyFrames, Limit))
+			++Limit;
+
+		int8_t Control[4][4], BestControl[4][4];
+		float PositionError, AngleError, BestPositionError = 0.0f, BestAngleError = 0.0f;
+		size_t End = findFurthest(Anchor, Limit, [&](size_t End) {
+			if (!fitBoneSegment(Reduced.back(), KeyFrames[End], Control, PositionError, AngleError))
+				return false;
+
+			std::copy(&Control[0][0], &Control[0][0] + 16, &BestControl[0][0]);
+			BestPositionError = PositionError;
+			BestAngleError = AngleError;
+			return true;
+		});
+
+		BoneKeyFrame Frame = KeyFrames[End];
+		if (End > Anchor + 1) {
+			uint16_t Curves[4];
+			bool Added = true;
+			for (int i = 0; i < 4 && Added; ++i)
+				Added = Target.Curves.getCurve(BestControl[i][0], BestControl[i][1], BestControl[i][2], BestControl[i][3], Curves[i]);
+
+			if (Added) {
+				std::copy(Curves, Curves + 4, Frame.Curves);
+				Result.MaxError = std::max(Result.MaxError, BestPositionError);
+				Result.MaxAngleError = std::max(Result.MaxAngleError, BestAngleError);
+			}
+			else {
+				// The curve table is full, keep the original key frames
+				End = Anchor + 1;
+				Frame = KeyFrames[End];
+			}
+		}
+
+		Reduced.push_back(Frame);
+		Anchor = End;
+	}
+
+	KeyFrames.swap(Reduced);
+	KeyFrames.shrink_to_fit();
+	Result.ReducedKeyFrames = (uint32_t)KeyFrames.size();
+}
+
+bool KeyFrameReducer::fitBoneSegment(const BoneKeyFrame &From, const BoneKeyFrame &To, int8_t (&Control)[4][4], float &PositionError, float &AngleError) const
+{
+	const BoneSample *Samples = &BoneSamples[From.FrameCount - SampleOrigin];
+	float Duration = (float)(To.FrameCount - From.FrameCount);
+
+	// Express every sample as the progress of each channel from one key frame to the other
+	CurveFit Fits[4];
+	float Angle = getAngle(From.Rotation, To.Rotation);
+	for (uint32_t Offset = 1; Offset < To.FrameCount - From.FrameCount; ++Offset) {
+		const BoneSample &Sample = Samples[Offset];
+		double T = (double)Offset / Duration;
+
+		for (int i = 0; i < 3; ++i) {
+			float Distance = To.Translation[i] - From.Translation[i];
+			if (fabsf(Distance) > 1e-6f)
+				Fits[i].add(T, (Sample.Translation[i] - From.Translation[i]) / Distance);
+		}
+
+		if (Angle > 1e-4f)
+			Fits[3].add(T, getAngle(From.Rotation, Sample.Rotation) / Angle);
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		if (fabsf(To.Translation[i] - From.Translation[i]) > 1e-6f)
+			Fits[i].solve(Control[i]);
+		else
+			setLinear(Control[i]);
+	}
+	if (Angle > 1e-4f)
+		Fits[3].solve(Control[3]);
+	else
+		setLinear(Control[3]);
+
+	// Measure the error of the quantized curves, as they will be played
+	XMVECTOR X1 = XMVectorScale(XMVectorSet(Control[0][0], Control[1][0], Control[2][0], Control[3][0]), 1.0f / 127.0f);
+	XMVECTOR Y1 = XMVectorScale(XMVectorSet(Control[0][1], Control[1][1], Control[2][1], Control[3][1]), 1.0f / 127.0f);
+	XMVECTOR X2 = XMVectorScale(XMVectorSet(Control[0][2], Control[1][2], Control[2][2], Control[3][2]), 1.0f / 127.0f);
+	XMVECTOR Y2 = XMVectorScale(XMVectorSet(Control[0][3], Control[1][3], Control[2][3], Control[3][3]), 1.0f / 127.0f);
+	btQuaternion Rotation1 = From.getRotation(), Rotation2 = To.getRotation();
+
+	PositionError = AngleError = 0.0f;
+	for (uint32_t Offset = 1; Offset < To.FrameCount - From.FrameCount; ++Offset) {
+		const BoneSample &Sample = Samples[Offset];
+
+		XMFLOAT4 Weights;
+		XMStoreFloat4(&Weights, CurveTable::solve(XMVectorReplicate((float)Offset / Duration), X1, X2, Y1, Y2));
+
+		float Squared = 0.0f;
+		for (int i = 0; i < 3; ++i) {
+			float Difference = From.Translation[i] + (To.Translation[i] - From.Translation[i]) * (&Weights.x)[i] - Sample.Translation[i];
+			Squared += Difference * Difference;
+		}
+		PositionError = std::max(PositionError, sqrtf(Squared));
+
+		btQuaternion Rotation = Rotation1.slerp(Rotation2, Weights.w);
+		float Played[4] = { Rotation.getX(), Rotation.getY(), Rotation.getZ(), Rotation.getW() };
+		AngleError = std::max(AngleError, getAngle(Played, Sample.Rotation));
+
+		if (PositionError > Limits.Position || AngleError > Limits.Angle)
+			return false;
+	}
+
+	return true;
+}
+
+void KeyFrameReducer::reduceMorphTrack(MorphTrack &Track, TrackReport &Result)
+{
+	auto &KeyFrames = Track.KeyFrames;
+	Result.OriginalKeyFrames = Result.ReducedKeyFrames = (uint32_t)KeyFrames.size();
+	Result.MaxError = Result.MaxAngleError = 0.0f;
+
+	if (KeyFrames.size() <= 2)
+		return;
+
+	// Morphs are interpolated linearly, so they are compared against the original key frames only
+	uint32_t First = KeyFrames.front().FrameCount, Last = KeyFrames.back().FrameCount;
+	if (Last - First >= MaxSampledFrames)
+		return;
+
+	MorphSamples.resize(Last - First + 1);
+	for (uint32_t Frame = First, Next = 0; Frame <= Last; ++Frame) {
+		while (KeyFrames[Next].FrameCount < Frame)
+			++Next;
+
+		const MorphKeyFrame &Frame2 = KeyFrames[Next];
+		if (Next == 0 || Frame2.FrameCount == Frame) {
+			MorphSamples[Frame - First] = Frame2.Weight;
+			continue;
+		}
+
+		const MorphKeyFrame &Frame1 = KeyFrames[Next - 1];
+		float Ratio = (float)(Frame - Frame1.FrameCount) / (float)(Frame2.FrameCount - Frame1.FrameCount);
+		MorphSamples[Frame - First] = Frame1.Weight + (Frame2.Weight - Frame1.Weight) * Ratio;
+	}
+
+	std::vector<MorphKeyFrame> Reduced;
+	Reduced.push_back(KeyFrames.front());
+
+	for (size_t Anchor = 0; Anchor + 1 < KeyFrames.size();) {
+		size_t Limit = Anchor + 1;
+		while (isRemovable(KeyFrames, Limit))
+			++Limit;
+
+		float BestError = 0.0f;
+		size_t End = findFurthest(Anchor, Limit, [&](size_t End) {
+			const MorphKeyFrame &Frame1 = KeyFrames[Anchor], &Frame2 = KeyFrames[End];
+			float Duration = (float)(Frame2.FrameCount - Frame1.FrameCount);
+			float Error = 0.0f;
+
+			for (uint32_t Frame = Frame1.FrameCount + 1; Frame < Frame2.FrameCount; ++Frame) {
+				float Ratio = (float)(Frame - Frame1.FrameCount) / Duration;
+				Error = std::max(Error, fabsf(Frame1.Weight + (Frame2.Weight - Frame1.Weight) * Ratio - MorphSamples[Frame - First]));
+				if (Error > Limits.Weight)
+					return false;
+			}
+
+			BestError = Error;
+			return true;
+		});
+
+		if (End > Anchor + 1)
+			Result.MaxError = std::max(Result.MaxError, BestError);
+
+		Reduced.push_back(KeyFrames[End]);
+		Anchor = End;
+	}
+
+	KeyFrames.swap(Reduced);
+	KeyFrames.shrink_to_fit();
+	Result.ReducedKeyFrames = (uint32_t)KeyFrames.size();
+}
+
+std::wstring KeyFrameReducer::formatReport() const
+{
+	std::wstring Text;
+	uint64_t Original = 0, Reduced = 0;
+	wchar_t Line[256];
+
+	for (auto &Track : Report) {
+		Original += Track.OriginalKeyFrames;
+		Reduced += Track.ReducedKeyFrames;
+
+		if (Track.IsMorph)
+			swprintf(Line, 256, L"%ls (morph): %u -> %u key frames (%.1f%%), max weight error %.4f\n", Track.Name.c_str(), Track.OriginalKeyFrames, Track.ReducedKeyFrames, Track.getRatio() * 100.0f, Track.MaxError);
+		else
+			swprintf(Line, 256, L"%ls: %u -> %u key frames (%.1f%%), max position error %.4f, max angle error %.3f deg\n", Track.Name.c_str(), Track.OriginalKeyFrames, Track.ReducedKeyFrames, Track.getRatio() * 100.0f, Track.MaxError, XMConvertToDegrees(Track.MaxAngleError));
+		Text += Line;
+	}
+
+	swprintf(Line, 256, L"Total: %llu -> %llu key frames (%.1f%%)\n", (unsigned long long)Original, (unsigned long long)Reduced, Original > 0 ? (double)Reduced * 100.0 / (double)Original : 100.0);
+	Text += Line;
+	return Text;
+}
+
+bool KeyFrameReducer::reduceFile(const std::wstring &InputFile, const std::wstring &OutputFile)
+{
+	Motion Source;
+	if (!Source.loadFromFile(InputFile))
+		return false;
+
+	reduce(Source);
+	return Source.saveToFile(OutputFile);
+}
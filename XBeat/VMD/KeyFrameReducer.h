@@ -0,0 +1,129 @@
+//===-- VMD/KeyFrameReducer.h - Declares the VMD key frame reducer --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the VMD::KeyFrameReducer class, which removes the key
+/// frames of a motion that its interpolation curves can rebuild
+///
+//===------------------------------------------------------------------------===//
+
+#pragma once
+
+#include "VMDDefinitions.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace VMD {
+
+	class Motion;
+
+	/// \brief Removes redundant key frames from the bone and morph tracks of a motion
+	///
+	/// Motion captured files often have a key frame on every frame of every bone. Starting
+	/// from a kept key frame, the reducer looks for the furthest key frame that can be
+	/// reached with a single interpolation: the VMD Bezier curves of that key frame are
+	/// fitted to the original motion, and the segment is accepted if every frame in
+	/// between stays within the tolerances. The key frames inside the segment are dropped.
+	///
+	/// A reducer can run on a motion just loaded, before it is attached to anything, or
+	/// write the reduced motion back to a file with reduceFile().
+	///
+	/// \remarks Camera key frames are left as they are, since cameras usually cut on
+	/// consecutive frames and are small anyway.
+	class KeyFrameReducer
+	{
+	public:
+		/// \brief The largest differences allowed between the original and the reduced motion
+		struct Tolerances
+		{
+			/// \brief The largest bone translation error, in model units
+			float Position;
+			/// \brief The largest bone rotation error, in radians
+			float Angle;
+			/// \brief The largest morph weight error
+			float Weight;
+		};
+
+		/// \brief The outcome of reducing a single track
+		struct TrackReport
+		{
+			/// \brief The name of the bone or morph of the track
+			std::wstring Name;
+			/// \brief Whether this is a morph track or a bone track
+			bool IsMorph;
+			/// \brief The amount of key frames before the reduction
+			uint32_t OriginalKeyFrames;
+			/// \brief The amount of key frames after the reduction
+			uint32_t ReducedKeyFrames;
+			/// \brief The largest translation error of a bone, or the largest weight error of a morph
+			float MaxError;
+			/// \brief The largest rotation error of a bone, in radians
+			float MaxAngleError;
+
+			/// \brief Returns the fraction of the key frames that were kept
+			float getRatio() const { return OriginalKeyFrames > 0 ? (float)ReducedKeyFrames / (float)OriginalKeyFrames : 1.0f; }
+		};
+
+		/// \brief Creates a reducer whose errors are below what can be seen on screen
+		KeyFrameReducer();
+		explicit KeyFrameReducer(const Tolerances &Limits);
+
+		/// \brief Reduces every bone and morph track of a motion
+		///
+		/// \param [in,out] Target The motion to be reduced, it is rewound afterwards
+		void reduce(Motion &Target);
+
+		/// \brief Returns the outcome of each track of the last reduced motion
+		const std::vector<TrackReport>& getReport() const { return Report; }
+
+		/// \brief Formats the report of the last reduced motion, one line per track and a total
+		std::wstring formatReport() const;
+
+		/// \brief Loads a motion file, reduces it and writes the result to another file
+		///
+		/// \param [in] InputFile The path of the motion to be reduced
+		/// \param [in] OutputFile The path of the reduced motion, it may be the same as InputFile
+		/// \returns Whether the motion was loaded and the reduced one written
+		bool reduceFile(const std::wstring &InputFile, const std::wstring &OutputFile);
+
+	private:
+		Tolerances Limits;
+		std::vector<TrackReport> Report;
+
+		/// \brief The pose of a bone at a single frame
+		struct BoneSample
+		{
+			float Translation[3];
+			float Rotation[4];
+		};
+
+		/// \brief The original poses of the track being reduced, one per frame from its first key frame
+		std::vector<BoneSample> BoneSamples;
+		/// \brief The original weights of the track being reduced, one per frame from its first key frame
+		std::vector<float> MorphSamples;
+		/// \brief The frame of the first sample
+		uint32_t SampleOrigin;
+
+		void reduceBoneTrack(Motion &Target, BoneTrack &Track, TrackReport &Result);
+		void reduceMorphTrack(MorphTrack &Track, TrackReport &Result);
+
+		/// \brief Fits the curves of a key frame replacing every key frame since another one
+		///
+		/// \param [in] From The key frame the segment starts at
+		/// \param [in] To The key frame the segment ends at
+		/// \param [out] Control The control points X1, Y1, X2 and Y2 of the X, Y, Z and rotation curves of To
+		/// \param [out] PositionError The largest translation error along the segment
+		/// \param [out] AngleError The largest rotation error along the segment
+		/// \returns Whether the segment stays within the tolerances
+		bool fitBoneSegment(const BoneKeyFrame &From, const BoneKeyFrame &To, int8_t (&Control)[4][4], float &PositionError, float &AngleError) const;
+	};
+
+}
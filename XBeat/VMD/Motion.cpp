@@ -14,45 +14,80 @@
 
 #include "Motion.h"
 
-#include <Windows.h>
-
-VMD::Motion::Motion()
-{
-	reset();
-	MaxFrame = 0.0f;
-}
-
+#include "../PMX/PMXModel.h"
+#include "../Renderer/Camera.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+	/// \brief The amount of key frames walked forward before falling back to a binary search
+	const size_t MaxCursorSteps = 4;
+
+	/// \brief Finds the first key frame at or after the specified frame
+	///
+	/// \param [in] KeyFrames The key frames of a track, sorted by frame
+	/// \param [in] Frame The frame being evaluated, not past the last key frame
+	/// \param [in,out] Cursor The key frame found by the previous call for this track
+	/// \returns The index of the key frame, also stored in Cursor
+	/// \remarks During forward playback the answer is at most a few key frames after the
+	/// previous one, so it is found in constant time; seeking and rewinding use a binary search.
+	template <class KeyFrame>
+	size_t findNextKeyFrame(const std::vector<KeyFrame> &KeyFrames, float Frame, uint32_t &Cursor)
+	{
+		auto Before = [](const KeyFrame &Key, float Frame) { return (float)Key.FrameCount < Frame; };
+		size_t Last = KeyFrames.size() - 1;
+		size_t Next = std::min<size_t>(Cursor, Last);
+
+		if (Next > 0 && Frame <= (float)KeyFrames[Next - 1].FrameCount) {
+			// Going backwards, search before the cursor
+			Next = std::lower_bound(KeyFrames.begin(), KeyFrames.begin() + Next, Frame, Before) - KeyFrames.begin();
+		}
+		else {
+			for (size_t Steps = 0; Next < Last && (float)KeyFrames[Next].FrameCount < Frame; ++Steps) {
+				if (Steps == MaxCursorSteps) {
+					Next = std::lower_bound(KeyFrames.begin() + Next, KeyFrames.end(), Frame, Before) - KeyFrames.begin();
+					break;
+				}
+				++Next;
+			}
+		}
 
-VMD::Motion::~Motion()
-{
+		Next = std::min(Next, Last);
+		Cursor = (uint32_t)Next;
+		return Next;
+	}
 }
 
-void VMD::Motion::reset()
+bool VMD::Motion::advanceFrame(float Frames)
 {
-	CurrentFrame = 0.0f;
-	Finished = false;
+	return setFrame(CurrentFrame + Frames);
 }
 
-bool VMD::Motion::advanceFrame(float Frames)
+bool VMD::Motion::setFrame(double Frame)
 {
-	CurrentFrame += Frames;
+	CurrentFrame = Frame;
 
-	if (CurrentFrame >= MaxFrame) {
-		Finished = true;
+	// Seeking back into the motion plays it again
+	Finished = CurrentFrame >= MaxFrame;
+	if (Finished)
 		return true;
-	}
 
-	if (!AttachedCameras.empty())
-		updateCamera(CurrentFrame);
+	// The frame is absolute, so single precision is enough to evaluate the tracks
+	float EvaluatedFrame = (float)CurrentFrame;
 
-	if (!AttachedModels.empty()) {
-		for (auto &Model : AttachedModels)
-			Model->Reset();
+	if (!AttachedCameras.empty())
+		updateCamera(EvaluatedFrame);
 
-		updateBones(CurrentFrame);
-		updateMorphs(CurrentFrame);
+	// Layers read the evaluated tracks from the MotionController, which applies them itself
+	if (!AttachedModels.empty() || LayerReferences > 0) {
+		updateBones(EvaluatedFrame);
+		updateMorphs(EvaluatedFrame);
 	}
 
+	if (!AttachedModels.empty())
+		applyToModels();
+
 	return false;
 }
 
@@ -63,158 +98,34 @@ void VMD::Motion::attachCamera(std::shared_ptr<Renderer::Camera> Camera)
 
 void VMD::Motion::attachModel(std::shared_ptr<PMX::Model> Model)
 {
-	AttachedModels.push_back(Model);
+	ModelBinding Binding;
+	Binding.Model = Model;
+	bindModel(Binding);
+
+	AttachedModels.push_back(std::move(Binding));
 }
 
-bool VMD::Motion::loadFromFile(const std::wstring &FileName)
+void VMD::Motion::bindModel(ModelBinding &Binding)
 {
-	std::ifstream InputStream;
-
-	InputStream.open(FileName, std::ios::binary);
-
-	if (!InputStream.good())
-		return false;
-
-	char Magic[30];
-
-	InputStream.read(Magic, 30);
-
-	int Version;
-
-	if (!strcmp("Vocaloid Motion Data file", Magic))
-		Version = 1;
-	else if (!strcmp("Vocaloid Motion Data 0002", Magic))
-		Version = 2;
-	else {
-		InputStream.close();
-		return false;
-	}
-
-	// Function used to read a Shift-JIS string from an input stream and returns its counterfeit in a std::wstring
-	auto readSJISString = [](std::istream &Input, size_t Length) {
-		char *ReadBuffer = new char[Length];
-		assert(ReadBuffer != nullptr);
-
-		Input.read(ReadBuffer, Length);
-		ReadBuffer[Length - 1] = '\0';
-
-		// Gets the required output buffer size
-		auto RequiredLength = MultiByteToWideChar(932, 0, ReadBuffer, -1, nullptr, 0);
-
-		// Creates the output buffer
-		wchar_t *OutputBuffer = new wchar_t[RequiredLength];
-		assert(OutputBuffer != nullptr);
-
-		// Convert the sequence
-		auto WrittenCharacters = MultiByteToWideChar(932, 0, ReadBuffer, -1, OutputBuffer, RequiredLength);
-
-		// Create the output string
-		std::wstring Output(OutputBuffer);
-
-		// Delete the buffers
-		delete[] ReadBuffer;
-		delete[] OutputBuffer;
-
-		return Output;
-	};
-
-#if 1
-	std::wstring ModelName = readSJISString(InputStream, Version * 10);
-#else
-	// Skips the model name for the animation
-	InputStream.seekg(Version * 10, std::ios::cur);
-#endif
-
-	uint32_t FrameCount;
-	InputStream.read((char*)&FrameCount, sizeof(uint32_t));
-
-	while (FrameCount --> 0) {
-		BoneKeyFrame Frame;
-		int8_t InterpolationData[64];
-		float TempVector[4];
-
-		Frame.BoneName = readSJISString(InputStream, 15);
-		InputStream.read((char*)&Frame.FrameCount, sizeof(uint32_t));
-		InputStream.read((char*)TempVector, sizeof(float) * 3);
-		Frame.Translation = btVector3(TempVector[0], TempVector[1], TempVector[2]);
-		InputStream.read((char*)TempVector, sizeof(float) * 4);
-		Frame.Rotation = btQuaternion(TempVector[0], TempVector[1], TempVector[2], TempVector[3]);
-		InputStream.read((char*)InterpolationData, 64);
-
-		parseBoneInterpolationData(Frame, InterpolationData);
-
-		MaxFrame = std::max(MaxFrame, (float)Frame.FrameCount);
-
-		auto BoneMotion = BoneKeyFrames.find(Frame.BoneName);
-		if (BoneMotion == BoneKeyFrames.end())
-			BoneKeyFrames[Frame.BoneName] = { Frame };
-		else BoneKeyFrames[Frame.BoneName].emplace_back(Frame);
-	}
-
-	// Sort the bone motion by the key frames
-	for (auto &BoneMotion : BoneKeyFrames) {
-		std::sort(BoneMotion.second.begin(), BoneMotion.second.end(), [](BoneKeyFrame &a, BoneKeyFrame &b) {
-			return a.FrameCount < b.FrameCount;
-		});
-	}
-
-	InputStream.read((char*)&FrameCount, sizeof(uint32_t));
-
-	while (FrameCount --> 0) {
-		MorphKeyFrame Frame;
-
-		Frame.MorphName = readSJISString(InputStream, 15);
-		InputStream.read((char*)&Frame.FrameCount, sizeof(uint32_t));
-		InputStream.read((char*)&Frame.Weight, sizeof(float));
-
-		MaxFrame = std::max(MaxFrame, (float)Frame.FrameCount);
-
-		auto MorphFrame = MorphKeyFrames.find(Frame.MorphName);
-		if (MorphFrame == MorphKeyFrames.end())
-			MorphKeyFrames[Frame.MorphName] = { Frame };
-		else MorphKeyFrames[Frame.MorphName].emplace_back(Frame);
-	}
-
-	// Check if the camera data is present
-	if (InputStream.eof()) {
-		InputStream.close();
-		return true;
+	Binding.Bones.clear();
+	Binding.Morphs.clear();
+	Binding.Revision = Revision;
+
+	for (uint32_t Track = 0; Track < BoneTracks.size(); ++Track) {
+		auto Bone = Binding.Model->GetBoneByName(BoneTracks[Track].BoneName);
+		if (Bone != nullptr) {
+			BoneBinding Bound = { Track, Bone };
+			Binding.Bones.push_back(Bound);
+		}
 	}
 
-	InputStream.read((char*)&FrameCount, sizeof(uint32_t));
-
-	while (FrameCount --> 0) {
-		CameraKeyFrame Frame;
-		int8_t InterpolationData[24];
-		float TempVector[3];
-		uint32_t DegreesAngle;
-
-		InputStream.read((char*)&Frame.FrameCount, sizeof(uint32_t));
-		InputStream.read((char*)&Frame.Distance, sizeof(float));
-
-		InputStream.read((char*)TempVector, sizeof(float) * 3);
-		Frame.Position = btVector3(TempVector[0], TempVector[1], TempVector[2]);
-
-		InputStream.read((char*)TempVector, sizeof(float) * 3);
-		Frame.Rotation.setEulerZYX(TempVector[0], TempVector[1], TempVector[2]);
-
-		InputStream.read((char*)InterpolationData, 24);
-
-		InputStream.read((char*)&DegreesAngle, sizeof(uint32_t));
-		Frame.FovAngle = DirectX::XMConvertToRadians((float)DegreesAngle);
-
-		InputStream.read((char*)&Frame.NoPerspective, 1);
-
-		parseCameraInterpolationData(Frame, InterpolationData);
-
-		MaxFrame = std::max(MaxFrame, (float)Frame.FrameCount);
-
-		CameraKeyFrames.push_back(Frame);
+	for (uint32_t Track = 0; Track < MorphTracks.size(); ++Track) {
+		auto Morph = Binding.Model->FindMorph(MorphTracks[Track].MorphName);
+		if (Morph.isValid()) {
+			MorphBinding Bound = { Track, Morph };
+			Binding.Morphs.push_back(Bound);
+		}
 	}
-
-	InputStream.close();
-
-	return true;
 }
 
 void VMD::Motion::setCameraParameters(float FieldOfView, float Distance, btVector3 &Position, btQuaternion &Rotation)
@@ -227,20 +138,27 @@ void VMD::Motion::setCameraParameters(float FieldOfView, float Distance, btVecto
 	}
 }
 
-void VMD::Motion::setBoneParameters(std::wstring BoneName, btVector3 &Translation, btQuaternion &Rotation)
+void VMD::Motion::applyToModels()
 {
-	for (auto &Model : AttachedModels) {
-		auto bone = Model->GetBoneByName(BoneName);
-		if (bone) {
-			bone->transform(btTransform(Rotation, Translation), PMX::DeformationOrigin::Motion);
+	for (auto &Binding : AttachedModels) {
+		// Models attached before the tracks were loaded resolve them again
+		if (Binding.Revision != Revision)
+			bindModel(Binding);
+
+		auto &Model = Binding.Model;
+		Model->Reset();
+
+		for (auto &Bound : Binding.Bones) {
+			auto &Pose = BonePoses[Bound.Track];
+			if (Pose.Active)
+				Bound.Bone->transform(btTransform(Pose.Rotation, Pose.Translation), PMX::DeformationOrigin::Motion);
 		}
-	}
-}
 
-void VMD::Motion::setMorphParameters(std::wstring MorphName, float MorphWeight)
-{
-	for (auto &Model : AttachedModels) {
-		Model->ApplyMorph(MorphName, MorphWeight);
+		for (auto &Bound : Binding.Morphs) {
+			auto &Pose = MorphPoses[Bound.Track];
+			if (Pose.Active)
+				Model->ApplyMorph(Bound.Morph, Pose.Weight);
+		}
 	}
 }
 
@@ -255,16 +173,7 @@ void VMD::Motion::updateCamera(float Frame)
 	}
 
 	// Find the next key frame
-	size_t NextKeyFrame = 0, CurrentKeyFrame = 0;
-	for (size_t i = 0; i < CameraKeyFrames.size(); ++i) {
-		if (Frame <= CameraKeyFrames[i].FrameCount) {
-			NextKeyFrame = i;
-			break;
-		}
-	}
-
-	// Value clamping
-	if (NextKeyFrame >= CameraKeyFrames.size()) NextKeyFrame = CameraKeyFrames.size() - 1;
+	size_t NextKeyFrame = findNextKeyFrame(CameraKeyFrames, Frame, CameraCursor), CurrentKeyFrame = 0;
 
 	if (NextKeyFrame <= 1) CurrentKeyFrame = 0;
 	else CurrentKeyFrame = NextKeyFrame - 1;
@@ -282,53 +191,41 @@ void VMD::Motion::updateCamera(float Frame)
 
 	btVector3 Position;
 	float Ratio = (Frame - Frame1Time) / (Frame2Time - Frame1Time);
-	uint32_t InterpolationIndex = (uint32_t)(Ratio * InterpolationTableSize);
-
-	auto findRatio = [Ratio, InterpolationIndex](std::vector<float> &Table) {
-		if (Table.empty()) return Ratio;
 
-		return Table[InterpolationIndex] + (Table[InterpolationIndex + 1] - Table[InterpolationIndex]) * (Ratio * InterpolationTableSize - InterpolationIndex);
+	auto findRatio = [this, Ratio](uint16_t Curve) {
+		return Curves.evaluate(Curve, Ratio);
 	};
 
 	// Calculate the camera parameters
-	Position.setX(doLinearInterpolation(findRatio(Frame2.InterpolationData[0]), Frame1.Position.getX(), Frame2.Position.getX()));
-	Position.setY(doLinearInterpolation(findRatio(Frame2.InterpolationData[1]), Frame1.Position.getY(), Frame2.Position.getY()));
-	Position.setZ(doLinearInterpolation(findRatio(Frame2.InterpolationData[2]), Frame1.Position.getZ(), Frame2.Position.getZ()));
-	btQuaternion Rotation = Frame1.Rotation.slerp(Frame2.Rotation, findRatio(Frame2.InterpolationData[3]));
-	float Distance = doLinearInterpolation(findRatio(Frame2.InterpolationData[4]), Frame1.Distance, Frame2.Distance);
-	float FieldOfView = doLinearInterpolation(findRatio(Frame2.InterpolationData[5]), Frame1.FovAngle, Frame2.FovAngle);
+	Position.setX(doLinearInterpolation(findRatio(Frame2.Curves[0]), Frame1.Position.getX(), Frame2.Position.getX()));
+	Position.setY(doLinearInterpolation(findRatio(Frame2.Curves[1]), Frame1.Position.getY(), Frame2.Position.getY()));
+	Position.setZ(doLinearInterpolation(findRatio(Frame2.Curves[2]), Frame1.Position.getZ(), Frame2.Position.getZ()));
+	btQuaternion Rotation = Frame1.Rotation.slerp(Frame2.Rotation, findRatio(Frame2.Curves[3]));
+	float Distance = doLinearInterpolation(findRatio(Frame2.Curves[4]), Frame1.Distance, Frame2.Distance);
+	float FieldOfView = doLinearInterpolation(findRatio(Frame2.Curves[5]), Frame1.FovAngle, Frame2.FovAngle);
 
 	setCameraParameters(FieldOfView, Distance, Position, Rotation);
 }
 
-void VMD::Motion::updateBones(float Frame)
+void VMD::Motion::updateBones(float CurrentFrame)
 {
-	for (auto BoneMotion = BoneKeyFrames.begin(); BoneMotion != BoneKeyFrames.end(); ++BoneMotion) {
-		if (BoneMotion->second.size() == 1) {
-			if (BoneMotion->second.front().FrameCount > Frame) continue;
-
-			setBoneParameters(BoneMotion->first, BoneMotion->second.front().Translation, BoneMotion->second.front().Rotation);
+	for (size_t Track = 0; Track < BoneTracks.size(); ++Track) {
+		auto &BoneKeyFrames = BoneTracks[Track].KeyFrames;
+		auto &Pose = BonePoses[Track];
+		Pose.Active = true;
+
+		if (BoneKeyFrames.size() == 1) {
+			Pose.Active = BoneKeyFrames.front().FrameCount <= CurrentFrame;
+			Pose.Translation = BoneKeyFrames.front().getTranslation();
+			Pose.Rotation = BoneKeyFrames.front().getRotation();
 			continue;
 		}
 
-		auto &BoneKeyFrames = BoneMotion->second;
-
 		// Clamp frame to the last frame of the animation
-		if (Frame > (float)BoneKeyFrames.back().FrameCount) {
-			Frame = (float)BoneKeyFrames.back().FrameCount;
-		}
+		float Frame = std::min(CurrentFrame, (float)BoneKeyFrames.back().FrameCount);
 
 		// Find the next key frame
-		size_t NextKeyFrame = 0, CurrentKeyFrame = 0;
-		for (size_t i = 0; i < BoneKeyFrames.size(); ++i) {
-			if (Frame <= BoneKeyFrames[i].FrameCount) {
-				NextKeyFrame = i;
-				break;
-			}
-		}
-
-		// Value clamping
-		if (NextKeyFrame >= BoneKeyFrames.size()) NextKeyFrame = BoneKeyFrames.size() - 1;
+		size_t NextKeyFrame = findNextKeyFrame(BoneKeyFrames, Frame, Pose.Cursor), CurrentKeyFrame = 0;
 
 		if (NextKeyFrame <= 1) CurrentKeyFrame = 0;
 		else CurrentKeyFrame = NextKeyFrame - 1;
@@ -339,60 +236,46 @@ void VMD::Motion::updateBones(float Frame)
 		BoneKeyFrame& Frame2 = BoneKeyFrames[NextKeyFrame];
 
 		if (Frame1Time == Frame2Time || Frame <= Frame1Time) {
-			setBoneParameters(Frame1.BoneName, Frame1.Translation, Frame1.Rotation);
-			return;
+			Pose.Translation = Frame1.getTranslation();
+			Pose.Rotation = Frame1.getRotation();
+			continue;
 		}
 		else if (Frame >= Frame2Time) {
-			setBoneParameters(Frame2.BoneName, Frame2.Translation, Frame2.Rotation);
-			return;
+			Pose.Translation = Frame2.getTranslation();
+			Pose.Rotation = Frame2.getRotation();
+			continue;
 		}
 
 		float Ratio = (Frame - Frame1Time) / (Frame2Time - Frame1Time);
-		uint32_t InterpolationIndex = (uint32_t)(Ratio * InterpolationTableSize);
-
-		auto findRatio = [Ratio, InterpolationIndex](std::vector<float> &Table) {
-			if (Table.empty()) return Ratio;
 
-			return Table[InterpolationIndex] + (Table[InterpolationIndex + 1] - Table[InterpolationIndex]) * (Ratio * InterpolationTableSize - InterpolationIndex);
-		};
+		// The four curves of a bone key frame are solved together
+		DirectX::XMFLOAT4 Weights;
+		DirectX::XMStoreFloat4(&Weights, Curves.evaluate(Frame2.Curves, Ratio));
 
-		btVector3 Translation;
-		Translation.setX(doLinearInterpolation(findRatio(Frame2.InterpolationData[0]), Frame1.Translation.getX(), Frame2.Translation.getX()));
-		Translation.setY(doLinearInterpolation(findRatio(Frame2.InterpolationData[1]), Frame1.Translation.getY(), Frame2.Translation.getY()));
-		Translation.setZ(doLinearInterpolation(findRatio(Frame2.InterpolationData[2]), Frame1.Translation.getZ(), Frame2.Translation.getZ()));
-		btQuaternion Rotation;
-		Rotation = Frame1.Rotation.slerp(Frame2.Rotation, findRatio(Frame2.InterpolationData[3]));
-
-		setBoneParameters(Frame1.BoneName, Translation, Rotation);
+		Pose.Translation.setX(doLinearInterpolation(Weights.x, Frame1.Translation[0], Frame2.Translation[0]));
+		Pose.Translation.setY(doLinearInterpolation(Weights.y, Frame1.Translation[1], Frame2.Translation[1]));
+		Pose.Translation.setZ(doLinearInterpolation(Weights.z, Frame1.Translation[2], Frame2.Translation[2]));
+		Pose.Rotation = Frame1.getRotation().slerp(Frame2.getRotation(), Weights.w);
 	}
 }
 
 void VMD::Motion::updateMorphs(float CurrentFrame)
 {
-	for (auto MorphFrame = MorphKeyFrames.begin(); MorphFrame != MorphKeyFrames.end(); ++MorphFrame) {
-		if (MorphFrame->second.size() == 1) {
-			if (MorphFrame->second.front().FrameCount > CurrentFrame) continue;
-
-			setMorphParameters(MorphFrame->second.front().MorphName, MorphFrame->second.front().Weight);
+	for (size_t Track = 0; Track < MorphTracks.size(); ++Track) {
+		auto &Frame = MorphTracks[Track].KeyFrames;
+		auto &Pose = MorphPoses[Track];
+		Pose.Active = true;
+
+		if (Frame.size() == 1) {
+			Pose.Active = Frame.front().FrameCount <= CurrentFrame;
+			Pose.Weight = Frame.front().Weight;
 			continue;
 		}
 
-		auto &Frame = MorphFrame->second;
-
-		if (CurrentFrame > Frame.back().FrameCount)
-			CurrentFrame = (float)Frame.back().FrameCount;
+		float Time = std::min(CurrentFrame, (float)Frame.back().FrameCount);
 
 		// Find the next key frame
-		size_t NextKeyFrame = 0, CurrentKeyFrame = 0;
-		for (size_t i = 0; i < Frame.size(); ++i) {
-			if (CurrentFrame <= Frame[i].FrameCount) {
-				NextKeyFrame = i;
-				break;
-			}
-		}
-
-		// Value clamping
-		if (NextKeyFrame >= Frame.size()) NextKeyFrame = Frame.size() - 1;
+		size_t NextKeyFrame = findNextKeyFrame(Frame, Time, Pose.Cursor), CurrentKeyFrame = 0;
 
 		if (NextKeyFrame <= 1) CurrentKeyFrame = 0;
 		else CurrentKeyFrame = NextKeyFrame - 1;
@@ -402,89 +285,17 @@ void VMD::Motion::updateMorphs(float CurrentFrame)
 		auto& Frame1 = Frame[CurrentKeyFrame];
 		auto& Frame2 = Frame[NextKeyFrame];
 
-		if (Frame1Time == Frame2Time || CurrentFrame <= Frame1Time) {
-			setMorphParameters(Frame1.MorphName, Frame1.Weight);
-			return;
-		}
-		else if (CurrentFrame >= Frame2Time) {
-			setMorphParameters(Frame2.MorphName, Frame2.Weight);
-			return;
-		}
-
-		float Ratio = (CurrentFrame - Frame1Time) / (Frame2Time - Frame1Time);
-
-		setMorphParameters(Frame1.MorphName, doLinearInterpolation(Ratio, Frame1.Weight, Frame2.Weight));
-	}
-}
-
-void VMD::Motion::parseCameraInterpolationData(CameraKeyFrame &Frame, int8_t *InterpolationData)
-{
-	float X1, Y1, X2, Y2;
-
-	for (int i = 0; i < 6; ++i) {
-		if (InterpolationData[i * 4] == InterpolationData[i * 4 + 2] && InterpolationData[i * 4 + 1] == InterpolationData[i * 4 + 3]) {
-			Frame.InterpolationData[i].clear();
+		if (Frame1Time == Frame2Time || Time <= Frame1Time) {
+			Pose.Weight = Frame1.Weight;
 			continue;
 		}
-
-		Frame.InterpolationData[i].resize(InterpolationTableSize + 1);
-		X1 = InterpolationData[i * 4] / 127.0f;
-		Y1 = InterpolationData[i * 4 + 2] / 127.0f;
-		X2 = InterpolationData[i * 4 + 1] / 127.0f;
-		Y2 = InterpolationData[i * 4 + 3] / 127.0f;
-
-		generateInterpolationTable(Frame.InterpolationData[i], X1, X2, Y1, Y2);
-	}
-}
-
-void VMD::Motion::parseBoneInterpolationData(BoneKeyFrame &Frame, int8_t *InterpolationData)
-{
-	float X1, Y1, X2, Y2;
-
-	for (int i = 0; i < 4; ++i) {
-		if (InterpolationData[i] == InterpolationData[i + 4] && InterpolationData[i + 8] == InterpolationData[i + 12]) {
-			Frame.InterpolationData[i].clear();
+		else if (Time >= Frame2Time) {
+			Pose.Weight = Frame2.Weight;
 			continue;
 		}
 
-		Frame.InterpolationData[i].resize(InterpolationTableSize + 1);
-		X1 = InterpolationData[i] / 127.0f;
-		Y1 = InterpolationData[i + 4] / 127.0f;
-		X2 = InterpolationData[i + 8] / 127.0f;
-		Y2 = InterpolationData[i + 12] / 127.0f;
-
-		generateInterpolationTable(Frame.InterpolationData[i], X1, X2, Y1, Y2);
-	}
-}
-
-void VMD::Motion::generateInterpolationTable(std::vector<float> &Table, float X1, float X2, float Y1, float Y2)
-{
-	for (int k = 0; k < InterpolationTableSize; ++k) {
-		float CurrentFrame = (float)k / (float)InterpolationTableSize;
-		float Param = CurrentFrame;
-
-		while (true) {
-			float Value = InterpolationFunction(Param, X1, X2) - CurrentFrame;
-			if (fabsf(Value) <= 0.0001f) break;
-
-			float ParamDT = InterpolationFunctionDerivative(Param, X1, X2);
-			if (ParamDT == 0.0f) break;
-
-			Param -= Value / ParamDT;
-		}
+		float Ratio = (Time - Frame1Time) / (Frame2Time - Frame1Time);
 
-		Table[k] = InterpolationFunction(Param, Y1, Y2);
+		Pose.Weight = doLinearInterpolation(Ratio, Frame1.Weight, Frame2.Weight);
 	}
-
-	Table[InterpolationTableSize] = 1.0f;
-}
-
-float VMD::Motion::InterpolationFunction(float T, float P1, float P2)
-{
-	return ((1 + 3 * P1 - 3 * P2) * T * T * T + (3 * P2 - 6 * P1) * T * T + 3 * P1 * T);
-}
-
-float VMD::Motion::InterpolationFunctionDerivative(float T, float P1, float P2)
-{
-	return ((3 + 9 * P1 - 9 * P2) * T * T + (6 * P2 - 12 * P1) * T + 3 * P1);
 }
@@ -14,16 +14,22 @@
 
 #pragma once
 
-#include "../PMX/PMXModel.h"
-#include "../Renderer/Camera.h"
+#include "../PMX/PMXNameIndex.h"
 
+#include "CurveTable.h"
 #include "VMDDefinitions.h"
 
+#include <memory>
 #include <string>
 #include <vector>
 
+namespace PMX { class Model; }
+namespace Renderer { class Camera; }
+
 namespace VMD {
 
+	class MotionController;
+
 	/// \brief This is used to perform an animation of a character and/or camera
 	///
 	/// \remarks A single character may have different motions (for example, one motion is related to walking and another related to wave hands) in effect at the same time.
@@ -42,12 +48,29 @@ namespace VMD {
 		/// \returns Whether the loading was successful or not
 		bool loadFromFile(const std::wstring &FileName);
 
+		/// \brief Writes the motion to a VMD file
+		///
+		/// \param [in] FileName The path of the file to be written
+		/// \returns Whether the file was written or not
+		bool saveToFile(const std::wstring &FileName) const;
+
 		/// \brief Advances the frame of the motion
 		///
 		/// \param [in] Frames The amount of frames to advance the motion
 		/// \returns true if the animation is finished, false otherwise
 		bool advanceFrame(float Frames);
 
+		/// \brief Evaluates the motion at an absolute frame
+		///
+		/// \param [in] Frame The frame to be played, usually computed from a MotionClock
+		/// \returns true if the animation is finished, false otherwise
+		/// \remarks Unlike advanceFrame(), nothing is accumulated between calls, so playback
+		/// stays exact however long the motion plays
+		bool setFrame(double Frame);
+
+		/// \brief Returns the current frame of the motion
+		double getFrame() const { return CurrentFrame; }
+
 		/// \brief Attaches a Renderer::Camera to the motion
 		///
 		/// \param [in] Camera The camera to be attached
@@ -55,6 +78,9 @@ namespace VMD {
 		/// \brief Attaches a Renderer::Model to the motion
 		///
 		/// \param [in] Model The model to be attached
+		/// \remarks The bone and morph names of the motion are resolved here, once; tracks
+		/// without a matching bone or morph in the model are ignored for that model.
+		/// To blend many motions on the same model, use MotionController layers instead.
 		void attachModel(std::shared_ptr<PMX::Model> Model);
 
 		/// \brief Returns the motion finished state
@@ -62,33 +88,103 @@ namespace VMD {
 
 	private:
 		/// \brief The current frame of the motion
-		float CurrentFrame;
+		double CurrentFrame;
 		/// \brief The motion frame count
 		float MaxFrame;
 
 		/// \brief Defines whether this motion has finished or not
 		bool Finished;
 
-		/// \brief The key frames of bone animations
-		std::map<std::wstring, std::vector<BoneKeyFrame>> BoneKeyFrames;
-		/// \brief The key frames of morphs animations
-		std::map<std::wstring, std::vector<MorphKeyFrame>> MorphKeyFrames;
+		/// \brief The name of the model the motion was made for, as found in the file
+		std::wstring ModelName;
+
+		/// \brief The key frames of bone animations, one track per bone
+		std::vector<BoneTrack> BoneTracks;
+		/// \brief The key frames of morphs animations, one track per morph
+		std::vector<MorphTrack> MorphTracks;
 		/// \brief The key frames of camera animations
 		std::vector<CameraKeyFrame> CameraKeyFrames;
+		/// \brief The interpolation curves used by the key frames
+		CurveTable Curves;
 
 		/// \brief The attached cameras
 		std::vector<std::shared_ptr<Renderer::Camera>> AttachedCameras;
+		/// \brief Links a bone track to the bone it animates in an attached model
+		struct BoneBinding
+		{
+			uint32_t Track;
+			PMX::Bone *Bone;
+		};
+
+		/// \brief Links a morph track to the morph it animates in an attached model
+		struct MorphBinding
+		{
+			uint32_t Track;
+			PMX::MorphHandle Morph;
+		};
+
+		/// \brief An attached model with the tracks of the motion resolved against it
+		struct ModelBinding
+		{
+			std::shared_ptr<PMX::Model> Model;
+			std::vector<BoneBinding> Bones;
+			std::vector<MorphBinding> Morphs;
+			/// \brief The Revision of the tracks the bindings were resolved against
+			uint32_t Revision;
+		};
+
 		/// \brief The attached models
-		std::vector<std::shared_ptr<PMX::Model>> AttachedModels;
+		std::vector<ModelBinding> AttachedModels;
+
+		/// \brief The amount of MotionController layers playing this motion
+		///
+		/// While it is not zero the tracks are evaluated on every frame even without attached models.
+		uint32_t LayerReferences;
+
+		/// \brief Incremented every time the tracks are loaded, so the layers and attached models know to resolve them again
+		uint32_t Revision;
+
+		/// \brief The state of a bone track at the current frame
+		struct BonePose
+		{
+			btVector3 Translation;
+			btQuaternion Rotation;
+			bool Active;
+			/// \brief The key frame found by the last evaluation of the track
+			uint32_t Cursor;
+		};
+
+		/// \brief The state of a morph track at the current frame
+		struct MorphPose
+		{
+			float Weight;
+			bool Active;
+			/// \brief The key frame found by the last evaluation of the track
+			uint32_t Cursor;
+		};
+
+		/// \brief The state of every bone track at the current frame, indexed as BoneTracks
+		std::vector<BonePose> BonePoses;
+		/// \brief The state of every morph track at the current frame, indexed as MorphTracks
+		std::vector<MorphPose> MorphPoses;
+		/// \brief The key frame found by the last evaluation of the camera track
+		uint32_t CameraCursor;
+
+		/// \brief Decodes a whole VMD file
+		///
+		/// \param [in] Data The contents of the file
+		/// \param [in] Size The size of the file, in bytes
+		/// \returns false if the file is not a VMD file or is truncated
+		bool parse(const char *Data, size_t Size);
+
+		/// \brief Resolves the tracks of the motion against a model
+		void bindModel(ModelBinding &Binding);
 
 		/// \brief Apply motion parameters to all attached cameras
 		void setCameraParameters(float FieldOfView, float Distance, btVector3 &Position, btQuaternion &Rotation);
 
-		/// \brief Apply bone deformation parameters to all attached models
-		void setBoneParameters(std::wstring BoneName, btVector3 &Translation, btQuaternion &Rotation);
-		
-		/// \brief Apply morph parameters to all attached models
-		void setMorphParameters(std::wstring MorphName, float MorphWeight);
+		/// \brief Apply the evaluated bone and morph tracks to all attached models
+		void applyToModels();
 
 		/// \name Functions extracted from MMDAgent, http://www.mmdagent.jp/
 		/// @{
@@ -99,30 +195,22 @@ namespace VMD {
 		void updateCamera(float Frame);
 
 		/// \brief Parses the camera interpolation data from the VMD file
-		void parseCameraInterpolationData(CameraKeyFrame &Frame, int8_t *InterpolationData);
+		bool parseCameraInterpolationData(CameraKeyFrame &Frame, const int8_t *InterpolationData);
 
-		/// \brief Sets bones parameters according to the motion at the specified frame
+		/// \brief Writes the camera interpolation data, the inverse of parseCameraInterpolationData()
+		void writeCameraInterpolationData(const CameraKeyFrame &Frame, int8_t *InterpolationData) const;
+
+		/// \brief Evaluates every bone track at the specified frame into BonePoses
 		void updateBones(float Frame);
 
 		/// \brief Parses the bone interpolation data from the VMD file
-		void parseBoneInterpolationData(BoneKeyFrame &Frame, int8_t *InterpolationData);
-
-		/// \brief Sets morphs parameters according to the motion at the specified frame
-		void updateMorphs(float Frame);
+		bool parseBoneInterpolationData(BoneKeyFrame &Frame, const int8_t *InterpolationData);
 
-		/// \brief Generates the interpolation data table
-		void generateInterpolationTable(std::vector<float> &Table, float X1, float X2, float Y1, float Y2);
+		/// \brief Writes the bone interpolation data, the inverse of parseBoneInterpolationData()
+		void writeBoneInterpolationData(const BoneKeyFrame &Frame, int8_t *InterpolationData) const;
 
-		/// \brief Cubic Bzier curve interpolation function
-		///
-		/// \param [in] T The interpolation value, in [0.0; 1.0] range
-		/// \param [in] P1 The first point ordinate
-		/// \param [in] P2 The second point ordinate
-		float InterpolationFunction(float T, float P1, float P2);
-
-		/// \brief The derivative of the cubic Bzier curve
-		/// \sa float VMD::Motion::InterpolationFunction(float T, float P1, float P2)
-		float InterpolationFunctionDerivative(float T, float P1, float P2);
+		/// \brief Evaluates every morph track at the specified frame into MorphPoses
+		void updateMorphs(float Frame);
 
 		float doLinearInterpolation(float Ratio, float V1, float V2) {
 			return V1 * (1.0f - Ratio) + V2 * Ratio;
@@ -130,9 +218,9 @@ namespace VMD {
 
 		/// @}
 
-		enum {
-			InterpolationTableSize = 64
-		};
+		friend class MotionController;
+		friend class BakedMotion;
+		friend class KeyFrameReducer;
 	};
 
 }
@@ -0,0 +1,94 @@
+//===-- VMD/MotionClock.cpp - Defines the motion timeline clock -----*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the VMD::MotionClock class, the timeline motions
+/// are evaluated against
+///
+//===------------------------------------------------------------------------===//
+
+#include "MotionClock.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace VMD;
+
+MotionClock::MotionClock()
+{
+	Time = 0.0;
+	LastUpdate = SystemClock::now();
+	Paused = false;
+
+	CorrectionTime = 0.5;
+	SnapThreshold = 0.25;
+}
+
+void MotionClock::setSource(Source ExternalSource)
+{
+	this->ExternalSource = ExternalSource;
+	if (this->ExternalSource && !Paused)
+		Time = this->ExternalSource();
+}
+
+void MotionClock::update()
+{
+	auto Now = SystemClock::now();
+	double Elapsed = std::chrono::duration<double>(Now - LastUpdate).count();
+	LastUpdate = Now;
+
+	if (Paused)
+		return;
+
+	double Predicted = Time + Elapsed;
+	if (!ExternalSource) {
+		Time = Predicted;
+		return;
+	}
+
+	double Target = ExternalSource();
+	double Drift = Target - Predicted;
+
+	if (fabs(Drift) > SnapThreshold) {
+		// The source was moved or stalled for long, follow it at once
+		Time = Target;
+		return;
+	}
+
+	// Absorb the difference a little on every update, the timeline never goes backwards
+	double Correction = Drift * std::min(1.0, Elapsed / CorrectionTime);
+	Time = std::max(Time, Predicted + Correction);
+}
+
+void MotionClock::seek(double Time)
+{
+	this->Time = Time;
+	LastUpdate = SystemClock::now();
+}
+
+void MotionClock::pause()
+{
+	Paused = true;
+}
+
+void MotionClock::resume()
+{
+	if (!Paused)
+		return;
+
+	// The time spent paused does not count
+	Paused = false;
+	LastUpdate = SystemClock::now();
+}
+
+void MotionClock::setCorrection(double CorrectionTime, double SnapThreshold)
+{
+	this->CorrectionTime = std::max(CorrectionTime, 1e-3);
+	this->SnapThreshold = SnapThreshold;
+}
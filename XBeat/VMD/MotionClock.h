@@ -0,0 +1,91 @@
+//===-- VMD/MotionClock.h - Declares the motion timeline clock -----*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-----------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file declares the VMD::MotionClock class, the timeline motions
+/// are evaluated against
+///
+//===-----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+
+namespace VMD {
+
+	/// \brief A double precision timeline, optionally locked to an external clock
+	///
+	/// The clock measures time itself with a steady system clock, so it does not depend on
+	/// the duration of rendered frames. When a source is set, for example the playback
+	/// position of a song, the clock follows it: small differences are corrected smoothly
+	/// over a short time, so the coarse updates of an audio position do not make motions
+	/// stutter, while large ones, like a seek, are applied at once.
+	///
+	/// Motions are then evaluated at absolute frames computed from getTime(), instead of
+	/// adding up frame durations, so no error builds up however long they play.
+	class MotionClock
+	{
+	public:
+		/// \brief Returns the position of an external clock, in seconds
+		typedef std::function<double(void)> Source;
+
+		MotionClock();
+
+		/// \brief Locks the clock to an external source
+		///
+		/// \param [in] ExternalSource The source to be followed, or nullptr to use the system clock only
+		void setSource(Source ExternalSource);
+
+		/// \brief Samples the system clock and the source, if any, and moves the timeline
+		void update();
+
+		/// \brief Moves the timeline to the specified time
+		///
+		/// \remarks When a source is set, it keeps control of the time: this is only useful
+		/// right before the source itself is moved, to avoid waiting for the next update
+		void seek(double Time);
+
+		/// \brief Stops the timeline; the source, if any, is not sampled until it resumes
+		void pause();
+		/// \brief Resumes the timeline from where it stopped
+		void resume();
+		/// \brief Returns whether the timeline is stopped
+		bool isPaused() const { return Paused; }
+
+		/// \brief Returns the current time of the timeline, in seconds
+		double getTime() const { return Time; }
+
+		/// \brief Returns the current time of the timeline as a motion frame
+		///
+		/// \param [in] FramesPerSecond The frame rate of the motions
+		double getFrame(double FramesPerSecond = 30.0) const { return Time * FramesPerSecond; }
+
+		/// \brief Sets how the clock follows its source
+		///
+		/// \param [in] CorrectionTime The time taken to absorb most of a small difference, in seconds
+		/// \param [in] SnapThreshold The difference above which the source is followed at once, in seconds
+		void setCorrection(double CorrectionTime, double SnapThreshold);
+
+	private:
+		typedef std::chrono::steady_clock SystemClock;
+
+		/// \brief The current time of the timeline, in seconds
+		double Time;
+		/// \brief The system time of the last update
+		SystemClock::time_point LastUpdate;
+
+		Source ExternalSource;
+		bool Paused;
+
+		double CorrectionTime;
+		double SnapThreshold;
+	};
+
+}
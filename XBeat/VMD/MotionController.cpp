@@ -15,37 +15,65 @@
 #include "MotionController.h"
 
 #include "Motion.h"
+#include "../PMX/PMXModel.h"
+
+#include <algorithm>
 
 using namespace VMD;
 
 MotionController::MotionController()
 {
 	FramesPerSecond = 30.f;
+	NextLayerId = 0;
 }
 
 
 MotionController::~MotionController()
 {
+	for (auto &Model : LayeredModels) {
+		for (auto &Layer : Model.Layers)
+			--Layer.Motion->LayerReferences;
+	}
 }
 
-void MotionController::advanceFrame(float Time)
+void MotionController::update()
 {
-	float FrameCount = Time * FramesPerSecond;
+	double PreviousTime = Clock.getTime();
+	Clock.update();
+	double Time = Clock.getTime();
 
-	for (auto &Motion : KnownMotions) {
-		Motion->advanceFrame(FrameCount);
+	// Evaluate each motion at its absolute frame, motions scheduled later wait for their start
+	for (auto &Playing : KnownMotions) {
+		double Frame = (Time - Playing.StartTime) * FramesPerSecond;
+		if (Frame >= 0.0)
+			Playing.Motion->setFrame(Frame);
 	}
+
+	// Fades are not rewound when the clock seeks backwards
+	updateFades((float)std::max(Time - PreviousTime, 0.0));
+
+	for (auto &Model : LayeredModels)
+		blendLayers(Model);
 }
 
 void MotionController::clearFinished()
 {
-	for (auto motion = KnownMotions.begin(); motion != KnownMotions.end(); ) {
-		if ((*motion)->isFinished()) {
-			KnownMotions.erase(motion);
-			motion = KnownMotions.begin();
-		}
-		else ++motion;
+	for (auto &Model : LayeredModels) {
+		auto Finished = std::remove_if(Model.Layers.begin(), Model.Layers.end(), [](const Layer &Layer) {
+			return Layer.Motion->isFinished();
+		});
+		for (auto Layer = Finished; Layer != Model.Layers.end(); ++Layer)
+			--Layer->Motion->LayerReferences;
+		Model.Layers.erase(Finished, Model.Layers.end());
 	}
+
+	LayeredModels.erase(std::remove_if(LayeredModels.begin(), LayeredModels.end(), [](const ModelLayers &Model) {
+		return Model.Layers.empty();
+	}), LayeredModels.end());
+
+	KnownMotions.erase(std::remove_if(KnownMotions.begin(), KnownMotions.end(), [](const PlayingMotion &Playing) {
+		return Playing.Motion->isFinished();
+	}), KnownMotions.end());
 }
 
 void MotionController::setFPS(float FPS)
@@ -66,7 +94,261 @@ std::shared_ptr<Motion> MotionController::loadMotion(std::wstring FileName)
 	if (!Output->loadFromFile(FileName))
 		return nullptr;
 
-	KnownMotions.push_back(Output);
+	PlayingMotion Playing = { Output, Clock.getTime() };
+	KnownMotions.push_back(Playing);
 
 	return Output;
 }
+
+std::vector<MotionController::PlayingMotion>::iterator MotionController::findMotion(const std::shared_ptr<Motion> &Motion)
+{
+	return std::find_if(KnownMotions.begin(), KnownMotions.end(), [&Motion](const PlayingMotion &Playing) {
+		return Playing.Motion == Motion;
+	});
+}
+
+void MotionController::startMotion(std::shared_ptr<Motion> Motion, double StartTime)
+{
+	auto Playing = findMotion(Motion);
+	if (Playing != KnownMotions.end()) {
+		Playing->StartTime = StartTime;
+		return;
+	}
+
+	PlayingMotion NewMotion = { Motion, StartTime };
+	KnownMotions.push_back(NewMotion);
+}
+
+MotionController::LayerId MotionController::addLayer(std::shared_ptr<PMX::Model> Model, std::shared_ptr<Motion> Motion, float Weight)
+{
+	if (findMotion(Motion) == KnownMotions.end()) {
+		PlayingMotion Playing = { Motion, Clock.getTime() };
+		KnownMotions.push_back(Playing);
+	}
+
+	auto Layers = std::find_if(LayeredModels.begin(), LayeredModels.end(), [&Model](const ModelLayers &Layers) {
+		return Layers.Model == Model;
+	});
+	if (Layers == LayeredModels.end()) {
+		LayeredModels.emplace_back();
+		LayeredModels.back().Model = Model;
+		Layers = LayeredModels.end() - 1;
+	}
+
+	Layer NewLayer;
+	NewLayer.Id = NextLayerId++;
+	NewLayer.Motion = Motion;
+	NewLayer.Weight = NewLayer.FadeStart = NewLayer.FadeTarget = std::min(std::max(Weight, 0.0f), 1.0f);
+	NewLayer.FadeElapsed = NewLayer.FadeDuration = 0.0f;
+	NewLayer.RemoveWhenFaded = false;
+	bindLayer(NewLayer, *Model);
+
+	++Motion->LayerReferences;
+	Layers->Layers.push_back(std::move(NewLayer));
+
+	return Layers->Layers.back().Id;
+}
+
+void MotionController::removeLayer(LayerId Id)
+{
+	for (auto Model = LayeredModels.begin(); Model != LayeredModels.end(); ++Model) {
+		auto Layer = std::find_if(Model->Layers.begin(), Model->Layers.end(), [Id](const MotionController::Layer &Layer) {
+			return Layer.Id == Id;
+		});
+		if (Layer == Model->Layers.end())
+			continue;
+
+		--Layer->Motion->LayerReferences;
+		Model->Layers.erase(Layer);
+
+		if (Model->Layers.empty())
+			LayeredModels.erase(Model);
+		return;
+	}
+}
+
+void MotionController::bindLayer(Layer &Layer, PMX::Model &Model)
+{
+	auto &Motion = *Layer.Motion;
+
+	// Resolve the tracks once, like Motion::attachModel does
+	Layer.Bones.clear();
+	for (uint32_t Track = 0; Track < Motion.BoneTracks.size(); ++Track) {
+		auto Bone = Model.FindBone(Motion.BoneTracks[Track].BoneName);
+		if (Bone.isValid())
+			Layer.Bones.emplace_back(Track, Bone);
+	}
+
+	Layer.Morphs.clear();
+	for (uint32_t Track = 0; Track < Motion.MorphTracks.size(); ++Track) {
+		auto Morph = Model.FindMorph(Motion.MorphTracks[Track].MorphName);
+		if (Morph.isValid())
+			Layer.Morphs.emplace_back(Track, Morph);
+	}
+
+	Layer.MotionRevision = Motion.Revision;
+}
+
+MotionController::Layer* MotionController::findLayer(LayerId Id)
+{
+	for (auto &Model : LayeredModels) {
+		for (auto &Layer : Model.Layers) {
+			if (Layer.Id == Id)
+				return &Layer;
+		}
+	}
+
+	return nullptr;
+}
+
+void MotionController::fadeLayer(LayerId Id, float Weight, float Duration, bool RemoveWhenDone)
+{
+	Layer *Layer = findLayer(Id);
+	if (Layer == nullptr)
+		return;
+
+	Layer->FadeStart = Layer->Weight;
+	Layer->FadeTarget = std::min(std::max(Weight, 0.0f), 1.0f);
+	Layer->FadeElapsed = 0.0f;
+	Layer->FadeDuration = std::max(Duration, 0.0f);
+	Layer->RemoveWhenFaded = RemoveWhenDone;
+
+	if (Layer->FadeDuration == 0.0f) {
+		Layer->Weight = Layer->FadeTarget;
+		if (RemoveWhenDone)
+			removeLayer(Id);
+	}
+}
+
+void MotionController::crossfade(LayerId From, LayerId To, float Duration)
+{
+	fadeLayer(To, 1.0f, Duration);
+	fadeLayer(From, 0.0f, Duration, true);
+}
+
+void MotionController::setLayerMask(LayerId Id, const std::vector<std::wstring> &RootBones)
+{
+	for (auto &Model : LayeredModels) {
+		for (auto &Layer : Model.Layers) {
+			if (Layer.Id != Id)
+				continue;
+
+			Layer.BoneMask.clear();
+			if (RootBones.empty())
+				return;
+
+			// Mark every root bone and its descendants
+			Layer.BoneMask.assign(Model.Model->GetBoneCount(), 0.0f);
+			std::vector<PMX::Bone*> Pending;
+			for (auto &Name : RootBones) {
+				auto Bone = Model.Model->GetBoneByName(Name);
+				if (Bone != nullptr)
+					Pending.push_back(Bone);
+			}
+
+			while (!Pending.empty()) {
+				auto Bone = Pending.back();
+				Pending.pop_back();
+
+				Layer.BoneMask[Bone->getId()] = 1.0f;
+				Pending.insert(Pending.end(), Bone->m_children.begin(), Bone->m_children.end());
+			}
+			return;
+		}
+	}
+}
+
+void MotionController::updateFades(float Time)
+{
+	std::vector<LayerId> Faded;
+
+	for (auto &Model : LayeredModels) {
+		for (auto &Layer : Model.Layers) {
+			if (Layer.FadeDuration <= 0.0f)
+				continue;
+
+			Layer.FadeElapsed = std::min(Layer.FadeElapsed + Time, Layer.FadeDuration);
+			float Ratio = Layer.FadeElapsed / Layer.FadeDuration;
+			Layer.Weight = Layer.FadeStart + (Layer.FadeTarget - Layer.FadeStart) * Ratio;
+
+			if (Layer.FadeElapsed >= Layer.FadeDuration) {
+				Layer.FadeDuration = 0.0f;
+				if (Layer.RemoveWhenFaded)
+					Faded.push_back(Layer.Id);
+			}
+		}
+	}
+
+	for (auto Id : Faded)
+		removeLayer(Id);
+}
+
+void MotionController::blendLayers(ModelLayers &Layers)
+{
+	auto &Model = Layers.Model;
+
+	// Every pose starts from the rest pose of the model
+	BlendedBone Rest = { btVector3(0.0f, 0.0f, 0.0f), btQuaternion::getIdentity(), false };
+	BlendedBones.assign(Model->GetBoneCount(), Rest);
+	BlendedMorph Neutral = { 0.0f, false };
+	BlendedMorphs.assign(Model->GetMorphCount(), Neutral);
+
+	for (auto &Layer : Layers.Layers) {
+		if (Layer.Weight <= 0.0f)
+			continue;
+
+		auto &Motion = *Layer.Motion;
+
+		// The motion was loaded again since its tracks were resolved
+		if (Layer.MotionRevision != Motion.Revision)
+			bindLayer(Layer, *Model);
+
+		for (auto &Bound : Layer.Bones) {
+			auto &Pose = Motion.BonePoses[Bound.first];
+			if (!Pose.Active)
+				continue;
+
+			float Weight = Layer.Weight;
+			if (!Layer.BoneMask.empty())
+				Weight *= Layer.BoneMask[Bound.second.Id];
+			if (Weight <= 0.0f)
+				continue;
+
+			auto &Blended = BlendedBones[Bound.second.Id];
+			if (Weight >= 1.0f) {
+				Blended.Translation = Pose.Translation;
+				Blended.Rotation = Pose.Rotation;
+			}
+			else {
+				Blended.Translation = Blended.Translation.lerp(Pose.Translation, Weight);
+				Blended.Rotation = Blended.Rotation.slerp(Pose.Rotation, Weight);
+			}
+			Blended.Written = true;
+		}
+
+		for (auto &Bound : Layer.Morphs) {
+			auto &Pose = Motion.MorphPoses[Bound.first];
+			if (!Pose.Active)
+				continue;
+
+			auto &Blended = BlendedMorphs[Bound.second.Id];
+			Blended.Weight += (Pose.Weight - Blended.Weight) * Layer.Weight;
+			Blended.Written = true;
+		}
+	}
+
+	// Write the final pose once
+	Model->Reset();
+
+	for (uint32_t Id = 0; Id < BlendedBones.size(); ++Id) {
+		auto &Blended = BlendedBones[Id];
+		if (Blended.Written)
+			Model->GetBone(PMX::BoneHandle(Id))->transform(btTransform(Blended.Rotation, Blended.Translation), PMX::DeformationOrigin::Motion);
+	}
+
+	for (uint32_t Id = 0; Id < BlendedMorphs.size(); ++Id) {
+		auto &Blended = BlendedMorphs[Id];
+		if (Blended.Written)
+			Model->ApplyMorph(PMX::MorphHandle(Id), Blended.Weight);
+	}
+}
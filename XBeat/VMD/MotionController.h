@@ -15,46 +15,197 @@
 
 #pragma once
 
+#include "../PMX/PMXNameIndex.h"
+#include "MotionClock.h"
+
+#include <LinearMath/btQuaternion.h>
+#include <LinearMath/btVector3.h>
 #include <boost/filesystem/path.hpp>
 #include <memory>
 #include <string>
 #include <vector>
 
+namespace PMX { class Model; }
+
 namespace VMD {
 
 	class Motion;
 
 	/// \brief Class that manages all running VMD motions
+	///
+	/// Besides playing motions attached directly to models, the controller can blend many
+	/// motions on the same model through layers. The layers of a model are blended in the
+	/// order they were added, each one over the result of the previous ones, by its weight
+	/// and by an optional per-bone mask. The final pose of every model is then written once
+	/// per frame.
+	///
+	/// Every motion is evaluated at the absolute frame given by the clock of the controller
+	/// and the time the motion started at, so it stays in sync with the clock source, such as
+	/// a song, however long it plays.
 	class MotionController
 	{
 	public:
+		/// \brief Identifies a layer
+		typedef uint32_t LayerId;
+
 		MotionController();
 		~MotionController();
 		
-		/// \brief Advances all motions by the specified amount of time
+		/// \brief Updates the clock and evaluates every motion at the new time
+		void update();
+
+		/// \brief Returns the clock the motions are played against
 		///
-		/// \param [in] Time The amount of time, in milliseconds to advance the VMD motions
-		void advanceFrame(float Time);
+		/// Set its source to lock the motions to the playback position of a song.
+		MotionClock& getClock() { return Clock; }
+
+		/// \brief Sets the time of the clock at which a motion plays its first frame
+		///
+		/// \param [in] Motion The motion to be scheduled, added to the known motions if needed
+		/// \param [in] StartTime The time of the clock, in seconds; it may be in the future
+		void startMotion(std::shared_ptr<Motion> Motion, double StartTime);
 
 		/// \brief Sets the new amount of Frames per Second
 		void setFPS(float FPS);
 		/// \brief Gets the amount of frames per second
 		float getFPS();
 
-		/// \brief Removes all finished motions
+		/// \brief Removes all finished motions, and the layers playing them
 		void clearFinished();
 
 		/// \brief Loads a VMD motion from the specified filename
 		///
 		/// \param [in] FileName The file to load the motion from
+		/// \remarks The motion starts playing at the current time of the clock
 		std::shared_ptr<Motion> loadMotion(std::wstring FileName);
 
+		/// \brief Plays a motion on a model as a new layer, on top of its existing layers
+		///
+		/// \param [in] Model The model to be animated
+		/// \param [in] Motion The motion to be played, added to the known motions if needed
+		/// \param [in] Weight The initial weight of the layer, in [0.0; 1.0] range
+		/// \returns The id of the new layer
+		LayerId addLayer(std::shared_ptr<PMX::Model> Model, std::shared_ptr<Motion> Motion, float Weight = 1.0f);
+
+		/// \brief Removes a layer
+		void removeLayer(LayerId Layer);
+
+		/// \brief Changes the weight of a layer, optionally over time
+		///
+		/// \param [in] Layer The layer to be changed
+		/// \param [in] Weight The new weight of the layer, in [0.0; 1.0] range
+		/// \param [in] Duration The duration of the fade, in seconds, 0 to change it at once
+		/// \param [in] RemoveWhenDone Whether to remove the layer once the fade finishes
+		void fadeLayer(LayerId Layer, float Weight, float Duration, bool RemoveWhenDone = false);
+
+		/// \brief Fades out a layer while fading in another one, removing the former when done
+		///
+		/// \param [in] From The layer to be faded out
+		/// \param [in] To The layer to be faded in, to full weight
+		/// \param [in] Duration The duration of the fade, in seconds
+		void crossfade(LayerId From, LayerId To, float Duration);
+
+		/// \brief Restricts a layer to some parts of the model
+		///
+		/// \param [in] Layer The layer to be changed
+		/// \param [in] RootBones The bones to be animated by the layer, with all of their descendants;
+		/// an empty list removes the mask
+		void setLayerMask(LayerId Layer, const std::vector<std::wstring> &RootBones);
+
 	private:
+		/// \brief A motion and the time of the clock it started at
+		struct PlayingMotion
+		{
+			std::shared_ptr<VMD::Motion> Motion;
+			double StartTime;
+		};
+
 		/// \brief Stores all loaded motions
-		std::vector<std::shared_ptr<Motion>> KnownMotions;
+		std::vector<PlayingMotion> KnownMotions;
+
+		/// \brief The timeline every motion is evaluated against
+		MotionClock Clock;
 
 		/// \brief The amount of frames per second of the motions
 		float FramesPerSecond;
+
+		/// \brief Finds a known motion
+		std::vector<PlayingMotion>::iterator findMotion(const std::shared_ptr<Motion> &Motion);
+
+		/// \brief A motion played on a model with a weight
+		struct Layer
+		{
+			LayerId Id;
+			std::shared_ptr<VMD::Motion> Motion;
+
+			/// \brief The current weight of the layer
+			float Weight;
+			/// \brief The weight at the start of the current fade
+			float FadeStart;
+			/// \brief The weight at the end of the current fade
+			float FadeTarget;
+			/// \brief The time elapsed since the fade started
+			float FadeElapsed;
+			/// \brief The duration of the fade, 0 if the layer is not fading
+			float FadeDuration;
+			/// \brief Whether the layer is removed when the fade finishes
+			bool RemoveWhenFaded;
+
+			/// \brief The weight of each bone of the model, indexed by id; empty if every bone is animated
+			std::vector<float> BoneMask;
+
+			/// \brief The bone track of the motion and the bone it animates
+			std::vector<std::pair<uint32_t, PMX::BoneHandle>> Bones;
+			/// \brief The morph track of the motion and the morph it animates
+			std::vector<std::pair<uint32_t, PMX::MorphHandle>> Morphs;
+			/// \brief The Motion::Revision the tracks were resolved against
+			uint32_t MotionRevision;
+		};
+
+		/// \brief The layers of a model, from the bottom one to the top one
+		struct ModelLayers
+		{
+			std::shared_ptr<PMX::Model> Model;
+			std::vector<Layer> Layers;
+		};
+
+		/// \brief The models animated by layers
+		std::vector<ModelLayers> LayeredModels;
+
+		/// \brief The id of the next layer
+		LayerId NextLayerId;
+
+		/// \brief The blended pose of a bone
+		struct BlendedBone
+		{
+			btVector3 Translation;
+			btQuaternion Rotation;
+			bool Written;
+		};
+
+		/// \brief The blended weight of a morph
+		struct BlendedMorph
+		{
+			float Weight;
+			bool Written;
+		};
+
+		/// \brief The blended pose of every bone of the model being blended, kept to avoid allocations
+		std::vector<BlendedBone> BlendedBones;
+		/// \brief The blended weight of every morph of the model being blended
+		std::vector<BlendedMorph> BlendedMorphs;
+
+		/// \brief Finds a layer
+		Layer* findLayer(LayerId Id);
+
+		/// \brief Resolves the tracks of the motion of a layer against a model
+		void bindLayer(Layer &Layer, PMX::Model &Model);
+
+		/// \brief Advances the fades of every layer and removes the faded ones
+		void updateFades(float Time);
+
+		/// \brief Blends every layer of a model and writes the resulting pose to it
+		void blendLayers(ModelLayers &Model);
 	};
 
 }
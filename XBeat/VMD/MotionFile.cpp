@@ -0,0 +1,406 @@
+//===-- VMD/MotionFile.cpp - Defines the VMD file input and output --*- C++ -*-===//
+//
+//                      The XBeat Project
+//
+// This file is distributed under the University of Illinois Open Source License.
+// See LICENSE.TXT for details.
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// \brief This file defines the functions of the VMD::Motion class that load and write
+/// VMD files, which depend neither on the models nor on the renderer
+///
+//===-------------------------------------------------------------------------===//
+
+#include "Motion.h"
+
+#include "../MappedFile.h"
+#include "../ShiftJIS.h"
+
+#include <boost/filesystem/fstream.hpp>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+VMD::Motion::Motion()
+{
+	reset();
+	MaxFrame = 0.0f;
+	LayerReferences = 0;
+	Revision = 0;
+}
+
+
+VMD::Motion::~Motion()
+{
+}
+
+void VMD::Motion::reset()
+{
+	CurrentFrame = 0.0;
+	Finished = false;
+
+	CameraCursor = 0;
+	for (auto &Pose : BonePoses)
+		Pose.Cursor = 0;
+	for (auto &Pose : MorphPoses)
+		Pose.Cursor = 0;
+}
+
+bool VMD::Motion::loadFromFile(const std::wstring &FileName)
+{
+	MappedFile File;
+	if (!File.open(FileName))
+		return false;
+
+	BoneTracks.clear();
+	MorphTracks.clear();
+	CameraKeyFrames.clear();
+	Curves.clear();
+	ModelName.clear();
+	MaxFrame = 0.0f;
+
+	bool Loaded = parse(File.data(), File.size());
+	if (!Loaded) {
+		BoneTracks.clear();
+		MorphTracks.clear();
+		CameraKeyFrames.clear();
+		Curves.clear();
+		MaxFrame = 0.0f;
+	}
+
+	BonePoses.resize(BoneTracks.size());
+	MorphPoses.resize(MorphTracks.size());
+	reset();
+
+	// The attached models and layers resolve the new tracks when they next play them
+	++Revision;
+
+	return Loaded;
+}
+
+namespace {
+	/// \brief The size of the header of a VMD file, the magic string followed by the model name
+	const size_t MagicSize = 30;
+	/// \brief The size of a Shift-JIS name of a bone or morph
+	const size_t NameSize = 15;
+	/// \brief The size of a bone key frame record
+	const size_t BoneRecordSize = NameSize + 4 + 3 * 4 + 4 * 4 + 64;
+	/// \brief The size of a morph key frame record
+	const size_t MorphRecordSize = NameSize + 4 + 4;
+	/// \brief The size of a camera key frame record
+	const size_t CameraRecordSize = 4 + 4 + 3 * 4 + 3 * 4 + 24 + 4 + 1;
+
+	/// \brief Reads little-endian values from a mapped file
+	struct Reader
+	{
+		const char *Current;
+		const char *End;
+
+		bool has(size_t Size) const { return (size_t)(End - Current) >= Size; }
+
+		/// \brief Reads the amount of records of a section and checks that all of them are present
+		bool readCount(size_t RecordSize, uint32_t &Count) {
+			if (!has(sizeof(uint32_t)))
+				return false;
+
+			memcpy(&Count, Current, sizeof(uint32_t));
+			Current += sizeof(uint32_t);
+			return (size_t)(End - Current) / RecordSize >= Count;
+		}
+	};
+
+	template <class T>
+	inline T readValue(const char *Data) {
+		T Value;
+		memcpy(&Value, Data, sizeof(T));
+		return Value;
+	}
+}
+
+bool VMD::Motion::parse(const char *Data, size_t Size)
+{
+	Reader File = { Data, Data + Size };
+
+	if (!File.has(MagicSize))
+		return false;
+
+	int Version;
+
+	if (!memcmp("Vocaloid Motion Data file", Data, sizeof("Vocaloid Motion Data file")))
+		Version = 1;
+	else if (!memcmp("Vocaloid Motion Data 0002", Data, sizeof("Vocaloid Motion Data 0002")))
+		Version = 2;
+	else
+		return false;
+
+	File.Current += MagicSize;
+
+	// Names repeat on every key frame, so each one is decoded only once
+	ShiftJIS Names;
+
+	// The name of the model the animation was made for
+	if (!File.has(Version * 10))
+		return false;
+	ShiftJIS::decode(File.Current, Version * 10, ModelName);
+	File.Current += Version * 10;
+
+	// Maps the track names to their position in BoneTracks and MorphTracks while loading
+	std::unordered_map<std::wstring, uint32_t> TrackIds;
+	// The track of each key frame of the section being read
+	std::vector<uint32_t> KeyTracks;
+
+	// Assigns every record of a section to its track and reserves the exact size of the tracks
+	auto assignTracks = [&](const char *Records, uint32_t Count, size_t RecordSize, std::function<uint32_t(const std::wstring&)> addTrack, std::vector<uint32_t> &KeyCounts) {
+		TrackIds.clear();
+		KeyTracks.resize(Count);
+		for (uint32_t i = 0; i < Count; ++i) {
+			auto &Name = Names.intern(Records + i * RecordSize, NameSize);
+			auto Track = TrackIds.find(Name);
+			if (Track == TrackIds.end()) {
+				Track = TrackIds.emplace(Name, addTrack(Name)).first;
+				KeyCounts.push_back(0);
+			}
+			KeyTracks[i] = Track->second;
+			++KeyCounts[Track->second];
+		}
+	};
+
+	uint32_t Count;
+	std::vector<uint32_t> KeyCounts;
+
+	// Bone key frames
+	if (!File.readCount(BoneRecordSize, Count))
+		return false;
+
+	assignTracks(File.Current, Count, BoneRecordSize, [this](const std::wstring &Name) {
+		BoneTracks.emplace_back();
+		BoneTracks.back().BoneName = Name;
+		return (uint32_t)BoneTracks.size() - 1;
+	}, KeyCounts);
+
+	for (size_t Track = 0; Track < BoneTracks.size(); ++Track)
+		BoneTracks[Track].KeyFrames.reserve(KeyCounts[Track]);
+
+	for (uint32_t i = 0; i < Count; ++i, File.Current += BoneRecordSize) {
+		const char *Record = File.Current + NameSize;
+		BoneKeyFrame Frame;
+
+		Frame.FrameCount = readValue<uint32_t>(Record);
+		memcpy(Frame.Translation, Record + 4, sizeof(Frame.Translation));
+		memcpy(Frame.Rotation, Record + 16, sizeof(Frame.Rotation));
+
+		if (!parseBoneInterpolationData(Frame, (const int8_t*)(Record + 32)))
+			return false;
+
+		MaxFrame = std::max(MaxFrame, (float)Frame.FrameCount);
+		BoneTracks[KeyTracks[i]].KeyFrames.push_back(Frame);
+	}
+
+	// Sort the bone motion by the key frames
+	for (auto &Track : BoneTracks) {
+		auto Earlier = [](const BoneKeyFrame &a, const BoneKeyFrame &b) {
+			return a.FrameCount < b.FrameCount;
+		};
+		if (!std::is_sorted(Track.KeyFrames.begin(), Track.KeyFrames.end(), Earlier))
+			std::sort(Track.KeyFrames.begin(), Track.KeyFrames.end(), Earlier);
+	}
+
+	// Morph key frames
+	KeyCounts.clear();
+	if (!File.readCount(MorphRecordSize, Count))
+		return false;
+
+	assignTracks(File.Current, Count, MorphRecordSize, [this](const std::wstring &Name) {
+		MorphTracks.emplace_back();
+		MorphTracks.back().MorphName = Name;
+		return (uint32_t)MorphTracks.size() - 1;
+	}, KeyCounts);
+
+	for (size_t Track = 0; Track < MorphTracks.size(); ++Track)
+		MorphTracks[Track].KeyFrames.reserve(KeyCounts[Track]);
+
+	for (uint32_t i = 0; i < Count; ++i, File.Current += MorphRecordSize) {
+		const char *Record = File.Current + NameSize;
+		MorphKeyFrame Frame;
+
+		Frame.FrameCount = readValue<uint32_t>(Record);
+		Frame.Weight = readValue<float>(Record + 4);
+
+		MaxFrame = std::max(MaxFrame, (float)Frame.FrameCount);
+		MorphTracks[KeyTracks[i]].KeyFrames.push_back(Frame);
+	}
+
+	// Sort the morph motion by the key frames
+	for (auto &Track : MorphTracks) {
+		auto Earlier = [](const MorphKeyFrame &a, const MorphKeyFrame &b) {
+			return a.FrameCount < b.FrameCount;
+		};
+		if (!std::is_sorted(Track.KeyFrames.begin(), Track.KeyFrames.end(), Earlier))
+			std::sort(Track.KeyFrames.begin(), Track.KeyFrames.end(), Earlier);
+	}
+
+	// Older files end after the morphs, without a camera section
+	if (File.Current == File.End)
+		return true;
+
+	if (!File.readCount(CameraRecordSize, Count))
+		return false;
+
+	CameraKeyFrames.reserve(Count);
+	for (uint32_t i = 0; i < Count; ++i, File.Current += CameraRecordSize) {
+		const char *Record = File.Current;
+		CameraKeyFrame Frame;
+		float TempVector[3];
+
+		Frame.FrameCount = readValue<uint32_t>(Record);
+		Frame.Distance = readValue<float>(Record + 4);
+
+		memcpy(TempVector, Record + 8, sizeof(TempVector));
+		Frame.Position = btVector3(TempVector[0], TempVector[1], TempVector[2]);
+
+		memcpy(Frame.EulerAngles, Record + 20, sizeof(Frame.EulerAngles));
+		Frame.Rotation.setEulerZYX(Frame.EulerAngles[0], Frame.EulerAngles[1], Frame.EulerAngles[2]);
+
+		if (!parseCameraInterpolationData(Frame, (const int8_t*)(Record + 32)))
+			return false;
+
+		Frame.FovAngle = DirectX::XMConvertToRadians((float)readValue<uint32_t>(Record + 56));
+		Frame.NoPerspective = (uint8_t)Record[60];
+
+		MaxFrame = std::max(MaxFrame, (float)Frame.FrameCount);
+
+		CameraKeyFrames.push_back(Frame);
+	}
+
+	auto Earlier = [](const CameraKeyFrame &a, const CameraKeyFrame &b) {
+		return a.FrameCount < b.FrameCount;
+	};
+	if (!std::is_sorted(CameraKeyFrames.begin(), CameraKeyFrames.end(), Earlier))
+		std::sort(CameraKeyFrames.begin(), CameraKeyFrames.end(), Earlier);
+
+	// The light and self shadow sections that may follow are not used
+	return true;
+}
+
+bool VMD::Motion::saveToFile(const std::wstring &FileName) const
+{
+	std::vector<char> Data;
+	Data.reserve(MagicSize + 20 + 5 * sizeof(uint32_t) + CameraKeyFrames.size() * CameraRecordSize);
+
+	auto append = [&Data](const void *Value, size_t Size) {
+		Data.insert(Data.end(), (const char*)Value, (const char*)Value + Size);
+	};
+	auto appendValue = [&append](uint32_t Value) {
+		append(&Value, sizeof(uint32_t));
+	};
+	// Names are padded with zeroes, longer ones are cut like MMD does
+	auto appendName = [&Data](const std::wstring &Name, size_t Size) {
+		std::string Encoded;
+		ShiftJIS::encode(Name, Encoded);
+		Encoded.resize(Size, '\0');
+		Data.insert(Data.end(), Encoded.begin(), Encoded.end());
+	};
+
+	static const char Magic[MagicSize] = "Vocaloid Motion Data 0002";
+	append(Magic, MagicSize);
+	appendName(ModelName, 20);
+
+	uint32_t Count = 0;
+	for (auto &Track : BoneTracks)
+		Count += (uint32_t)Track.KeyFrames.size();
+	appendValue(Count);
+
+	for (auto &Track : BoneTracks) {
+		for (auto &Frame : Track.KeyFrames) {
+			int8_t InterpolationData[64];
+			writeBoneInterpolationData(Frame, InterpolationData);
+
+			appendName(Track.BoneName, NameSize);
+			appendValue(Frame.FrameCount);
+			append(Frame.Translation, sizeof(Frame.Translation));
+			append(Frame.Rotation, sizeof(Frame.Rotation));
+			append(InterpolationData, sizeof(InterpolationData));
+		}
+	}
+
+	Count = 0;
+	for (auto &Track : MorphTracks)
+		Count += (uint32_t)Track.KeyFrames.size();
+	appendValue(Count);
+
+	for (auto &Track : MorphTracks) {
+		for (auto &Frame : Track.KeyFrames) {
+			appendName(Track.MorphName, NameSize);
+			appendValue(Frame.FrameCount);
+			append(&Frame.Weight, sizeof(float));
+		}
+	}
+
+	appendValue((uint32_t)CameraKeyFrames.size());
+	for (auto &Frame : CameraKeyFrames) {
+		int8_t InterpolationData[24];
+		writeCameraInterpolationData(Frame, InterpolationData);
+
+		float Position[3] = { Frame.Position.getX(), Frame.Position.getY(), Frame.Position.getZ() };
+
+		appendValue(Frame.FrameCount);
+		append(&Frame.Distance, sizeof(float));
+		append(Position, sizeof(Position));
+		append(Frame.EulerAngles, sizeof(Frame.EulerAngles));
+		append(InterpolationData, sizeof(InterpolationData));
+		appendValue((uint32_t)(DirectX::XMConvertToDegrees(Frame.FovAngle) + 0.5f));
+		append(&Frame.NoPerspective, sizeof(uint8_t));
+	}
+
+	// No light and self shadow key frames
+	appendValue(0);
+	appendValue(0);
+
+	boost::filesystem::ofstream Output(boost::filesystem::path(FileName), std::ios::binary | std::ios::trunc);
+	if (!Output.good())
+		return false;
+
+	Output.write(Data.data(), Data.size());
+	return Output.good();
+}
+
+bool VMD::Motion::parseCameraInterpolationData(CameraKeyFrame &Frame, const int8_t *InterpolationData)
+{
+	for (int i = 0; i < 6; ++i) {
+		if (!Curves.getCurve(InterpolationData[i * 4], InterpolationData[i * 4 + 2], InterpolationData[i * 4 + 1], InterpolationData[i * 4 + 3], Frame.Curves[i]))
+			return false;
+	}
+
+	return true;
+}
+
+void VMD::Motion::writeCameraInterpolationData(const CameraKeyFrame &Frame, int8_t *InterpolationData) const
+{
+	for (int i = 0; i < 6; ++i)
+		Curves.getControlPoints(Frame.Curves[i], InterpolationData[i * 4], InterpolationData[i * 4 + 2], InterpolationData[i * 4 + 1], InterpolationData[i * 4 + 3]);
+}
+
+bool VMD::Motion::parseBoneInterpolationData(BoneKeyFrame &Frame, const int8_t *InterpolationData)
+{
+	for (int i = 0; i < 4; ++i) {
+		if (!Curves.getCurve(InterpolationData[i], InterpolationData[i + 4], InterpolationData[i + 8], InterpolationData[i + 12], Frame.Curves[i]))
+			return false;
+	}
+
+	return true;
+}
+
+void VMD::Motion::writeBoneInterpolationData(const BoneKeyFrame &Frame, int8_t *InterpolationData) const
+{
+	for (int i = 0; i < 4; ++i)
+		Curves.getControlPoints(Frame.Curves[i], InterpolationData[i], InterpolationData[i + 4], InterpolationData[i + 8], InterpolationData[i + 12]);
+
+	// The remaining rows repeat the first one, each shifted by one more byte, as MMD writes them
+	for (int Row = 1; Row < 4; ++Row) {
+		for (int i = 0; i < 16; ++i)
+			InterpolationData[Row * 16 + i] = i + Row < 16 ? InterpolationData[i + Row] : (i + Row == 16 ? 1 : 0);
+	}
+}
@@ -25,35 +25,56 @@
 namespace VMD {
 
 	/// \brief Stores information about the bone animation
+	///
+	/// \remarks The bone name is stored once, in its BoneTrack
 	struct BoneKeyFrame
 	{
-		/// \brief The name of the bone to be animated
-		std::wstring BoneName;
-		/// \brief The amount of frames until the next keyframe
+		/// \brief The frame of the key
 		uint32_t FrameCount;
 		/// \brief The bone translation component
-		btVector3 Translation;
+		float Translation[3];
 		/// \brief The bone rotation component, a quaternion
-		btQuaternion Rotation;
-		/// \brief Bone interpolation data
-		std::vector<float> InterpolationData[4];
+		float Rotation[4];
+		/// \brief The interpolation curves of X, Y, Z and rotation, ids in the CurveTable of the motion
+		uint16_t Curves[4];
+
+		btVector3 getTranslation() const { return btVector3(Translation[0], Translation[1], Translation[2]); }
+		btQuaternion getRotation() const { return btQuaternion(Rotation[0], Rotation[1], Rotation[2], Rotation[3]); }
 	};
 
 	/// \brief Stores information about morph animations
+	///
+	/// \remarks The morph name is stored once, in its MorphTrack
 	struct MorphKeyFrame
 	{
-		/// \brief The name of the morph to be applied, Shift-JIS encoded
-		std::wstring MorphName;
-		/// \brief The amount of frames until the next keyframe
+		/// \brief The frame of the key
 		uint32_t FrameCount;
 		/// \brief The weight of the morph to be applied
 		float Weight;
 	};
 
+	/// \brief Stores every key frame of a single bone, sorted by frame
+	struct BoneTrack
+	{
+		/// \brief The name of the bone to be animated
+		std::wstring BoneName;
+		/// \brief The key frames of the bone
+		std::vector<BoneKeyFrame> KeyFrames;
+	};
+
+	/// \brief Stores every key frame of a single morph, sorted by frame
+	struct MorphTrack
+	{
+		/// \brief The name of the morph to be applied
+		std::wstring MorphName;
+		/// \brief The key frames of the morph
+		std::vector<MorphKeyFrame> KeyFrames;
+	};
+
 	/// \brief Stores information about camera movement
 	struct CameraKeyFrame
 	{
-		/// \brief The amount of frames until the next keyframe
+		/// \brief The frame of the key
 		uint32_t FrameCount;
 		/// \brief The distance of the camera to the focal point
 		float Distance;
@@ -61,8 +82,12 @@ namespace VMD {
 		btVector3 Position;
 		/// \brief Rotation around the focal point
 		btQuaternion Rotation;
-		/// \brief Animation interpolation data
-		std::vector<float> InterpolationData[6];
+		/// \brief The Euler angles of the rotation as read from the file, written back as they are
+		///
+		/// \remarks Converting Rotation back would wrap the angles, losing spins of more than a turn
+		float EulerAngles[3];
+		/// \brief The interpolation curves of X, Y, Z, rotation, distance and field of view
+		uint16_t Curves[6];
 		/// \brief Field of View angle, in radians
 		float FovAngle;
 		/// \brief Use or not orthogonal projection